@@ -0,0 +1,109 @@
+#!/bin/bash
+
+# Benchmark spidey in each concurrency mode against the bundled www tree, and
+# write the throughput and latency of each workload (at each concurrency) as
+# JSON.  Run from the top of the repository (ie. make bench).
+#
+# Environment:
+#   BENCH_MODES         Concurrency modes   (single forking event prefork threaded)
+#   BENCH_WORKLOADS     Workloads           (small large browse cgi notfound mixed)
+#   BENCH_CONCURRENCY   Hammers of thor     (1 16 128)
+#   BENCH_SECONDS       Seconds per run     (2)
+#   BENCH_KEEPALIVE     Use keep-alive (1) or a connection per request (0)
+#   BENCH_OUTPUT        Results file        (bench.json)
+#   BENCH_BASELINE      Compare results to this file (see bin/bench_compare.py)
+
+SPIDEY=bin/spidey
+THOR=bin/thor
+MODES=${BENCH_MODES:-single forking event prefork threaded}
+WORKLOADS=${BENCH_WORKLOADS:-small large browse cgi notfound mixed}
+CONCURRENCY=${BENCH_CONCURRENCY:-1 16 128}
+SECONDS_PER_RUN=${BENCH_SECONDS:-2}
+KEEPALIVE=${BENCH_KEEPALIVE:-0}
+OUTPUT=${BENCH_OUTPUT:-bench.json}
+PORT=$((20000 + RANDOM % 10000))
+SERVER=
+
+# Functions
+
+cleanup() {
+    [ -n "$SERVER" ] && kill $SERVER 2> /dev/null && wait $SERVER 2> /dev/null
+    SERVER=
+}
+
+workload_paths() {
+    case $1 in
+	small)	  echo "/text/hackers.txt";;
+	large)	  echo "/images/a.png";;
+	browse)	  echo "/";;
+	cgi)	  echo "/scripts/env.sh";;
+	notfound) echo "/asdf";;
+	mixed)	  echo "/text/hackers.txt /images/a.png / /scripts/env.sh /asdf";;
+	*)	  echo "Unknown workload: $1" 1>&2; return 1;;
+    esac
+}
+
+start_server() {
+    $SPIDEY -c $1 -p $PORT -r www 2> /dev/null &
+    SERVER=$!
+    for attempt in $(seq 50); do
+	if (exec 3<> /dev/tcp/localhost/$PORT) 2> /dev/null; then
+	    return 0
+	fi
+	sleep 0.1
+    done
+    echo "Unable to start $SPIDEY in $1 mode" 1>&2
+    return 1
+}
+
+# Main execution
+
+trap "cleanup; exit 1" INT TERM
+trap "cleanup" EXIT
+
+for program in $SPIDEY $THOR; do
+    if [ ! -x $program ]; then
+	echo "Missing $program (run make first)" 1>&2
+	exit 1
+    fi
+done
+
+THOR_FLAGS="-j -d $SECONDS_PER_RUN"
+[ "$KEEPALIVE" = 1 ] && THOR_FLAGS="$THOR_FLAGS -k"
+
+{
+    printf '{\n'
+    printf '  "commit": "%s",\n' "$(git rev-parse --short HEAD 2> /dev/null)"
+    printf '  "date": "%s",\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    printf '  "host": "%s",\n' "$(uname -n)"
+    printf '  "cpus": %d,\n' "$(nproc)"
+    printf '  "seconds": %s,\n' "$SECONDS_PER_RUN"
+    printf '  "keepalive": %s,\n' "$([ "$KEEPALIVE" = 1 ] && echo true || echo false)"
+    printf '  "results": [\n'
+} > $OUTPUT
+
+separator=""
+for mode in $MODES; do
+    start_server $mode || exit 1
+    for workload in $WORKLOADS; do
+	urls=$(for path in $(workload_paths $workload); do echo "localhost:$PORT$path"; done)
+	for hammers in $CONCURRENCY; do
+	    result=$($THOR $THOR_FLAGS -h $hammers $urls)
+	    [ -z "$result" ] && result=null
+	    printf "%-9s %-9s %4d  %s\n" $mode $workload $hammers "$result" 1>&2
+	    printf '%s    {"mode": "%s", "workload": "%s", "concurrency": %d, "result": %s}' \
+		"$separator" $mode $workload $hammers "$result" >> $OUTPUT
+	    separator=$',\n'
+	done
+    done
+    cleanup
+done
+
+printf '\n  ]\n}\n' >> $OUTPUT
+echo "Results written to $OUTPUT" 1>&2
+
+if [ -n "$BENCH_BASELINE" ]; then
+    bin/bench_compare.py $BENCH_BASELINE $OUTPUT
+fi
+
+# vim: set sts=4 sw=4 ts=8 ft=sh:
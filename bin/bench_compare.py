@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+
+import json
+import os
+import sys
+
+# Functions
+
+def usage(status=0):
+    progname = os.path.basename(sys.argv[0])
+    print(f'''Usage: {progname} [-t PERCENT -l PERCENT] BASELINE CURRENT
+    -t  PERCENT     Flag throughput drops larger than this (10)
+    -l  PERCENT     Flag p99 latency increases larger than this (20)
+
+Compare benchmark results written by bin/bench.sh (make bench).''')
+    sys.exit(status)
+
+def load_results(path):
+    ''' Load benchmark results from path.
+
+    Return dictionary mapping (mode, workload, concurrency) to result.
+    '''
+    with open(path) as stream:
+        data = json.load(stream)
+
+    return {
+        (r['mode'], r['workload'], r['concurrency']): r['result']
+        for r in data['results'] if r['result']
+    }
+
+def compare(baseline, current, throughput, latency):
+    ''' Compare current results to baseline results.
+
+    - baseline:     Baseline results (see load_results)
+    - current:      Current results
+    - throughput:   Largest acceptable drop of requests/s (percent)
+    - latency:      Largest acceptable increase of p99 latency (percent)
+
+    Return number of regressions.
+    '''
+    regressions = 0
+
+    print(f'{"MODE":9} {"WORKLOAD":9} {"HAMMERS":>7} {"RPS":>10} {"CHANGE":>8} {"P99 US":>10} {"CHANGE":>8}')
+    for key in sorted(current):
+        if key not in baseline:
+            continue
+
+        old, new = baseline[key], current[key]
+        rps      = percent_change(old['rps'], new['rps'])
+        p99      = percent_change(old['p99_us'], new['p99_us'])
+        flags    = []
+
+        if rps < -throughput:
+            flags.append('THROUGHPUT')
+        if p99 > latency:
+            flags.append('LATENCY')
+        if new['errors'] > old['errors']:
+            flags.append('ERRORS')
+        regressions += bool(flags)
+
+        mode, workload, hammers = key
+        print(f'{mode:9} {workload:9} {hammers:7} {new["rps"]:10.1f} {rps:+7.1f}% '
+              f'{new["p99_us"]:10.1f} {p99:+7.1f}% {" ".join(flags)}')
+
+    print(f'\n{regressions} regressions')
+    return regressions
+
+def percent_change(old, new):
+    ''' Return change from old to new in percent. '''
+    if not old:
+        return 0.0 if not new else 100.0
+    return (new - old) / old * 100.0
+
+def main():
+    throughput = 10.0
+    latency    = 20.0
+    arguments  = sys.argv[1:]
+
+    # Parse command line arguments
+    while arguments and arguments[0].startswith('-'):
+        argument = arguments.pop(0)
+        if argument == '-t' and arguments:
+            throughput = float(arguments.pop(0))
+        elif argument == '-l' and arguments:
+            latency = float(arguments.pop(0))
+        elif argument == '-h':
+            usage(0)
+        else:
+            usage(1)
+
+    if len(arguments) != 2:
+        usage(1)
+
+    baseline = load_results(arguments[0])
+    current  = load_results(arguments[1])
+    sys.exit(1 if compare(baseline, current, throughput, latency) else 0)
+
+# Main execution
+
+if __name__ == '__main__':
+    main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -37,7 +37,7 @@ check_md5sum() {
 
 check_header() {
     status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n')
-    content=$(awk '/Content/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    content=$(awk 'tolower($1) == "content-type:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
     if [ "$status" != "$1" ]; then
 	echo "FAILURE: $status != $1" > $WORKSPACE/test
 	return 1;
@@ -115,7 +115,7 @@ printf "\n %-64s ... \n" "Handle Browse Requests"
 
 printf "     %-60s ... " "/"
 HREFS="/..,/html,/images,/scripts,/song.txt,/text"
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/ > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all ".. html scripts text" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
@@ -149,7 +149,7 @@ fi
 sleep 1
 
 printf "     %-60s ... " "/scripts"
-HREFS="/scripts/..,/scripts/cowsay.sh,/scripts/env.sh,/scripts/hello.py"
+HREFS="/scripts/..,/scripts/cowsay.sh,/scripts/env.sh,/scripts/hello.py,/scripts/hello.worker"
 curl -s -D $WORKSPACE/header $HOST:$PORT/scripts > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all ".. cowsay.sh env.sh" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
     error "Failure"
@@ -177,13 +177,46 @@ else
     echo "Success"
 fi
 
+sleep 1
+
+printf "     %-60s ... " "/text?offset=0&limit=2"
+HREFS="/text/..,/text/hackers.txt,/text?offset=2&limit=2"
+curl -s -D $WORKSPACE/header "$HOST:$PORT/text?offset=0&limit=2" > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "hackers.txt rel=.next" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/text?offset=2&limit=2"
+HREFS="/text/lyrics.txt,/text/pass"
+curl -s -D $WORKSPACE/header "$HOST:$PORT/text?offset=2&limit=2" > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "lyrics.txt pass" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/text?offset=3&limit=0"
+HREFS="/text/pass"
+curl -s -D $WORKSPACE/header "$HOST:$PORT/text?offset=3&limit=0" > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "pass" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
 # ------------------------------------------------------------------------------
 
 printf "\n %-64s ... \n" "Handle File Requests"
 
 printf "     %-60s ... " "/html/index.html"
 MD5SUM=36fcc1da4afe58242350ee3940bb4220
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "Spidey html thumbnail" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
@@ -289,9 +322,149 @@ sleep 1
 
 # ------------------------------------------------------------------------------
 
+printf "\n %-64s ... \n" "Handle Range Requests"
+
+printf "     %-60s ... " "/song.txt (Range: bytes=0-9)"
+MD5SUM=bb7402f7e29e0f732b352f6b458faf94
+STATUS="HTTP/1.1 206 Partial Content"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header -r 0-9 $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! grep_all "Content-Range:.bytes.0-9/227 Vary:.Accept-Encoding" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/song.txt (Range: bytes=1000-)"
+STATUS="HTTP/1.1 416 Range Not Satisfiable"
+CONTENT="text/html"
+curl -s -D $WORKSPACE/header -r 1000- $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "416" $WORKSPACE/test || ! grep_all "Content-Range:.bytes.[*]/227 Vary:.Accept-Encoding" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Conditional Requests"
+
+printf "     %-60s ... " "/song.txt (If-None-Match: ETag)"
+MD5SUM=d41d8cd98f00b204e9800998ecf8427e
+STATUS="HTTP/1.1 304 Not Modified"
+curl -s -D $WORKSPACE/header -o /dev/null $HOST:$PORT/song.txt
+ETAG=$(awk 'tolower($1) == "etag:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+curl -s -D $WORKSPACE/header -H "If-None-Match: $ETAG" $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! grep_all "ETag" $WORKSPACE/header || ! check_header "$STATUS" ""; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/song.txt (If-None-Match: other)"
+MD5SUM=d073749ecc174b560cded952656a4f57
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header -H 'If-None-Match: "other"' $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Compression"
+
+printf "     %-60s ... " "/text/hackers.txt (Accept-Encoding: gzip)"
+MD5SUM=c77059544e187022e19b940d0c55f408
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header -H "Accept-Encoding: gzip" $HOST:$PORT/text/hackers.txt | gunzip -c > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! grep_all "Content-Encoding:.gzip Vary:.Accept-Encoding" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/text/hackers.txt (Accept-Encoding: br, gzip;q=0.5)"
+curl -s -D $WORKSPACE/header -o /dev/null -H "Accept-Encoding: br, gzip;q=0.5" $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "Content-Encoding:.(br|gzip) Vary:.Accept-Encoding" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/text/hackers.txt (Accept-Encoding: gzip;q=0)"
+curl -s -D $WORKSPACE/header -H "Accept-Encoding: gzip;q=0" $HOST:$PORT/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || grep -q -i "Content-Encoding" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Persistent Connections"
+
+printf "     %-60s ... " "Keep-Alive (/song.txt, /song.txt)"
+MD5SUM=126f05feb572bc8379e212223a40b3b5
+curl -s -w "%{num_connects}\n" -o /dev/null -o /dev/null $HOST:$PORT/song.txt $HOST:$PORT/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "Pipelining (/song.txt, /text/hackers.txt)"
+printf "GET /song.txt HTTP/1.1\r\nHost: $HOST\r\n\r\nGET /text/hackers.txt HTTP/1.1\r\nHost: $HOST\r\nConnection: close\r\n\r\n" | nc $HOST $PORT |& tee $WORKSPACE/test > /dev/null
+if ! check_status $? 0 || ! grep_count "^HTTP/1.1.200" 2 || ! grep_all "Right Mentor" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Metrics"
+
+printf "     %-60s ... " "/_spidey/stats"
+METRICS="spidey_connections_accepted_total spidey_responses_total.code=.200 spidey_request_duration_seconds_bucket"
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain;"
+curl -s -D $WORKSPACE/header $HOST:$PORT/_spidey/stats > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "$METRICS" $WORKSPACE/test || ! grep_all "Cache-Control:.no-store" $WORKSPACE/header || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+# ------------------------------------------------------------------------------
+
 printf "\n %-64s ... \n" "Handle CGI Requests"
 
 printf "     %-60s ... " "/scripts/env.sh"
+STATUS="HTTP/1.0 200 OK"
 CONTENT="text/plain"
 HEADERS="DOCUMENT_ROOT QUERY_STRING REMOTE_ADDR REMOTE_PORT REQUEST_METHOD REQUEST_URI SCRIPT_FILENAME SERVER_PORT HTTP_HOST HTTP_USER_AGENT"
 curl -s -D $WORKSPACE/header $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
@@ -303,6 +476,16 @@ fi
 
 sleep 1
 
+printf "     %-60s ... " "/scripts/env.sh (POST)"
+curl -s -D $WORKSPACE/header -d "message=hi" $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "REQUEST_METHOD=POST CONTENT_LENGTH=10" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
 printf "     %-60s ... " "/scripts/cowsay.sh"
 MD5SUM=ddc37544d37e4ff1ca8c43eae6ff0f9d
 CONTENT="text/html"
@@ -363,12 +546,34 @@ fi
 
 sleep 1
 
+printf "     %-60s ... " "/scripts/hello.worker?user=pparker"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header "$HOST:$PORT/scripts/hello.worker?user=pparker" > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "Hello query=user=pparker body=0" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/scripts/hello.worker?user=pparker (POST)"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header -d "message=hi" "$HOST:$PORT/scripts/hello.worker?user=pparker" > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "Hello query=user=pparker body=10" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
 # ------------------------------------------------------------------------------
 
 printf "\n %-64s ... \n" "Handle Errors"
 
 printf "     %-60s ... " "/asdf"
-STATUS="HTTP/1.0 404 Not Found"
+STATUS="HTTP/1.1 404 Not Found"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/asdf > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
@@ -379,6 +584,45 @@ fi
 
 sleep 1
 
+printf "     %-60s ... " "/../../etc/passwd"
+curl -s -D $WORKSPACE/header --path-as-is $HOST:$PORT/../../etc/passwd > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/%2e%2e/%2e%2e/etc/passwd"
+curl -s -D $WORKSPACE/header --path-as-is $HOST:$PORT/%2e%2e/%2e%2e/etc/passwd > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
+printf "     %-60s ... " "/escape/secret.txt (symlink outside root)"
+mkdir $WORKSPACE/root $WORKSPACE/outside
+echo secret > $WORKSPACE/outside/secret.txt
+ln -s ../outside $WORKSPACE/root/escape
+./bin/spidey -r $WORKSPACE/root -p $((PORT + 1)) -c single > /dev/null 2>&1 &
+ESCAPE=$!
+sleep 1
+curl -s -D $WORKSPACE/header localhost:$((PORT + 1))/escape/secret.txt > $WORKSPACE/test
+RESULT=$?
+kill $ESCAPE
+wait $ESCAPE 2> /dev/null
+if ! check_status $RESULT 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 1
+
 printf "     %-60s ... " "Bad Request"
 STATUS="HTTP/1.0 400 Bad Request"
 CONTENT="text/html"
@@ -3,15 +3,19 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /* Constants */
 
-#define WHITESPACE	" \t\n"
+#define WHITESPACE	" \t\r\n"
 
 /**
  * Concurrency modes
@@ -19,6 +23,9 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    EVENT,                              /**< Event-driven (epoll) connections */
+    PREFORK,                            /**< Pool of pre-forked workers */
+    THREADED,                           /**< Pool of worker threads */
     UNKNOWN
 } ServerMode;
 
@@ -28,72 +35,495 @@ extern char *Port;                      /**< Port number */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern size_t Workers;                  /**< Number of prefork workers (0 = CPUs) */
+extern size_t WorkerRequests;           /**< Requests per worker (0 = unlimited) */
+extern size_t Threads;                  /**< Number of worker threads (0 = CPUs) */
+extern int KeepAliveTimeout;            /**< Idle seconds before closing connection */
+extern size_t FileCacheSize;            /**< Number of cached files (0 = disabled) */
+extern size_t ContentCacheSize;         /**< Bytes of cached content (0 = disabled) */
+extern size_t CompressCacheSize;        /**< Bytes of compressed content (0 = disabled) */
+extern size_t CGIWorkers;               /**< Persistent workers per script (0 = disabled) */
+extern size_t CGICacheSize;             /**< Bytes of cached CGI output (0 = disabled) */
+extern char *AccessLogPath;             /**< Path to access log ("-" = stderr, NULL = none) */
+extern size_t AccessSampling;           /**< Log one in this many requests (0 = none) */
+extern char *TracePath;                 /**< Path to trace file (NULL = none) */
+extern size_t TraceSampling;            /**< Trace one in this many requests (0 = none) */
+
+/* Logging */
+
+typedef enum {
+    LOG_ERROR,                          /**< Server messages (stderr) */
+    LOG_ACCESS,                         /**< Access log */
+    LOG_TRACE,                          /**< Trace file (binary TraceRecords) */
+    LOG_CHANNELS
+} LogChannel;
+
+void        logger_write(const char *level, const char *file, int line, const char *format, ...)
+            __attribute__((format(printf, 4, 5)));
 
 /* Logging Macros */
 
 #ifdef NDEBUG
 #define debug(M, ...)
 #else
-#define debug(M, ...)   fprintf(stderr, "[%5d] DEBUG %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
+#define debug(M, ...)   logger_write("DEBUG", __FILE__, __LINE__, M, ##__VA_ARGS__)
 #endif
 
-#define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
-#define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
+#define fatal(M, ...)   logger_write("FATAL", __FILE__, __LINE__, M, ##__VA_ARGS__); exit(EXIT_FAILURE)
+#define log(M, ...)     logger_write("LOG  ", __FILE__, __LINE__, M, ##__VA_ARGS__)
+
+/* Cache */
+
+typedef struct cache_entry CacheEntry;
+struct cache_entry {
+    char        *key;                   /*< Key of entry */
+    void        *data;                  /*< Data of entry */
+    size_t       size;                  /*< Size charged against cache budget */
+    size_t       hash;                  /*< Hash of key */
+    size_t       refs;                  /*< Number of references held by users */
+    bool         linked;                /*< Whether entry is still in cache */
+    CacheEntry  *chain;                 /*< Next entry in hash bucket */
+    CacheEntry  *prev;                  /*< Previous (more recently used) entry */
+    CacheEntry  *next;                  /*< Next (less recently used) entry */
+};
+
+typedef struct {
+    size_t          hits;               /*< Number of successful lookups */
+    size_t          misses;             /*< Number of failed lookups */
+    size_t          evictions;          /*< Number of entries evicted */
+} CacheCounters;
+
+typedef struct {
+    pthread_mutex_t lock;               /*< Protects all fields and entries */
+    CacheEntry    **buckets;            /*< Hash table of entries */
+    size_t          nbuckets;           /*< Number of buckets (power of two) */
+    CacheEntry     *head;               /*< Most recently used entry */
+    CacheEntry     *tail;               /*< Least recently used entry */
+    size_t          count;              /*< Number of entries */
+    size_t          capacity;           /*< Maximum number of entries */
+    size_t          bytes;              /*< Total size of entries */
+    size_t          budget;             /*< Maximum total size (0 = no limit) */
+    CacheCounters   local;              /*< Counters of unshared cache */
+    CacheCounters  *counters;           /*< Counters (local, or shared with stats_cache) */
+    void          (*destroy)(void *data); /*< Function to free entry data */
+} Cache;
+
+void        cache_init(Cache *cache, size_t capacity, size_t budget, void (*destroy)(void *data));
+CacheEntry *cache_entry(Cache *cache, const char *key, void *data, size_t size);
+CacheEntry *cache_get(Cache *cache, const char *key);
+CacheEntry *cache_put(Cache *cache, const char *key, void *data, size_t size);
+void        cache_release(Cache *cache, CacheEntry *entry);
+void        cache_purge(Cache *cache, bool (*match)(void *data, void *arg), void *arg);
+
+/* Coalesced cache misses (see flight_begin) */
+
+typedef struct flight Flight;
+
+typedef struct {
+    pthread_mutex_t lock;               /*< Protects flights */
+    Flight         *flights;            /*< Flights in progress */
+} FlightGroup;
+
+#define FLIGHT_GROUP_INITIALIZER    {PTHREAD_MUTEX_INITIALIZER, NULL}
+
+bool        flight_begin(FlightGroup *group, const char *key, Flight **flight);
+void        flight_finish(FlightGroup *group, Flight *flight);
+
+/* Content Encodings */
+
+typedef enum {
+    ENCODING_IDENTITY = 0,              /**< Uncompressed */
+    ENCODING_GZIP,                      /**< gzip (zlib) */
+    ENCODING_BROTLI,                    /**< br (only compressed on the fly with HAVE_BROTLI) */
+    ENCODING_COUNT
+} Encoding;
+
+/* File Cache */
+
+typedef struct {
+    char        *path;                  /*< Real path of file */
+    struct stat  st;                    /*< Status of file */
+    bool         executable;            /*< Whether file is a CGI script */
+    const char  *mimetype;              /*< Mimetype of file */
+    size_t       generation;            /*< Mimetypes generation of mimetype */
+    int          fd;                    /*< Open descriptor for regular files (or -1) */
+    int         *wds;                   /*< Inotify watches of RootPath and directories on path */
+    size_t       nwds;                  /*< Number of inotify watches (0 if uncacheable) */
+    size_t       hits;                  /*< Number of requests for file */
+    bool         compressible;          /*< Whether to compress file on the fly */
+    int          sidecars[ENCODING_COUNT]; /*< Precompressed variants (or -1) */
+    off_t        sidecar_sizes[ENCODING_COUNT]; /*< Sizes of precompressed variants */
+    char         etag[64];              /*< Entity tag (without quotes) */
+    char         last_modified[32];     /*< Modification time as HTTP date */
+} FileInfo;
+
+CacheEntry *filecache_lookup(const char *uri);
+void        filecache_release(CacheEntry *entry);
+
+/* Content Cache */
+
+typedef struct {
+    char            *headers;           /*< Pre-rendered Content-Type and Length */
+    size_t           headers_length;    /*< Length of headers */
+    char            *body;              /*< Contents of file */
+    size_t           length;            /*< Length of body */
+    off_t            size;              /*< Size of file when loaded */
+    ino_t            ino;               /*< Inode of file when loaded */
+    struct timespec  mtime;             /*< Modification time of file when loaded */
+    size_t           generation;        /*< Mimetypes generation of headers */
+} Content;
+
+CacheEntry *contentcache_lookup(FileInfo *info);
+void        contentcache_release(CacheEntry *entry);
+
+/* Arena */
+
+typedef struct arena_block ArenaBlock;
+
+typedef struct {
+    char        *data;                  /*< Storage (or NULL until taken from chunk pool) */
+    size_t       size;                  /*< Size of storage */
+    size_t       used;                  /*< Bytes of storage allocated */
+    ArenaBlock  *overflow;              /*< Malloc'd blocks past storage */
+    bool         pooled;                /*< Whether storage is a pooled chunk (returned on reset) */
+} Arena;
+
+typedef struct {
+    size_t  requests_allocated;         /*< Request structs malloc'd */
+    size_t  requests_recycled;          /*< Request structs reused from pool */
+    size_t  arena_allocs;               /*< Arena allocations */
+    size_t  arena_overflows;            /*< Overflow blocks malloc'd */
+    size_t  arena_resets;               /*< Arena resets */
+    size_t  arena_chunks;               /*< Pooled storage chunks malloc'd */
+} AllocationStats;
+
+extern AllocationStats Allocations;
+
+void        arena_init(Arena *a, char *data, size_t size);
+void *      arena_alloc(Arena *a, size_t size);
+char *      arena_strdup(Arena *a, const char *s);
+void        arena_reset(Arena *a);
+void        arena_report(int signum);
+void        arena_refresh();
 
 /* HTTP Request */
 
-typedef struct header Header;
-struct header {
+typedef enum {
+    HTTP_STATUS_OK = 0,			/* 200 OK */
+    HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
+    HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
+    HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_HEADERS_TOO_LARGE,	/* 431 Request Header Fields Too Large */
+    HTTP_STATUS_PARTIAL_CONTENT,	/* 206 Partial Content */
+    HTTP_STATUS_RANGE_NOT_SATISFIABLE,	/* 416 Range Not Satisfiable */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
+    HTTP_STATUS_REQUEST_TIMEOUT,	/* 408 Request Timeout */
+    HTTP_STATUS_NOT_IMPLEMENTED,	/* 501 Not Implemented */
+    HTTP_STATUS_GATEWAY_TIMEOUT,	/* 504 Gateway Timeout */
+} Status;
+
+#define REQUEST_MAX_HEADERS 64
+#define REQUEST_ARENA_SIZE  (16*1024)
+#define REQUEST_POOL_SIZE   64
+#define REQUEST_HEADER_TIMEOUT  10      /* Seconds allowed to send a request header */
+#define CGI_TIMEOUT             30      /* Seconds a script may take to read its body, produce captured output, or stall streamed output */
+
+typedef struct {
     char    *name;                      /*< Name of header entry */
     char    *data;                      /*< Data of header entry */
-    Header  *next;                      /*< Next header entry */
-};
+} Header;
+
+/**
+ * Headers recorded in Request.known when parsed (must match KnownHeaders)
+ */
+typedef enum {
+    HEADER_HOST,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_RANGE,
+    HEADER_IF_RANGE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_COUNT
+} KnownHeader;
+
+typedef struct offload Offload;
+typedef struct output_segment OutputSegment;
 
 typedef struct {
     int     fd;                         /*< Client socket file descripter */
-    FILE    *stream;                    /*< Client socket file stream */
+    FILE    *stream;                    /*< Client socket file stream (only while handling requests, see open_request) */
     char    *method;                    /*< HTTP method */
     char    *uri;                       /*< HTTP uniform resource identifier */
     char    *path;                      /*< Real path corrsponding to URI and RootPath */
+    CacheEntry *file;                   /*< File cache entry (FileInfo) of path */
     char    *query;                     /*< HTTP query string */
+    int      version;                   /*< HTTP minor version (1.0 or 1.1) */
+    bool     keep_alive;                /*< Whether to keep connection open */
+    size_t   sent;                      /*< Bytes written to client socket */
+    bool     deferred;                  /*< Whether to queue output instead of waiting for the socket (see transmit_resume) */
+    OutputSegment *pending;             /*< Output queued until the socket is writable */
+    OutputSegment *pending_last;        /*< Last segment of queued output */
+    bool   (*offload)(Offload *offload);/*< Hands blocking handlers to another thread (or NULL, see handle_request) */
+    uint64_t accepted;                  /*< Time connection was accepted (0 = untraced, see trace_now) */
+
+    struct sockaddr_storage address;    /*< Address of client */
+    char     host[INET6_ADDRSTRLEN];    /*< Address of client as text (formatted by request_host) */
+    char     port[NI_MAXSERV];          /*< Port number of client as text (see request_port) */
 
-    char     host[NI_MAXHOST];          /*< Host name of client */
-    char     port[NI_MAXSERV];          /*< Port number of client */
+    Header   headers[REQUEST_MAX_HEADERS]; /*< Name, data Header pairs (in buffer) */
+    size_t   nheaders;                  /*< Number of headers */
+    const char *known[HEADER_COUNT];    /*< Data of known headers (or NULL) */
+    char    *body;                      /*< Buffered part of request body (in buffer) */
+    size_t   body_length;               /*< Length of buffered part of body */
+    size_t   content_length;            /*< Length of complete request body */
 
-    Header  *headers;                   /*< List of name, data Header pairs */
+    char     buffer[BUFSIZ];            /*< Data read from client socket */
+    size_t   offset;                    /*< Offset of unconsumed data in buffer */
+    size_t   length;                    /*< Length of valid data in buffer */
+    size_t   scanned;                   /*< Offset searched for end of header */
+    time_t   started;                   /*< Time pending header began arriving (0 = none, see request_expired) */
+
+    Arena    arena;                     /*< Allocations for current request (storage pooled, see arena_init) */
+    char    *output;                    /*< Buffer of client socket stream (pooled, see idle_request) */
 } Request;
 
 Request *   accept_request(int sfd);
 void	    free_request(Request *request);
-int	    parse_request(Request *request);
+void	    reset_request(Request *request);
+bool        open_request(Request *request);
+bool        idle_request(Request *request);
+ssize_t     fill_request(Request *request, bool block);
+int         check_request(Request *request);
+bool	    wait_request(Request *request, int timeout);
+bool        request_expired(Request *request);
+Status	    parse_request(Request *request);
+const char *request_header(Request *request, const char *name);
+const char *request_host(Request *request);
+const char *request_port(Request *request);
 
-/* HTTP Request Handlers */
+/* Directory Listings */
 
-typedef enum {
-    HTTP_STATUS_OK = 0,			/* 200 OK */
-    HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
-    HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
-    HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
-} Status;
+#define LISTING_MAX_SORTED  10000       /* Larger directories are streamed unsorted */
+
+typedef struct {
+    int      fd;                        /*< Directory file descriptor */
+    size_t   offset;                    /*< Offset of next entry in buffer */
+    size_t   length;                    /*< Length of entries in buffer */
+    char     buffer[4 * BUFSIZ] __attribute__((aligned(8))); /*< Entries from getdents64 */
+} ListingReader;
+
+typedef struct {
+    Content  content;                   /*< Rendered listing of all entries */
+    char    *uri;                       /*< URI the links are relative to */
+    char   **names;                     /*< Sorted names of entries */
+    size_t   count;                     /*< Number of entries */
+} Listing;
+
+bool        listing_open(ListingReader *reader, const char *path);
+const char *listing_next(ListingReader *reader);
+void        listing_close(ListingReader *reader);
+int         listing_item(char *buffer, size_t size, const char *uri, const char *name);
+Listing *   listing_render(const char *uri, const FileInfo *info, char **names, size_t count);
+CacheEntry *listing_lookup(const char *uri, const FileInfo *info);
+CacheEntry *listing_store(const FileInfo *info, Listing *listing);
+void        listing_release(CacheEntry *entry);
+
+/* CGI */
+
+char *      cgi_environment(Request *request, size_t *length);
+bool        cgi_is_worker(const char *path);
+Status      cgi_request(Request *request);
+
+/* CGI Cache */
+
+typedef struct {
+    char            *output;            /*< Output of script (status, headers, and body) */
+    size_t           length;            /*< Length of output */
+    char            *vary;              /*< Request headers output depends on (or NULL) */
+    time_t           expires;           /*< Time at which output becomes stale */
+    bool             cacheable;         /*< Whether output may be reused */
+    ino_t            ino;               /*< Inode of script when run */
+    struct timespec  mtime;             /*< Modification time of script when run */
+} CGIResponse;
+
+size_t      cgicache_limit();
+CacheEntry *cgicache_lookup(Request *request, Flight **flight);
+void        cgicache_store(Request *request, Flight *flight, const char *output, size_t length, bool complete);
+void        cgicache_release(CacheEntry *entry);
+Status      cgi_worker_request(Request *request);
+
+/* Compression */
+
+extern const char *EncodingNames[];
+extern const char *EncodingSuffixes[];
+
+bool        compress_compressible(const char *mimetype);
+bool        compress_varies(const FileInfo *info);
+Encoding    compress_negotiate(Request *request, const FileInfo *info);
+CacheEntry *compress_lookup(FileInfo *info, Encoding encoding);
+void        compress_release(CacheEntry *entry);
+
+/* Byte Ranges */
+
+#define RANGE_MAX   16                  /* Ranges honored per request */
+
+typedef struct {
+    off_t   offset;                     /*< Offset of first byte */
+    off_t   length;                     /*< Number of bytes */
+} ByteRange;
+
+int         range_parse(const char *header, off_t size, ByteRange *ranges, size_t capacity);
+
+/* Validators */
+
+void        validators_init(FileInfo *info);
+int         validators_render(char *buffer, size_t size, const FileInfo *info, Encoding encoding);
+bool        validators_not_modified(Request *request, const FileInfo *info, Encoding encoding);
+bool        validators_if_range(Request *request, const FileInfo *info);
+
+/* HTTP Request Handlers */
 
 Status      handle_request(Request *request);
+size_t      handle_connection(Request *request);
+void        handle_offload(Offload *offload);
 
 /* HTTP Server */
 
 int         single_server(int sfd);
 int         forking_server(int sfd);
+int         event_server(int sfd);
+int         prefork_server();
+int         threaded_server(int sfd);
+
+/* Transmission */
+
+ssize_t     transmit_file(Request *request, int fd, off_t offset, size_t count);
+ssize_t     transmit_stream(Request *request, int fd, size_t count);
+ssize_t     transmit_iov(Request *request, struct iovec *iov, int iovcnt);
+ssize_t     transmit_write(void *cookie, const char *buffer, size_t size);
+size_t      transmit_sent(Request *request);
+int         transmit_resume(Request *request);
+void        transmit_discard(Request *request);
+
+/* Logger */
+
+bool        logger_start();
+void        logger_flush();
+void        logger_wake();
+void        logger_synchronous();
+void        logger_queue(LogChannel channel, const char *data, size_t length);
+bool        logger_sample();
+void        logger_access(Request *request, Status status, const struct timespec *started, size_t bytes);
+
+/* Metrics */
+
+#define STATS_URI   "/_spidey/stats"
+
+typedef enum {
+    STATS_BROWSE,                       /**< handle_browse_request */
+    STATS_FILE,                         /**< handle_file_request */
+    STATS_CGI,                          /**< handle_cgi_request */
+    STATS_WORKER,                       /**< handle_worker_request */
+    STATS_ERROR,                        /**< handle_error (without another handler) */
+    STATS_STATS,                        /**< handle_stats_request */
+    STATS_HANDLERS
+} StatsHandler;
+
+typedef enum {
+    STATS_CACHE_FILE,                   /**< File cache */
+    STATS_CACHE_CONTENT,                /**< Hot content cache */
+    STATS_CACHE_COMPRESSED,             /**< Compressed content cache */
+    STATS_CACHE_LISTING,                /**< Directory listing cache */
+    STATS_CACHE_CGI,                    /**< CGI response cache */
+    STATS_CACHES
+} StatsCache;
+
+void        stats_init();
+CacheCounters *stats_cache(StatsCache cache);
+void        stats_connection(bool opened);
+void        stats_request(StatsHandler handler, Status status, const struct timespec *started, size_t bytes);
+char *      stats_render(size_t *length);
+
+/* Tracing */
+
+#define TRACE_MAGIC "SPDYTRC2"
+
+typedef enum {
+    TRACE_ACCEPT,                       /**< accept returned (origin of first request) */
+    TRACE_STREAM,                       /**< Client stream opened */
+    TRACE_PARSE,                        /**< parse_request returned */
+    TRACE_PATH,                         /**< determine_request_path returned */
+    TRACE_STAT,                         /**< stat (and access) returned */
+    TRACE_MIMETYPE,                     /**< determine_mimetype returned */
+    TRACE_FIRST_BYTE,                   /**< First write to client socket */
+    TRACE_LAST_BYTE,                    /**< Handler returned */
+    TRACE_PHASES
+} TracePhase;
+
+typedef struct {
+    char        magic[8];               /**< TRACE_MAGIC */
+    uint32_t    phases;                 /**< TRACE_PHASES */
+    uint32_t    size;                   /**< sizeof(TraceRecord) */
+} TraceHeader;
+
+typedef struct {
+    uint64_t    started;                /**< Start of request (CLOCK_MONOTONIC nanoseconds) */
+    uint32_t    phases[TRACE_PHASES];   /**< Nanoseconds from start to end of each phase */
+    uint32_t    pid;                    /**< Process that handled request */
+    uint16_t    code;                   /**< HTTP status code of response */
+    uint8_t     reached;                /**< Bitmask of phases reached */
+    uint8_t     handler;                /**< StatsHandler of request */
+} TraceRecord;
+
+extern __thread TraceRecord *TraceCurrent;
+
+/* Probe points (USDT probes, if systemtap's sys/sdt.h is available) */
+
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name)   DTRACE_PROBE(spidey, name)
+#else
+#define TRACE_PROBE(name)
+#endif
+
+/* Mark end of phase (ie. trace_mark(PARSE)) in sampled request, and fire probe */
+#define trace_mark(name)    do { \
+    TRACE_PROBE(name); \
+    if (TraceCurrent) trace_record(TraceCurrent, TRACE_##name); \
+} while (0)
+
+uint64_t    trace_now();
+bool        trace_header(int fd);
+TraceRecord *trace_begin(Request *request, TraceRecord *record);
+void        trace_record(TraceRecord *record, TracePhase phase);
+void        trace_end(TraceRecord *record, Status status, StatsHandler handler);
+
+/* MIME Types */
+
+bool        mimetypes_load(const char *path);
+const char *mimetypes_lookup(const char *extension);
+void        mimetypes_reload(int signum);
+void        mimetypes_refresh();
+size_t      mimetypes_generation();
 
 /* Socket */
 
-int	    socket_listen(const char *port);
+int	    socket_listen(const char *port, bool shared);
+bool        socket_available(const char *port);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
-char *	    determine_mimetype(const char *path);
+const char *determine_mimetype(const char *path);
 char *	    determine_request_path(const char *uri);
+bool        normalize_uri(const char *uri, char *buffer, size_t size);
+int         open_request_path(const char *path, int flags);
+char *      request_path(const char *path);
 const char *http_status_string(Status status);
 char *	    skip_nonwhitespace(char *s);
 char *	    skip_whitespace(char *s);
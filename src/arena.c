@@ -0,0 +1,243 @@
+/* arena.c: Per-Request Arena Allocator */
+
+#include "spidey.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+/* Constants */
+
+#define ARENA_ALIGNMENT     (sizeof(void *) * 2)
+#define ARENA_MIN_BLOCK     (4 * 1024)  /* Smallest overflow block */
+#define ARENA_POOL_SIZE     64          /* Free chunks kept for reuse */
+
+/* Global Variables */
+
+AllocationStats Allocations = {0};
+
+static volatile sig_atomic_t Report = 0;
+
+/* Free storage chunks of pooled arenas (linked through their first bytes) */
+static void           *Chunks     = NULL;
+static size_t          ChunkCount = 0;
+static pthread_mutex_t ChunkLock  = PTHREAD_MUTEX_INITIALIZER;
+
+/* Overflow block (allocated when the arena's own storage is exhausted) */
+
+struct arena_block {
+    ArenaBlock *next;                   /*< Previous (smaller) overflow block */
+    size_t      size;                   /*< Size of storage */
+    size_t      used;                   /*< Bytes of storage allocated */
+    char        data[] __attribute__((aligned(16))); /*< Storage */
+};
+
+/**
+ * Initialize arena over caller provided or pooled storage.
+ *
+ * @param   a           Arena structure.
+ * @param   data        Initial storage (or NULL to use a pooled chunk).
+ * @param   size        Size of initial storage.
+ *
+ * A pooled arena holds no storage until its first allocation, when a chunk
+ * of size bytes is taken from a shared free list, and gives it back on
+ * reset.  So a request only holds its arena while it is being handled, not
+ * while its connection is idle.  All pooled arenas must use the same size.
+ **/
+void arena_init(Arena *a, char *data, size_t size) {
+    a->data     = data;
+    a->size     = size;
+    a->used     = 0;
+    a->overflow = NULL;
+    a->pooled   = !data;
+}
+
+/**
+ * Take storage chunk for pooled arena from the free list (or malloc it).
+ *
+ * @param   a           Arena structure.
+ * @return  Whether or not the arena has storage.
+ **/
+static bool arena_take(Arena *a) {
+    pthread_mutex_lock(&ChunkLock);
+    if ((a->data = Chunks)) {
+        Chunks = *(void **)Chunks;
+        ChunkCount--;
+    }
+    pthread_mutex_unlock(&ChunkLock);
+
+    if (!a->data && (a->data = malloc(a->size))) {
+        __atomic_add_fetch(&Allocations.arena_chunks, 1, __ATOMIC_RELAXED);
+    }
+    return a->data != NULL;
+}
+
+/**
+ * Return storage chunk of pooled arena to the free list (or free it).
+ *
+ * @param   a           Arena structure.
+ **/
+static void arena_give(Arena *a) {
+    void *chunk = a->data;
+
+    a->data = NULL;
+    pthread_mutex_lock(&ChunkLock);
+    if (ChunkCount < ARENA_POOL_SIZE) {
+        *(void **)chunk = Chunks;
+        Chunks = chunk;
+        ChunkCount++;
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&ChunkLock);
+
+    free(chunk);
+}
+
+/**
+ * Carve aligned memory out of storage by bumping its offset.
+ *
+ * @param   data        Storage.
+ * @param   size        Size of storage.
+ * @param   used        Bytes of storage allocated (advanced on success).
+ * @param   length      Number of bytes to allocate.
+ * @return  Pointer to memory, or NULL if it does not fit.
+ **/
+static void *arena_bump(char *data, size_t size, size_t *used, size_t length) {
+    size_t aligned = (*used + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    if (aligned > size || length > size - aligned) {
+        return NULL;
+    }
+    *used = aligned + length;
+    return data + aligned;
+}
+
+/**
+ * Allocate memory from arena.
+ *
+ * @param   a           Arena structure.
+ * @param   size        Number of bytes to allocate.
+ * @return  Pointer to (uninitialized) memory, or NULL on failure.
+ *
+ * Allocations are carved out of the arena's storage by bumping an offset.
+ * When it is exhausted, they are carved out of malloc'd overflow blocks the
+ * same way; each new block is at least twice as large as the previous one
+ * (or the arena's own storage), so a large request only mallocs a handful of
+ * times.  Overflow blocks are freed on the next reset.  Memory is never
+ * released individually.
+ **/
+void *arena_alloc(Arena *a, size_t size) {
+    void *p;
+
+    __atomic_add_fetch(&Allocations.arena_allocs, 1, __ATOMIC_RELAXED);
+
+    if (a->pooled && !a->data && !arena_take(a)) {
+        return NULL;
+    }
+
+    if ((p = arena_bump(a->data, a->size, &a->used, size))) {
+        return p;
+    }
+
+    ArenaBlock *block = a->overflow;
+    if (block && (p = arena_bump(block->data, block->size, &block->used, size))) {
+        return p;
+    }
+
+    size_t capacity = block ? block->size * 2 : a->size * 2;
+    if (capacity < ARENA_MIN_BLOCK) {
+        capacity = ARENA_MIN_BLOCK;
+    }
+    if (capacity < size) {
+        capacity = size;
+    }
+
+    if (!(block = malloc(sizeof(ArenaBlock) + capacity))) {
+        return NULL;
+    }
+    __atomic_add_fetch(&Allocations.arena_overflows, 1, __ATOMIC_RELAXED);
+
+    block->next = a->overflow;
+    block->size = capacity;
+    block->used = size;
+    a->overflow = block;
+    return block->data;
+}
+
+/**
+ * Duplicate string into arena.
+ *
+ * @param   a           Arena structure.
+ * @param   s           String to duplicate.
+ * @return  Copy of string, or NULL on failure.
+ **/
+char *arena_strdup(Arena *a, const char *s) {
+    size_t length = strlen(s) + 1;
+    char  *copy   = arena_alloc(a, length);
+    if (copy) {
+        memcpy(copy, s, length);
+    }
+    return copy;
+}
+
+/**
+ * Release all allocations from arena.
+ *
+ * @param   a           Arena structure.
+ *
+ * Caller provided storage is kept for reuse and a pooled chunk goes back to
+ * the free list; overflow blocks are freed.
+ **/
+void arena_reset(Arena *a) {
+    while (a->overflow) {
+        ArenaBlock *next = a->overflow->next;
+        free(a->overflow);
+        a->overflow = next;
+    }
+    if (a->pooled && a->data) {
+        arena_give(a);
+    }
+    a->used = 0;
+
+    __atomic_add_fetch(&Allocations.arena_resets, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Schedule report of allocation counters (SIGUSR1 handler).
+ *
+ * @param   signum      Signal number (unused).
+ *
+ * Formatting is not async-signal-safe, so the report is written by the next
+ * arena_refresh (ie. from the logger's writer thread, which is woken up).
+ **/
+void arena_report(int signum) {
+    Report = 1;
+    logger_wake();
+}
+
+/**
+ * Report allocation counters on stderr if a report was scheduled.
+ **/
+void arena_refresh() {
+    if (!Report || !__atomic_exchange_n(&Report, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    char buffer[BUFSIZ];
+    int  length = snprintf(buffer, sizeof(buffer),
+        "[%5d] ALLOCATIONS requests_allocated=%zu requests_recycled=%zu "
+        "arena_allocs=%zu arena_overflows=%zu arena_resets=%zu arena_chunks=%zu\n",
+        getpid(),
+        __atomic_load_n(&Allocations.requests_allocated, __ATOMIC_RELAXED),
+        __atomic_load_n(&Allocations.requests_recycled,  __ATOMIC_RELAXED),
+        __atomic_load_n(&Allocations.arena_allocs,       __ATOMIC_RELAXED),
+        __atomic_load_n(&Allocations.arena_overflows,    __ATOMIC_RELAXED),
+        __atomic_load_n(&Allocations.arena_resets,       __ATOMIC_RELAXED),
+        __atomic_load_n(&Allocations.arena_chunks,       __ATOMIC_RELAXED));
+
+    if (length > 0 && write(STDERR_FILENO, buffer, length) < 0) {
+        return;
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
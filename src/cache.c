@@ -0,0 +1,435 @@
+/* cache.c: Bounded LRU Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Constants */
+
+#define CACHE_MIN_BUCKETS   64          /* Must be a power of two */
+
+/* Requests waiting for the leader of a cache miss (see flight_begin) */
+struct flight {
+    char            *key;               /*< Key being produced */
+    bool             done;              /*< Whether the leader has finished */
+    size_t           refs;              /*< Leader and waiting requests */
+    pthread_cond_t   finished;          /*< Signalled when the leader finishes */
+    Flight          *next;              /*< Next flight of group */
+};
+
+/**
+ * Hash cache key (FNV-1a).
+ *
+ * @param   key         Key string.
+ * @return  Hash of key.
+ **/
+static size_t cache_hash(const char *key) {
+    size_t hash = 2166136261u;
+    for (; *key; key++) {
+        hash ^= (unsigned char)*key;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Destroy cache entry (and its data).
+ *
+ * @param   c           Cache structure.
+ * @param   e           Cache entry.
+ **/
+static void cache_destroy(Cache *c, CacheEntry *e) {
+    if (c->destroy) {
+        c->destroy(e->data);
+    }
+    free(e);
+}
+
+/**
+ * Unlink entry from hash table and LRU list (caller must hold lock).
+ *
+ * @param   c           Cache structure.
+ * @param   e           Cache entry.
+ *
+ * The entry is destroyed immediately if nobody holds a reference to it,
+ * otherwise when the last reference is released.
+ **/
+static void cache_unlink(Cache *c, CacheEntry *e) {
+    CacheEntry **link = &c->buckets[e->hash & (c->nbuckets - 1)];
+    while (*link != e) {
+        link = &(*link)->chain;
+    }
+    *link = e->chain;
+
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        c->head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        c->tail = e->prev;
+    }
+
+    c->count--;
+    c->bytes -= e->size;
+    e->linked = false;
+
+    if (!e->refs) {
+        cache_destroy(c, e);
+    }
+}
+
+/**
+ * Move entry to front of LRU list (caller must hold lock).
+ *
+ * @param   c           Cache structure.
+ * @param   e           Cache entry.
+ **/
+static void cache_touch(Cache *c, CacheEntry *e) {
+    if (c->head == e) {
+        return;
+    }
+
+    /* Unlink from current position */
+    if (e->prev) {
+        e->prev->next = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else if (c->tail == e) {
+        c->tail = e->prev;
+    }
+
+    /* Insert at head */
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head) {
+        c->head->prev = e;
+    }
+    c->head = e;
+    if (!c->tail) {
+        c->tail = e;
+    }
+}
+
+/**
+ * Double the number of hash buckets (caller must hold lock).
+ *
+ * @param   c           Cache structure.
+ **/
+static void cache_grow(Cache *c) {
+    size_t       nbuckets = c->nbuckets * 2;
+    CacheEntry **buckets  = calloc(nbuckets, sizeof(CacheEntry *));
+    if (!buckets) {
+        return;
+    }
+
+    for (size_t i = 0; i < c->nbuckets; i++) {
+        CacheEntry *e = c->buckets[i];
+        while (e) {
+            CacheEntry *chain = e->chain;
+            e->chain = buckets[e->hash & (nbuckets - 1)];
+            buckets[e->hash & (nbuckets - 1)] = e;
+            e = chain;
+        }
+    }
+
+    free(c->buckets);
+    c->buckets  = buckets;
+    c->nbuckets = nbuckets;
+}
+
+/**
+ * Initialize cache.
+ *
+ * @param   c           Cache structure.
+ * @param   capacity    Maximum number of entries (0 disables caching).
+ * @param   budget      Maximum total size of entries in bytes (0 = no limit).
+ * @param   destroy     Function to free entry data (or NULL).
+ *
+ * Entries are evicted in least recently used order whenever either limit is
+ * exceeded.  All operations are protected by the cache's mutex, so a cache
+ * may be shared between threads.  Lookups and evictions are counted in
+ * c->counters, which may be pointed at shared counters (see stats_cache).
+ **/
+void cache_init(Cache *c, size_t capacity, size_t budget, void (*destroy)(void *data)) {
+    memset(c, 0, sizeof(Cache));
+    pthread_mutex_init(&c->lock, NULL);
+    c->capacity = capacity;
+    c->budget   = budget;
+    c->destroy  = destroy;
+    c->counters = &c->local;
+    c->nbuckets = CACHE_MIN_BUCKETS;
+    c->buckets  = calloc(c->nbuckets, sizeof(CacheEntry *));
+    if (!c->buckets) {
+        c->capacity = 0;
+    }
+}
+
+/**
+ * Lookup entry in cache.
+ *
+ * @param   c           Cache structure.
+ * @param   key         Key string.
+ * @return  Entry with a reference held for the caller (or NULL if missing).
+ *
+ * The returned entry must be released with cache_release.
+ **/
+CacheEntry *cache_get(Cache *c, const char *key) {
+    if (!c->capacity) {
+        return NULL;
+    }
+
+    size_t hash = cache_hash(key);
+
+    pthread_mutex_lock(&c->lock);
+    CacheEntry *e = c->buckets[hash & (c->nbuckets - 1)];
+    while (e && (e->hash != hash || !streq(e->key, key))) {
+        e = e->chain;
+    }
+
+    if (e) {
+        e->refs++;
+        cache_touch(c, e);
+        __atomic_add_fetch(&c->counters->hits, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&c->counters->misses, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return e;
+}
+
+/**
+ * Allocate cache entry that is not linked into the cache.
+ *
+ * @param   c           Cache structure.
+ * @param   key         Key string (copied).
+ * @param   data        Data to store (owned by the entry from now on).
+ * @param   size        Size of data.
+ * @return  Entry with a reference held for the caller (or NULL on error, in
+ * which case data has been destroyed).
+ *
+ * The entry is destroyed as soon as it is released, which lets callers
+ * handle data that should not be cached the same way as cached data.
+ **/
+CacheEntry *cache_entry(Cache *c, const char *key, void *data, size_t size) {
+    size_t      keylen = strlen(key);
+    CacheEntry *e      = calloc(1, sizeof(CacheEntry) + keylen + 1);
+    if (!e) {
+        if (c->destroy) {
+            c->destroy(data);
+        }
+        return NULL;
+    }
+
+    e->key  = (char *)(e + 1);
+    e->data = data;
+    e->size = size;
+    e->hash = cache_hash(key);
+    e->refs = 1;
+    memcpy(e->key, key, keylen + 1);
+    return e;
+}
+
+/**
+ * Insert data into cache (replacing any existing entry with the same key).
+ *
+ * @param   c           Cache structure.
+ * @param   key         Key string (copied).
+ * @param   data        Data to store (owned by the cache from now on).
+ * @param   size        Size of data charged against the budget.
+ * @return  Entry with a reference held for the caller (or NULL on error, in
+ * which case data has been destroyed).
+ *
+ * If the cache is disabled or the data is larger than the whole budget, the
+ * returned entry is not linked into the cache (see cache_entry).
+ **/
+CacheEntry *cache_put(Cache *c, const char *key, void *data, size_t size) {
+    CacheEntry *e = cache_entry(c, key, data, size);
+    if (!e || !c->capacity || (c->budget && size > c->budget)) {
+        return e;
+    }
+
+    pthread_mutex_lock(&c->lock);
+
+    /* Replace existing entry */
+    for (CacheEntry *old = c->buckets[e->hash & (c->nbuckets - 1)]; old; old = old->chain) {
+        if (old->hash == e->hash && streq(old->key, key)) {
+            cache_unlink(c, old);
+            break;
+        }
+    }
+
+    /* Evict least recently used entries until there is room */
+    while (c->tail && (c->count + 1 > c->capacity || (c->budget && c->bytes + size > c->budget))) {
+        __atomic_add_fetch(&c->counters->evictions, 1, __ATOMIC_RELAXED);
+        cache_unlink(c, c->tail);
+    }
+
+    /* Link new entry */
+    if (c->count + 1 > c->nbuckets) {
+        cache_grow(c);
+    }
+    size_t bucket = e->hash & (c->nbuckets - 1);
+    e->chain = c->buckets[bucket];
+    c->buckets[bucket] = e;
+
+    e->next = c->head;
+    if (c->head) {
+        c->head->prev = e;
+    }
+    c->head = e;
+    if (!c->tail) {
+        c->tail = e;
+    }
+
+    c->count++;
+    c->bytes += size;
+    e->linked = true;
+    pthread_mutex_unlock(&c->lock);
+
+    return e;
+}
+
+/**
+ * Release reference to cache entry.
+ *
+ * @param   c           Cache structure.
+ * @param   e           Cache entry (may be NULL).
+ *
+ * Entries that have been evicted or invalidated are destroyed once their
+ * last reference is released.
+ **/
+void cache_release(Cache *c, CacheEntry *e) {
+    if (!e) {
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    bool destroy = --e->refs == 0 && !e->linked;
+    pthread_mutex_unlock(&c->lock);
+
+    if (destroy) {
+        cache_destroy(c, e);
+    }
+}
+
+/**
+ * Remove entries whose data matches a predicate.
+ *
+ * @param   c           Cache structure.
+ * @param   match       Predicate (or NULL to remove every entry).
+ * @param   arg         Argument passed to predicate.
+ **/
+void cache_purge(Cache *c, bool (*match)(void *data, void *arg), void *arg) {
+    if (!c->capacity) {
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    CacheEntry *e = c->head;
+    while (e) {
+        CacheEntry *next = e->next;
+        if (!match || match(e->data, arg)) {
+            cache_unlink(c, e);
+        }
+        e = next;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Free flight.
+ *
+ * @param   f           Flight (no longer referenced).
+ **/
+static void flight_free(Flight *f) {
+    pthread_cond_destroy(&f->finished);
+    free(f->key);
+    free(f);
+}
+
+/**
+ * Coalesce cache miss with others for the same key.
+ *
+ * @param   g           Flight group (one per cache).
+ * @param   key         Key that missed.
+ * @param   flight      Set to flight to finish with flight_finish if the
+ *                      caller leads (NULL if it could not be allocated).
+ * @return  true if the caller should produce the data for key (and store it
+ * in the cache before finishing its flight), or false if another request
+ * already did, in which case this waited for it to finish and the cache
+ * should be looked up again.
+ *
+ * A leader should look up the cache once more after this returns, since a
+ * previous leader may have finished between its miss and this call.
+ **/
+bool flight_begin(FlightGroup *g, const char *key, Flight **flight) {
+    pthread_mutex_lock(&g->lock);
+    Flight *f = g->flights;
+    while (f && !streq(f->key, key)) {
+        f = f->next;
+    }
+
+    if (f) {
+        f->refs++;
+        while (!f->done) {
+            pthread_cond_wait(&f->finished, &g->lock);
+        }
+        bool last = --f->refs == 0;
+        pthread_mutex_unlock(&g->lock);
+        if (last) {
+            flight_free(f);
+        }
+        *flight = NULL;
+        return false;
+    }
+
+    f = calloc(1, sizeof(Flight));
+    if (f && !(f->key = strdup(key))) {
+        free(f);
+        f = NULL;
+    }
+    if (f) {
+        f->refs = 1;
+        pthread_cond_init(&f->finished, NULL);
+        f->next    = g->flights;
+        g->flights = f;
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    *flight = f;
+    return true;
+}
+
+/**
+ * Finish flight, waking up all requests waiting for it.
+ *
+ * @param   g           Flight group.
+ * @param   f           Flight returned by flight_begin (may be NULL).
+ **/
+void flight_finish(FlightGroup *g, Flight *f) {
+    if (!f) {
+        return;
+    }
+
+    pthread_mutex_lock(&g->lock);
+    Flight **link = &g->flights;
+    while (*link != f) {
+        link = &(*link)->next;
+    }
+    *link   = f->next;
+    f->done = true;
+    pthread_cond_broadcast(&f->finished);
+    bool last = --f->refs == 0;
+    pthread_mutex_unlock(&g->lock);
+    if (last) {
+        flight_free(f);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
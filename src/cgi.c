@@ -0,0 +1,853 @@
+/* cgi.c: CGI Scripts and Persistent CGI Workers */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Persistent workers are CGI scripts that stay running between requests.
+ * Each worker is started with SPIDEY_WORKER=1 and the PassedVariables of the
+ * server as its environment, and a UNIX stream socket as both its stdin and
+ * stdout, over which it handles one request at a time:
+ *
+ *  server -> worker:   uint32 length (network order), then that many bytes
+ *                      of NAME=VALUE\0 pairs (the CGI environment), then
+ *                      CONTENT_LENGTH bytes of request body (if set)
+ *  worker -> server:   uint32 length (network order), then that many bytes
+ *                      of output (exactly what a CGI script would print)
+ *
+ * A worker must read the whole request before it responds, and must do
+ * either within CGI_TIMEOUT seconds, otherwise it is stopped.  A worker exits
+ * when its socket is closed.  When workers are disabled (or in forking mode)
+ * the script is run as ordinary CGI, without SPIDEY_WORKER (see
+ * www/scripts/hello.worker for a script that handles both).
+ */
+
+/* Constants */
+
+#define CGI_PENDING     (1024 * 1024)   /* Bytes of output buffered while the body is written */
+
+/* Server environment variables passed on to CGI scripts */
+static const char *PassedVariables[] = {
+    "PATH",
+    "LANG",
+    "TZ",
+    NULL,
+};
+
+/* Global Variables */
+
+extern char **environ;
+
+typedef struct cgi_worker CGIWorker;
+struct cgi_worker {
+    pid_t        pid;                   /*< Process ID of worker */
+    int          fd;                    /*< Socket connected to worker */
+    CGIWorker   *next;                  /*< Next idle worker */
+};
+
+typedef struct cgi_pool CGIPool;
+struct cgi_pool {
+    char            *path;              /*< Path of worker script */
+    CGIWorker       *idle;              /*< Idle workers */
+    size_t           count;             /*< Number of running workers */
+    pthread_cond_t   available;         /*< Signalled when a worker becomes idle */
+    CGIPool         *next;              /*< Next pool */
+};
+
+static CGIPool          *Pools    = NULL;
+static pthread_mutex_t   PoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Build CGI environment of request.
+ *
+ * @param   r           Request structure.
+ * @param   length      Set to length of environment block.
+ * @return  Environment block of NAME=VALUE\0 pairs (in the request arena),
+ * or NULL on failure.
+ *
+ * This includes the standard request variables (CONTENT_LENGTH and
+ * CONTENT_TYPE only if the request has a body), and an HTTP_ variable for
+ * each request header (ie. User-Agent becomes HTTP_USER_AGENT):
+ * http://en.wikipedia.org/wiki/Common_Gateway_Interface
+ **/
+char *cgi_environment(Request *r, size_t *length) {
+    const char *variables[][2] = {
+        {"QUERY_STRING",    r->query},
+        {"DOCUMENT_ROOT",   RootPath},
+        {"REMOTE_ADDR",     request_host(r)},
+        {"REMOTE_PORT",     request_port(r)},
+        {"REQUEST_METHOD",  r->method},
+        {"REQUEST_URI",     r->uri},
+        {"SCRIPT_FILENAME", r->path},
+        {"SERVER_PORT",     Port},
+        {"CONTENT_LENGTH",  r->known[HEADER_CONTENT_LENGTH]},
+        {"CONTENT_TYPE",    request_header(r, "Content-Type")},
+    };
+    size_t nvariables = sizeof(variables) / sizeof(variables[0]);
+
+    /* Determine size of block */
+    size_t size = 0;
+    for (size_t i = 0; i < nvariables; i++) {
+        if (variables[i][1]) {
+            size += strlen(variables[i][0]) + 1 + strlen(variables[i][1]) + 1;
+        }
+    }
+    for (size_t i = 0; i < r->nheaders; i++) {
+        size += strlen("HTTP_") + strlen(r->headers[i].name) + 1 + strlen(r->headers[i].data) + 1;
+    }
+
+    char *block = arena_alloc(&r->arena, size);
+    if (!block) {
+        return NULL;
+    }
+
+    /* Fill block */
+    char *p = block;
+    for (size_t i = 0; i < nvariables; i++) {
+        if (variables[i][1]) {
+            p += sprintf(p, "%s=%s", variables[i][0], variables[i][1]) + 1;
+        }
+    }
+    for (size_t i = 0; i < r->nheaders; i++) {
+        p = stpcpy(p, "HTTP_");
+        for (const char *n = r->headers[i].name; *n; n++, p++) {
+            *p = *n == '-' ? '_' : toupper((unsigned char)*n);
+        }
+        p += sprintf(p, "=%s", r->headers[i].data) + 1;
+    }
+
+    *length = size;
+    return block;
+}
+
+/**
+ * Build environment array of CGI script.
+ *
+ * @param   r           Request structure.
+ * @return  NULL terminated array of NAME=VALUE strings (in the request arena),
+ * or NULL on failure.
+ *
+ * This holds the CGI environment of the request and the PassedVariables of
+ * the server, and nothing else, so no state leaks between requests and the
+ * server's own environment is never modified.
+ **/
+static char **cgi_envp(Request *r) {
+    size_t length;
+    char  *block = cgi_environment(r, &length);
+    if (!block) {
+        return NULL;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < length; i++) {
+        count += block[i] == '\0';
+    }
+    for (const char **name = PassedVariables; *name; name++) {
+        count++;
+    }
+
+    char **envp = arena_alloc(&r->arena, (count + 1) * sizeof(char *));
+    if (!envp) {
+        return NULL;
+    }
+
+    char **e = envp;
+    for (char *p = block; p < block + length; p += strlen(p) + 1) {
+        *e++ = p;
+    }
+    for (const char **name = PassedVariables; *name; name++) {
+        const char *value = getenv(*name);
+        size_t      size  = strlen(*name) + 1 + (value ? strlen(value) : 0) + 1;
+        if (value && (*e = arena_alloc(&r->arena, size))) {
+            sprintf(*e++, "%s=%s", *name, value);
+        }
+    }
+    *e = NULL;
+    return envp;
+}
+
+/**
+ * Start script with posix_spawn.
+ *
+ * @param   path        Path of script.
+ * @param   input       Descriptor to use as stdin (or -1 for /dev/null).
+ * @param   output      Descriptor to use as stdout.
+ * @param   envp        Environment of script.
+ * @return  Process ID of script (or -1 on failure, with errno set).
+ *
+ * The script is started directly (no shell, and with vfork semantics, so the
+ * server's memory is never copied) with its own environment array, which
+ * makes it safe to start scripts concurrently from threads.  Every other
+ * descriptor is closed, so scripts do not hold client or listening sockets
+ * open, and signals the server ignores are restored.
+ **/
+static pid_t cgi_exec(char *path, int input, int output, char **envp) {
+    /* Wire up stdin and stdout, and close every other descriptor */
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (input >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, input, STDIN_FILENO);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    }
+    posix_spawn_file_actions_adddup2(&actions, output, STDOUT_FILENO);
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+
+    /* Restore signals the server ignores (ie. SIGCHLD in forking mode) */
+    posix_spawnattr_t attributes;
+    sigset_t          defaults;
+    posix_spawnattr_init(&attributes);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGCHLD);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+
+    pid_t  pid;
+    char  *argv[] = {path, NULL};
+    int    status = posix_spawn(&pid, path, &actions, &attributes, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Start CGI script for request.
+ *
+ * @param   r           Request structure.
+ * @param   input       Set to write end of script's stdin (non-blocking), or
+ *                      -1 if the request has no body.
+ * @param   output      Set to read end of script's stdout (non-blocking).
+ * @return  Process ID of script (or -1 on failure).
+ *
+ * The script is started by cgi_exec with the environment of the request.
+ * The request body (if any) is written to the script's stdin by cgi_capture.
+ **/
+static pid_t cgi_start(Request *r, int *input, int *output) {
+    char **envp = cgi_envp(r);
+    if (!envp) {
+        return -1;
+    }
+
+    int out[2] = {-1, -1};
+    int in[2]  = {-1, -1};
+    if (pipe2(out, O_CLOEXEC) < 0 || fcntl(out[0], F_SETFL, O_NONBLOCK) < 0 ||
+        (r->content_length && (pipe2(in, O_CLOEXEC) < 0 || fcntl(in[1], F_SETFL, O_NONBLOCK) < 0))) {
+        goto fail;
+    }
+
+    pid_t pid = cgi_exec(r->path, in[0], out[1], envp);
+    if (pid < 0) {
+        goto fail;
+    }
+
+    close(out[1]);
+    if (in[0] >= 0) {
+        close(in[0]);
+    }
+
+    *input  = in[1];
+    *output = out[0];
+    return pid;
+
+fail:
+    log("Unable to start %s: %s", r->path, strerror(errno));
+    for (int i = 0; i < 2; i++) {
+        if (out[i] >= 0) {
+            close(out[i]);
+        }
+        if (in[i] >= 0) {
+            close(in[i]);
+        }
+    }
+    return -1;
+}
+
+/**
+ * Return milliseconds left until deadline.
+ *
+ * @param   deadline    Deadline (CLOCK_MONOTONIC).
+ * @return  Milliseconds left (0 once the deadline has passed).
+ **/
+static int cgi_remaining(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long remaining = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return remaining > 0 ? remaining : 0;
+}
+
+/**
+ * Write request body to CGI script and read its output into memory.
+ *
+ * @param   r           Request structure.
+ * @param   input       Write end of script's stdin (non-blocking, closed
+ *                      here), or -1 if the request has no body.
+ * @param   output      Read end of script's stdout (non-blocking).
+ * @param   buffer      Set to newly allocated output (or NULL).
+ * @param   length      Set to length of output.
+ * @param   limit       Maximum length of output to read.
+ * @return  1 if the complete output was read, 0 if the output is larger than
+ * the limit or the script has input (the rest is still in the pipe), or -1
+ * on error (errno is ETIMEDOUT if the script did not finish within
+ * CGI_TIMEOUT seconds).
+ *
+ * The body and the output are exchanged in one poll loop, so a script that
+ * writes output before it has read all its input cannot deadlock with the
+ * server.  The buffered part of the body is written first, and the rest is
+ * relayed from the client socket.  If the script has input, output is only
+ * read until the whole body is written, and whenever the limit is reached,
+ * the output so far is sent to the client to make room.  If the body cannot
+ * be written in full (ie. the client hangs up), this fails rather than let
+ * the script see a short body.  A script that exits or closes its stdin
+ * early simply does not get the rest.
+ **/
+static int cgi_capture(Request *r, int input, int output, char **buffer, size_t *length, size_t limit) {
+    size_t          capacity = 0;
+    const char     *pending  = r->body;
+    size_t          npending = input >= 0 ? r->body_length : 0;
+    size_t          left     = input >= 0 ? r->content_length - r->body_length : 0;
+    bool            capture  = input < 0;
+    bool            ended    = false;
+    char            chunk[BUFSIZ];
+    struct timespec deadline;
+    int             result   = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += CGI_TIMEOUT;
+
+    *buffer = NULL;
+    *length = 0;
+    while (true) {
+        /* Whole body written: close stdin, and stop unless capturing */
+        if (input >= 0 && npending == 0 && left == 0) {
+            close(input);
+            input = -1;
+        }
+        if (!capture && input < 0) {
+            result = ended;
+            break;
+        }
+
+        /* Grow output buffer (or stop reading once it holds the limit) */
+        if (*length == capacity && capacity <= limit) {
+            capacity = capacity ? capacity * 2 : BUFSIZ;
+            capacity = capacity < limit + 1 ? capacity : limit + 1;
+            char *grown = realloc(*buffer, capacity);
+            if (!grown) {
+                break;
+            }
+            *buffer = grown;
+        }
+        if (*length == capacity && capture) {
+            result = 0;
+            break;
+        }
+        if (*length == capacity) {
+            struct iovec iov = {*buffer, *length};
+            if (transmit_iov(r, &iov, 1) < 0) {
+                break;
+            }
+            *length = 0;
+        }
+
+        /* Wait for output, room in stdin, or more of the body */
+        struct pollfd pfds[2] = {{.fd = -1}, {.fd = -1}};
+        if (*length < capacity && !ended) {
+            pfds[0] = (struct pollfd){.fd = output, .events = POLLIN};
+        }
+        if (npending) {
+            pfds[1] = (struct pollfd){.fd = input, .events = POLLOUT};
+        } else if (left) {
+            pfds[1] = (struct pollfd){.fd = r->fd, .events = POLLIN};
+        }
+
+        int status;
+        while ((status = poll(pfds, 2, cgi_remaining(&deadline))) < 0 && errno == EINTR);
+        if (status == 0) {
+            errno = ETIMEDOUT;
+        }
+        if (status <= 0) {
+            break;
+        }
+
+        /* Read output */
+        if (pfds[0].revents) {
+            ssize_t n = read(output, *buffer + *length, capacity - *length);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                break;
+            }
+            if (n == 0 && capture) {
+                result = 1;
+                break;
+            }
+            ended    = n == 0;
+            *length += n > 0 ? n : 0;
+        }
+
+        /* Write body to stdin (dropping the rest if the script closed it) */
+        if (pfds[1].revents && npending) {
+            ssize_t n = write(input, pending, npending);
+            if (n < 0 && errno == EPIPE) {
+                npending = left = 0;
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                break;
+            } else if (n > 0) {
+                pending  += n;
+                npending -= n;
+            }
+        } else if (pfds[1].revents) {
+            ssize_t n = recv(r->fd, chunk, left < sizeof(chunk) ? left : sizeof(chunk), MSG_DONTWAIT);
+            if (n == 0) {
+                errno = ECONNRESET;
+                break;
+            }
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                break;
+            }
+            if (n > 0) {
+                pending  = chunk;
+                npending = n;
+                left    -= n;
+            }
+        }
+    }
+
+    if (input >= 0) {
+        close(input);
+    }
+    return result;
+}
+
+/**
+ * Run CGI script for request.
+ *
+ * @param   r           Request structure.
+ * @return  HTTP_STATUS_OK if the response was produced, otherwise the status
+ * to respond with (nothing has been sent to the client).
+ *
+ * Output the script allows to be cached (see cgicache.c) is sent from the
+ * CGI response cache.  Otherwise the script is started (see cgi_start), and
+ * its output is either read into memory to offer it to the cache, or spliced
+ * from the pipe into the client socket.  If the request has a body, output is
+ * buffered (up to CGI_PENDING bytes at a time) until the body has been
+ * written, so a failure to deliver the body can usually still be answered
+ * with an error.
+ *
+ * Output read into memory must be complete within CGI_TIMEOUT seconds, since
+ * other requests for it wait meanwhile, and a body must be read by the
+ * script within the same time.  Otherwise the script is killed and the
+ * request fails with HTTP_STATUS_GATEWAY_TIMEOUT (and any waiting requests
+ * run the script themselves).  Spliced output may take as long as the script
+ * likes, but a script that produces nothing for CGI_TIMEOUT seconds is killed
+ * too (see transmit_stream), as is one whose client went away.
+ **/
+Status cgi_request(Request *r) {
+    Flight     *flight;
+    CacheEntry *entry = cgicache_lookup(r, &flight);
+    if (entry) {
+        CGIResponse *response = entry->data;
+        struct iovec iov      = {response->output, response->length};
+        if (transmit_iov(r, &iov, 1) < 0) {
+            debug("Unable to transmit CGI output: %s", strerror(errno));
+        }
+        cgicache_release(entry);
+        return HTTP_STATUS_OK;
+    }
+
+    int   input;
+    int   output;
+    pid_t pid = cgi_start(r, &input, &output);
+    if (pid < 0) {
+        cgicache_store(r, flight, NULL, 0, false);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    ssize_t sent    = 0;
+    size_t  started = transmit_sent(r);
+    if (flight || input >= 0) {
+        char   *buffer;
+        size_t  length;
+        int     complete = cgi_capture(r, input, output, &buffer, &length, flight ? cgicache_limit() : CGI_PENDING);
+        if (complete < 0) {
+            Status status = errno == ETIMEDOUT ? HTTP_STATUS_GATEWAY_TIMEOUT : HTTP_STATUS_INTERNAL_SERVER_ERROR;
+            log("Unable to run %s: %s", r->path, strerror(errno));
+
+            /* Once output has been sent, the response can only be cut short
+             * (the connection is closed afterwards) */
+            if (transmit_sent(r) != started) {
+                status = HTTP_STATUS_OK;
+            }
+            cgicache_store(r, flight, NULL, 0, false);
+            free(buffer);
+            close(output);
+            kill(pid, SIGKILL);
+            while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+            return status;
+        }
+        cgicache_store(r, flight, buffer ? buffer : "", length, complete);
+
+        struct iovec iov = {buffer, length};
+        if (length) {
+            sent = transmit_iov(r, &iov, 1);
+        }
+        if (sent >= 0 && !complete) {
+            sent = transmit_stream(r, output, SIZE_MAX);
+        }
+        free(buffer);
+    } else {
+        sent = transmit_stream(r, output, SIZE_MAX);
+    }
+    Status status = HTTP_STATUS_OK;
+    if (sent < 0) {
+        log("Unable to transmit output of %s: %s", r->path, strerror(errno));
+        if (errno == ETIMEDOUT && transmit_sent(r) == started) {
+            status = HTTP_STATUS_GATEWAY_TIMEOUT;
+        }
+        kill(pid, SIGKILL);
+    }
+    close(output);
+
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+    return status;
+}
+
+/**
+ * Check whether script is a persistent worker.
+ *
+ * @param   path        Path of script.
+ * @return  Whether or not the script is named *.worker (and workers are
+ * enabled).
+ **/
+bool cgi_is_worker(const char *path) {
+    size_t length = strlen(path);
+    return CGIWorkers && length > 7 && streq(path + length - 7, ".worker");
+}
+
+/**
+ * Start worker process.
+ *
+ * @param   pool        Pool of worker script.
+ * @return  Newly allocated worker (or NULL on failure).
+ *
+ * The worker is started by cgi_exec with one end of a socket pair as both its
+ * stdin and stdout.  Reads from and writes to the worker time out after
+ * CGI_TIMEOUT seconds.
+ **/
+static CGIWorker *cgi_spawn(CGIPool *pool) {
+    CGIWorker *worker = calloc(1, sizeof(CGIWorker));
+    int sv[2] = {-1, -1};
+
+    if (!worker || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        goto fail;
+    }
+
+    /* Bound every exchange with the worker (see cgi_worker_request) */
+    struct timeval timeout = {.tv_sec = CGI_TIMEOUT};
+    if (setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        goto fail;
+    }
+
+    /* Pass only the PassedVariables of the server (like cgi_envp) */
+    char  *envp[sizeof(PassedVariables) / sizeof(PassedVariables[0]) + 1];
+    size_t nenvp = 0;
+    for (const char **name = PassedVariables; *name; name++) {
+        size_t length = strlen(*name);
+        for (char **e = environ; *e; e++) {
+            if (strncmp(*e, *name, length) == 0 && (*e)[length] == '=') {
+                envp[nenvp++] = *e;
+                break;
+            }
+        }
+    }
+    envp[nenvp++] = "SPIDEY_WORKER=1";
+    envp[nenvp]   = NULL;
+
+    worker->pid = cgi_exec(pool->path, sv[1], sv[1], envp);
+    if (worker->pid < 0) {
+        goto fail;
+    }
+
+    close(sv[1]);
+    worker->fd = sv[0];
+    log("Started worker %d for %s", worker->pid, pool->path);
+    return worker;
+
+fail:
+    log("Unable to start worker for %s: %s", pool->path, strerror(errno));
+    if (sv[0] >= 0) {
+        close(sv[0]);
+        close(sv[1]);
+    }
+    free(worker);
+    return NULL;
+}
+
+/**
+ * Stop worker process.
+ *
+ * @param   worker      Worker to stop (freed).
+ *
+ * The worker may be stuck in the middle of a request (ie. after a timeout),
+ * so it is killed outright rather than asked to exit, which keeps the reap
+ * from blocking the calling thread.
+ **/
+static void cgi_stop(CGIWorker *worker) {
+    close(worker->fd);
+    kill(worker->pid, SIGKILL);
+    while (waitpid(worker->pid, NULL, 0) < 0 && errno == EINTR);
+    free(worker);
+}
+
+/**
+ * Lookup pool of worker script, creating it if necessary (caller must hold
+ * PoolLock).
+ *
+ * @param   path        Path of worker script.
+ * @return  Pool of worker script (or NULL on failure).
+ **/
+static CGIPool *cgi_pool(const char *path) {
+    for (CGIPool *pool = Pools; pool; pool = pool->next) {
+        if (streq(pool->path, path)) {
+            return pool;
+        }
+    }
+
+    CGIPool *pool = calloc(1, sizeof(CGIPool));
+    if (!pool || !(pool->path = strdup(path))) {
+        free(pool);
+        return NULL;
+    }
+    pthread_cond_init(&pool->available, NULL);
+    pool->next = Pools;
+    Pools      = pool;
+    return pool;
+}
+
+/**
+ * Acquire idle worker for script.
+ *
+ * @param   path        Path of worker script.
+ * @param   pool        Set to pool of worker script.
+ * @return  Worker (or NULL on failure).
+ *
+ * If no worker is idle, another is started as long as there are fewer than
+ * CGIWorkers, otherwise the request waits for a worker to become idle.  The
+ * pool thus grows to the peak number of concurrent requests for the script
+ * (up to CGIWorkers), and workers are only stopped when they fail.
+ **/
+static CGIWorker *cgi_acquire(const char *path, CGIPool **pool) {
+    CGIWorker *worker = NULL;
+
+    pthread_mutex_lock(&PoolLock);
+    CGIPool *p = *pool = cgi_pool(path);
+    while (p && !p->idle && p->count >= CGIWorkers) {
+        pthread_cond_wait(&p->available, &PoolLock);
+    }
+
+    if (p && p->idle) {
+        worker  = p->idle;
+        p->idle = worker->next;
+    } else if (p) {
+        p->count++;
+        pthread_mutex_unlock(&PoolLock);
+        worker = cgi_spawn(p);
+        pthread_mutex_lock(&PoolLock);
+        if (!worker) {
+            p->count--;
+            pthread_cond_signal(&p->available);
+        }
+    }
+    pthread_mutex_unlock(&PoolLock);
+    return worker;
+}
+
+/**
+ * Release worker back to its pool.
+ *
+ * @param   pool        Pool of worker script.
+ * @param   worker      Worker to release.
+ * @param   healthy     Whether the worker completed its request (otherwise
+ *                      it is stopped).
+ **/
+static void cgi_release(CGIPool *pool, CGIWorker *worker, bool healthy) {
+    pthread_mutex_lock(&PoolLock);
+    if (healthy) {
+        worker->next = pool->idle;
+        pool->idle   = worker;
+    } else {
+        pool->count--;
+    }
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&PoolLock);
+
+    if (!healthy) {
+        log("Stopping worker %d for %s", worker->pid, pool->path);
+        cgi_stop(worker);
+    }
+}
+
+/**
+ * Write all data to worker.
+ *
+ * @param   fd          Worker socket.
+ * @param   data        Data to write.
+ * @param   length      Length of data.
+ * @return  Whether or not all the data was written.
+ **/
+static bool cgi_write(int fd, const void *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data    = (const char *)data + n;
+        length -= n;
+    }
+    return true;
+}
+
+/**
+ * Read exactly length bytes from worker.
+ *
+ * @param   fd          Worker socket.
+ * @param   data        Buffer to read into.
+ * @param   length      Number of bytes to read.
+ * @return  Whether or not all the data was read (errno is EAGAIN if the
+ * worker sent nothing for CGI_TIMEOUT seconds, or ECONNRESET if it exited).
+ **/
+static bool cgi_read(int fd, void *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = recv(fd, data, length, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data    = (char *)data + n;
+        length -= n;
+    }
+    return true;
+}
+
+/**
+ * Write request body to worker.
+ *
+ * @param   r           Request structure.
+ * @param   fd          Worker socket.
+ * @return  Whether or not the whole body was written (errno is ETIMEDOUT if
+ * the client stalled for KeepAliveTimeout seconds).
+ *
+ * The buffered part of the body is written first, and the rest is relayed
+ * from the client socket.
+ **/
+static bool cgi_relay(Request *r, int fd) {
+    char buffer[BUFSIZ];
+
+    if (!cgi_write(fd, r->body, r->body_length)) {
+        return false;
+    }
+
+    for (size_t left = r->content_length - r->body_length; left > 0; ) {
+        ssize_t n = recv(r->fd, buffer, left < sizeof(buffer) ? left : sizeof(buffer), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = {.fd = r->fd, .events = POLLIN};
+            int status;
+            while ((status = poll(&pfd, 1, KeepAliveTimeout * 1000)) < 0 && errno == EINTR);
+            if (status == 0) {
+                errno = ETIMEDOUT;
+            }
+            if (status <= 0) {
+                return false;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+        }
+        if (n <= 0 || !cgi_write(fd, buffer, n)) {
+            return false;
+        }
+        left -= n;
+    }
+    return true;
+}
+
+/**
+ * Handle request with a persistent worker.
+ *
+ * @param   r           Request structure.
+ * @return  HTTP_STATUS_OK if the response was produced, otherwise the status
+ * to respond with (nothing has been sent to the client).
+ *
+ * The CGI environment and body are sent to an idle worker of the script, and
+ * its output is relayed to the client.  A worker that fails, exits, or does
+ * not respond within CGI_TIMEOUT seconds is stopped and replaced on demand.
+ * So is a worker that was sent only part of a body, since it would otherwise
+ * take the next request as the rest.
+ **/
+Status cgi_worker_request(Request *r) {
+    size_t length;
+    char  *environment = cgi_environment(r, &length);
+    if (!environment || length > UINT32_MAX) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    CGIPool   *pool;
+    CGIWorker *worker = cgi_acquire(r->path, &pool);
+    if (!worker) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    uint32_t header = htonl(length);
+    if (!cgi_write(worker->fd, &header, sizeof(header)) ||
+        !cgi_write(worker->fd, environment, length) ||
+        !cgi_relay(r, worker->fd) ||
+        !cgi_read(worker->fd, &header, sizeof(header))) {
+        Status status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            status = HTTP_STATUS_GATEWAY_TIMEOUT;
+        } else if (errno == ETIMEDOUT) {
+            status = HTTP_STATUS_REQUEST_TIMEOUT;
+        }
+        log("Unable to pass request to worker %d: %s", worker->pid, strerror(errno));
+        cgi_release(pool, worker, false);
+        return status;
+    }
+
+    size_t  count = ntohl(header);
+    ssize_t sent  = transmit_stream(r, worker->fd, count);
+    cgi_release(pool, worker, sent >= 0 && (size_t)sent == count);
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,370 @@
+/* cgicache.c: CGI Response Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+/*
+ * Scripts opt in to caching by printing a Cache-Control header with a
+ * max-age (or s-maxage) in seconds, ie:
+ *
+ *      HTTP/1.0 200 OK
+ *      Content-Type: text/html
+ *      Cache-Control: max-age=60
+ *      Vary: Accept-Language
+ *
+ * The output is then reused for GET requests of the same script and query
+ * (and the same values of any request headers listed in Vary) until it
+ * expires or the script is modified.  Only successful responses are cached,
+ * and no-store, no-cache, or private responses never are.
+ *
+ * Concurrent misses for the same key are coalesced: the first request (the
+ * leader) runs the script while the others wait for its output.
+ */
+
+/* Constants */
+
+#define CGICACHE_MAX_RESPONSE   (1024 * 1024)   /* Largest output worth caching */
+#define CGICACHE_UNCACHEABLE    60              /* Seconds to remember uncacheable output */
+
+/* Global Variables */
+
+static Cache            Responses;
+static pthread_once_t   ResponsesOnce = PTHREAD_ONCE_INIT;
+static FlightGroup      Flights       = FLIGHT_GROUP_INITIALIZER;
+
+/**
+ * Initialize CGI response cache (once per process).
+ **/
+static void cgicache_init() {
+    cache_init(&Responses, CGICacheSize ? SIZE_MAX : 0, CGICacheSize, free);
+    Responses.counters = stats_cache(STATS_CACHE_CGI);
+}
+
+/**
+ * Determine largest output that may be cached.
+ *
+ * @return  Maximum length of cached output (0 if caching is disabled).
+ **/
+size_t cgicache_limit() {
+    return CGICacheSize / 8 < CGICACHE_MAX_RESPONSE ? CGICacheSize / 8 : CGICACHE_MAX_RESPONSE;
+}
+
+/**
+ * Render cache key of request.
+ *
+ * @param   r           Request structure.
+ * @param   vary        Comma separated request headers (or NULL).
+ * @param   key         Buffer to render key into.
+ * @param   size        Size of buffer.
+ * @return  Whether or not the key fit.
+ *
+ * The key is the script path and query, followed by the value of each
+ * header in vary (on separate lines, since header values cannot contain
+ * newlines).
+ **/
+static bool cgicache_key(Request *r, const char *vary, char *key, size_t size) {
+    size_t length = snprintf(key, size, "%s?%s", r->path, r->query);
+
+    for (const char *s = vary; s && *s && length < size; ) {
+        s += strspn(s, " \t,");
+
+        size_t n = strcspn(s, " \t,");
+        if (n) {
+            char name[BUFSIZ];
+            snprintf(name, sizeof(name), "%.*s", (int)n, s);
+            const char *value = request_header(r, name);
+            length += snprintf(key + length, size - length, "\n%s", value ? value : "");
+        }
+        s += n;
+    }
+    return length < size;
+}
+
+/**
+ * Check whether cached response is still current.
+ *
+ * @param   response    Cached response.
+ * @param   info        File information of script.
+ * @return  Whether or not the response has not expired and the script has
+ * not changed since it was produced.
+ **/
+static bool cgicache_current(const CGIResponse *response, const FileInfo *info) {
+    return time(NULL) < response->expires &&
+           response->ino           == info->st.st_ino &&
+           response->mtime.tv_sec  == info->st.st_mtim.tv_sec &&
+           response->mtime.tv_nsec == info->st.st_mtim.tv_nsec;
+}
+
+/**
+ * Lookup current response in cache.
+ *
+ * @param   r           Request structure.
+ * @param   key         Key of response.
+ * @return  Cache entry (or NULL if missing or stale).
+ **/
+static CacheEntry *cgicache_get(Request *r, const char *key) {
+    CacheEntry *entry = cache_get(&Responses, key);
+    if (entry && !cgicache_current(entry->data, r->file->data)) {
+        cache_release(&Responses, entry);
+        return NULL;
+    }
+    return entry;
+}
+
+/**
+ * Lookup current response of request in cache.
+ *
+ * @param   r           Request structure.
+ * @param   key         Buffer to render key of response into.
+ * @param   size        Size of buffer.
+ * @param   bypass      Set if the cache should not be used for the request.
+ * @return  Cache entry (or NULL if the script has to be run).
+ *
+ * The base entry (keyed by path and query) records whether and how the
+ * output varies, and either holds the output itself or leads to the entry
+ * of the variant matching the request.
+ **/
+static CacheEntry *cgicache_find(Request *r, char *key, size_t size, bool *bypass) {
+    *bypass = !cgicache_key(r, NULL, key, size);
+    if (*bypass) {
+        return NULL;
+    }
+
+    CacheEntry *entry = cgicache_get(r, key);
+    if (!entry) {
+        return NULL;
+    }
+
+    CGIResponse *response = entry->data;
+    if (!response->cacheable || !response->vary) {
+        *bypass = !response->cacheable;
+        if (*bypass) {
+            cache_release(&Responses, entry);
+            return NULL;
+        }
+        return entry;
+    }
+
+    *bypass = !cgicache_key(r, response->vary, key, size);
+    cache_release(&Responses, entry);
+    return *bypass ? NULL : cgicache_get(r, key);
+}
+
+/**
+ * Lookup cached output of CGI request.
+ *
+ * @param   r           Request structure.
+ * @param   flight      Set to flight to complete with cgicache_store if the
+ *                      caller should run the script and offer its output
+ *                      (otherwise NULL).
+ * @return  Cache entry containing CGIResponse structure (or NULL if the
+ * script has to be run).
+ *
+ * If another request is already running the script for the same key, this
+ * waits for it to finish and then uses its output.  If that output turns
+ * out not to be cacheable, the script is run again without coalescing.
+ *
+ * The returned entry must be released with cgicache_release.
+ **/
+CacheEntry *cgicache_lookup(Request *r, Flight **flight) {
+    char        key[BUFSIZ];
+    bool        bypass;
+    CacheEntry *entry;
+
+    *flight = NULL;
+    if (!CGICacheSize || !streq(r->method, "GET") || r->content_length) {
+        return NULL;
+    }
+    pthread_once(&ResponsesOnce, cgicache_init);
+
+    if ((entry = cgicache_find(r, key, sizeof(key), &bypass)) || bypass) {
+        return entry;
+    }
+
+    /* Join flight for key, or lead a new one */
+    if (!flight_begin(&Flights, key, flight)) {
+        return cgicache_find(r, key, sizeof(key), &bypass);
+    }
+
+    /* A leader stores its output before finishing its flight, so check
+     * again in case one finished since the lookup above */
+    if ((entry = cgicache_find(r, key, sizeof(key), &bypass)) || bypass) {
+        flight_finish(&Flights, *flight);
+        *flight = NULL;
+        return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Allocate cached response.
+ *
+ * @param   r           Request structure.
+ * @param   output      Output of script (or NULL).
+ * @param   length      Length of output.
+ * @param   vary        Request headers output depends on (or NULL).
+ * @param   ttl         Seconds until response expires.
+ * @param   cacheable   Whether the output may be reused.
+ * @return  Newly allocated CGIResponse structure (or NULL on error).
+ *
+ * The structure, vary list, and output are allocated as one block.
+ **/
+static CGIResponse *cgicache_response(Request *r, const char *output, size_t length,
+                                      const char *vary, long ttl, bool cacheable) {
+    size_t       vlength  = vary ? strlen(vary) + 1 : 0;
+    CGIResponse *response = malloc(sizeof(CGIResponse) + vlength + length);
+    if (!response) {
+        return NULL;
+    }
+
+    FileInfo *info = r->file->data;
+    response->vary      = vary ? memcpy(response + 1, vary, vlength) : NULL;
+    response->output    = (char *)(response + 1) + vlength;
+    response->length    = length;
+    response->expires   = time(NULL) + ttl;
+    response->cacheable = cacheable;
+    response->ino       = info->st.st_ino;
+    response->mtime     = info->st.st_mtim;
+    if (length) {
+        memcpy(response->output, output, length);
+    }
+    return response;
+}
+
+/**
+ * Insert response into cache.
+ *
+ * @param   key         Key of response.
+ * @param   response    Response (ownership passes to the cache).
+ **/
+static void cgicache_put(const char *key, CGIResponse *response) {
+    if (response) {
+        size_t size = sizeof(CGIResponse) + (response->vary ? strlen(response->vary) + 1 : 0) + response->length;
+        cache_release(&Responses, cache_put(&Responses, key, response, size));
+    }
+}
+
+/**
+ * Determine how long output may be cached.
+ *
+ * @param   output      Output of script.
+ * @param   length      Length of output.
+ * @param   vary        Buffer to store Vary header in.
+ * @param   size        Size of vary buffer.
+ * @return  Seconds the output may be reused for (0 if it is not cacheable).
+ *
+ * Both non-parsed header output ("HTTP/1.0 200 OK") and a CGI Status header
+ * are understood.
+ **/
+static long cgicache_ttl(const char *output, size_t length, char *vary, size_t size) {
+    long ttl    = 0;
+    bool ok     = true;
+    bool shared = false;
+
+    vary[0] = '\0';
+    for (const char *line = output; line < output + length; ) {
+        const char *end  = memchr(line, '\n', output + length - line);
+        size_t      n    = (end ? end : output + length) - line;
+        if (n && line[n - 1] == '\r') {
+            n--;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        char header[BUFSIZ];
+        snprintf(header, sizeof(header), "%.*s", (int)n, line);
+        char *value = strchr(header, ':');
+        if (line == output && strncmp(header, "HTTP/", 5) == 0) {
+            const char *status = strchr(header, ' ');
+            ok = status && atoi(status) == 200;
+        } else if (value) {
+            *value++ = '\0';
+            value += strspn(value, " \t");
+            if (strcasecmp(header, "Status") == 0) {
+                ok = atoi(value) == 200;
+            } else if (strcasecmp(header, "Cache-Control") == 0) {
+                const char *age;
+                if (strcasestr(value, "no-store") || strcasestr(value, "no-cache") || strcasestr(value, "private")) {
+                    ok = false;
+                } else if ((age = strcasestr(value, "s-maxage="))) {
+                    ttl    = atol(age + 9);
+                    shared = true;
+                } else if (!shared && (age = strcasestr(value, "max-age="))) {
+                    ttl = atol(age + 8);
+                }
+            } else if (strcasecmp(header, "Vary") == 0) {
+                if (strchr(value, '*') || strlen(vary) + strlen(value) + 2 > size) {
+                    ok = false;
+                } else {
+                    strcat(strcat(vary, vary[0] ? "," : ""), value);
+                }
+            }
+        }
+
+        if (!end) {
+            break;
+        }
+        line = end + 1;
+    }
+
+    return ok && ttl > 0 ? ttl : 0;
+}
+
+/**
+ * Offer output of CGI request to cache, and finish its flight.
+ *
+ * @param   r           Request structure.
+ * @param   flight      Flight returned by cgicache_lookup (may be NULL).
+ * @param   output      Output of script (or NULL if it failed to start).
+ * @param   length      Length of output.
+ * @param   complete    Whether output is complete (otherwise it was too
+ *                      large to cache).
+ *
+ * Output that cannot be cached is remembered for CGICACHE_UNCACHEABLE
+ * seconds, so requests for it are neither coalesced nor buffered meanwhile.
+ * Waiting requests are woken up in every case.
+ **/
+void cgicache_store(Request *r, Flight *flight, const char *output, size_t length, bool complete) {
+    if (!flight) {
+        return;
+    }
+
+    char vary[BUFSIZ];
+    char key[BUFSIZ];
+    long ttl = complete ? cgicache_ttl(output, length, vary, sizeof(vary)) : 0;
+
+    if (output && cgicache_key(r, NULL, key, sizeof(key))) {
+        if (!ttl) {
+            cgicache_put(key, cgicache_response(r, NULL, 0, NULL, CGICACHE_UNCACHEABLE, false));
+        } else if (!vary[0]) {
+            cgicache_put(key, cgicache_response(r, output, length, NULL, ttl, true));
+        } else {
+            /* Store variant before the base entry that leads to it, so
+             * nobody finds the base entry without the variant */
+            char variant[BUFSIZ];
+            if (cgicache_key(r, vary, variant, sizeof(variant))) {
+                cgicache_put(variant, cgicache_response(r, output, length, NULL, ttl, true));
+                cgicache_put(key, cgicache_response(r, NULL, 0, vary, ttl, true));
+            }
+        }
+    }
+
+    flight_finish(&Flights, flight);
+}
+
+/**
+ * Release CGI response cache entry.
+ *
+ * @param   entry       Cache entry (may be NULL).
+ **/
+void cgicache_release(CacheEntry *entry) {
+    cache_release(&Responses, entry);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
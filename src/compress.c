@@ -0,0 +1,432 @@
+/* compress.c: Response Compression */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+/* Constants */
+
+#define COMPRESS_MIN_FILE   256                 /* Smallest file worth compressing */
+#define COMPRESS_MAX_FILE   (1024 * 1024)       /* Largest file compressed on the fly */
+#define COMPRESS_MIN_SAVING 10                  /* Percent smaller to be worth sending */
+
+/* Content-Encoding names (indexed by Encoding) */
+const char *EncodingNames[] = {
+    "identity",
+    "gzip",
+    "br",
+};
+
+/* Suffixes of precompressed sidecar files (indexed by Encoding) */
+const char *EncodingSuffixes[] = {
+    "",
+    ".gz",
+    ".br",
+};
+
+/* Encodings that can be compressed on the fly (indexed by Encoding) */
+static const bool Compressors[] = {
+    false,
+    true,
+#ifdef HAVE_BROTLI
+    true,
+#else
+    false,
+#endif
+};
+
+/* Mimetypes (or prefixes ending in '/') worth compressing */
+static const char *CompressibleTypes[] = {
+    "text/",
+    "application/javascript",
+    "application/json",
+    "application/xml",
+    "application/xhtml+xml",
+    "image/svg+xml",
+    NULL,
+};
+
+/* Global Variables */
+
+static Cache            Compressed;
+static pthread_once_t   CompressedOnce = PTHREAD_ONCE_INIT;
+static FlightGroup      Flights        = FLIGHT_GROUP_INITIALIZER;
+
+/**
+ * Initialize compressed content cache (once per process).
+ **/
+static void compress_init() {
+    cache_init(&Compressed, CompressCacheSize ? SIZE_MAX : 0, CompressCacheSize, free);
+    Compressed.counters = stats_cache(STATS_CACHE_COMPRESSED);
+}
+
+/**
+ * Determine whether content of a mimetype is worth compressing.
+ *
+ * @param   mimetype    Mimetype of file.
+ * @return  Whether or not the mimetype is text-like.
+ **/
+bool compress_compressible(const char *mimetype) {
+    for (const char **type = CompressibleTypes; *type; type++) {
+        size_t length = strlen(*type);
+        if ((*type)[length - 1] == '/' ? strncmp(mimetype, *type, length) == 0 : streq(mimetype, *type)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Determine whether the response for a file depends on Accept-Encoding.
+ *
+ * @param   info        File information.
+ * @return  Whether or not a Vary: Accept-Encoding header is needed.
+ **/
+bool compress_varies(const FileInfo *info) {
+    if (info->compressible && CompressCacheSize) {
+        return true;
+    }
+    for (Encoding e = ENCODING_GZIP; e < ENCODING_COUNT; e++) {
+        if (info->sidecars[e] >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Determine quality of content encoding in Accept-Encoding header.
+ *
+ * @param   header      Accept-Encoding header.
+ * @param   name        Name of content encoding.
+ * @return  Quality (0 to 1) the client assigns to the encoding, directly or
+ * through *, or -1 if neither is listed.
+ *
+ * Each element is a coding followed by optional parameters, with optional
+ * whitespace around the separators (ie. "gzip ; q=0.5").  A listed coding
+ * without a q parameter has quality 1, and q=0 means "not acceptable".
+ **/
+static double compress_quality(const char *header, const char *name) {
+    size_t length   = strlen(name);
+    double quality  = -1;
+    double wildcard = -1;
+
+    for (const char *s = header; *s; ) {
+        s += strspn(s, " \t,");
+        if (!*s) {
+            break;
+        }
+
+        size_t token    = strcspn(s, " \t,;");
+        bool   exact    = token == length && strncasecmp(s, name, length) == 0;
+        bool   any      = token == 1 && *s == '*';
+        double q        = 1;
+
+        /* Parameters: ; name = value */
+        s += token;
+        while (*(s += strspn(s, " \t")) == ';') {
+            s++;
+            s += strspn(s, " \t");
+            bool is_q = (*s == 'q' || *s == 'Q') && s[1] && strchr(" \t=", s[1]);
+            s += strcspn(s, " \t=;,");
+            s += strspn(s, " \t");
+            if (*s == '=') {
+                s++;
+                s += strspn(s, " \t");
+                if (is_q) {
+                    q = strtod(s, NULL);
+                }
+                s += strcspn(s, " \t;,");
+            }
+        }
+        s += strcspn(s, ",");
+
+        if (exact) {
+            quality = q;
+        } else if (any) {
+            wildcard = q;
+        }
+    }
+
+    return quality >= 0 ? quality : wildcard;
+}
+
+/**
+ * Choose content encoding of response.
+ *
+ * @param   r           Request structure.
+ * @param   info        File information.
+ * @return  Encoding with the highest quality that the client accepts and
+ * that is available for the file (as a sidecar or by compressing it), or
+ * ENCODING_IDENTITY if the client prefers that (or accepts nothing else).
+ *
+ * Ties are broken in favor of the better compression (br over gzip).
+ **/
+Encoding compress_negotiate(Request *r, const FileInfo *info) {
+    const char *header = r->known[HEADER_ACCEPT_ENCODING];
+    if (!header) {
+        return ENCODING_IDENTITY;
+    }
+
+    Encoding best    = ENCODING_IDENTITY;
+    double   quality = 0;
+    for (Encoding e = ENCODING_COUNT - 1; e > ENCODING_IDENTITY; e--) {
+        bool available = info->sidecars[e] >= 0 ||
+                         (Compressors[e] && info->compressible && CompressCacheSize);
+        double q = available ? compress_quality(header, EncodingNames[e]) : 0;
+        if (q > quality) {
+            best    = e;
+            quality = q;
+        }
+    }
+
+    /* Identity is acceptable unless the client says otherwise */
+    double identity = compress_quality(header, EncodingNames[ENCODING_IDENTITY]);
+    if (best != ENCODING_IDENTITY && identity > quality) {
+        return ENCODING_IDENTITY;
+    }
+    return best;
+}
+
+/**
+ * Compress data with gzip.
+ *
+ * @param   data        Data to compress.
+ * @param   length      Length of data.
+ * @param   output      Output buffer.
+ * @param   capacity    Capacity of output buffer.
+ * @return  Length of compressed data, or 0 if it does not fit.
+ **/
+static size_t compress_gzip(const char *data, size_t length, char *output, size_t capacity) {
+    z_stream stream = {0};
+
+    /* 15 window bits + 16 selects the gzip wrapper */
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+
+    stream.next_in   = (Bytef *)data;
+    stream.avail_in  = length;
+    stream.next_out  = (Bytef *)output;
+    stream.avail_out = capacity;
+
+    int status = deflate(&stream, Z_FINISH);
+    size_t total = stream.total_out;
+    deflateEnd(&stream);
+
+    return status == Z_STREAM_END ? total : 0;
+}
+
+#ifdef HAVE_BROTLI
+/**
+ * Compress data with brotli.
+ *
+ * @param   data        Data to compress.
+ * @param   length      Length of data.
+ * @param   output      Output buffer.
+ * @param   capacity    Capacity of output buffer.
+ * @return  Length of compressed data, or 0 if it does not fit.
+ **/
+static size_t compress_brotli(const char *data, size_t length, char *output, size_t capacity) {
+    size_t total = capacity;
+    if (!BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               length, (const uint8_t *)data, &total, (uint8_t *)output)) {
+        return 0;
+    }
+    return total;
+}
+#endif
+
+/**
+ * Read and compress file, rendering its response headers.
+ *
+ * @param   info        File information.
+ * @param   encoding    Content encoding.
+ * @return  Newly allocated Content structure (or NULL on error).
+ *
+ * Only compressed output that saves at least COMPRESS_MIN_SAVING percent is
+ * kept; otherwise the returned content has no body, which records that the
+ * file should be sent uncompressed.
+ **/
+static Content *compress_load(const FileInfo *info, Encoding encoding) {
+    size_t  size     = info->st.st_size;
+    size_t  capacity = size - size * COMPRESS_MIN_SAVING / 100;
+    char   *data     = malloc(size);
+    char   *output   = malloc(capacity);
+    Content *content = NULL;
+
+    if (!data || !output) {
+        goto done;
+    }
+
+    for (size_t total = 0; total < size; ) {
+        ssize_t nread = pread(info->fd, data + total, size - total, total);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            goto done;
+        }
+        total += nread;
+    }
+
+    size_t length = 0;
+    switch (encoding) {
+        case ENCODING_GZIP:
+            length = compress_gzip(data, size, output, capacity);
+            break;
+#ifdef HAVE_BROTLI
+        case ENCODING_BROTLI:
+            length = compress_brotli(data, size, output, capacity);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    char validators[BUFSIZ];
+    char headers[BUFSIZ];
+    validators_render(validators, sizeof(validators), info, encoding);
+    int  hlength = snprintf(headers, sizeof(headers),
+                            "Content-Type: %s\r\nContent-Length: %zu\r\n%sContent-Encoding: %s\r\nVary: Accept-Encoding\r\n",
+                            info->mimetype, length, validators, EncodingNames[encoding]);
+    if (hlength < 0 || (size_t)hlength >= sizeof(headers)) {
+        goto done;
+    }
+
+    content = malloc(sizeof(Content) + hlength + length);
+    if (!content) {
+        goto done;
+    }
+
+    content->headers        = (char *)(content + 1);
+    content->headers_length = hlength;
+    content->body           = length ? content->headers + hlength : NULL;
+    content->length         = length;
+    content->size           = info->st.st_size;
+    content->ino            = info->st.st_ino;
+    content->mtime          = info->st.st_mtim;
+    content->generation     = info->generation;
+    memcpy(content->headers, headers, hlength);
+    if (length) {
+        memcpy(content->body, output, length);
+    }
+
+done:
+    free(data);
+    free(output);
+    return content;
+}
+
+/**
+ * Lookup current compressed content in cache.
+ *
+ * @param   key         Key of content (path and encoding suffix).
+ * @param   info        File information.
+ * @return  Cache entry (or NULL if missing or stale).
+ **/
+static CacheEntry *compress_get(const char *key, const FileInfo *info) {
+    CacheEntry *entry = cache_get(&Compressed, key);
+    if (entry) {
+        Content *content = entry->data;
+        if (content->ino                == info->st.st_ino &&
+            content->size               == info->st.st_size &&
+            content->mtime.tv_sec       == info->st.st_mtim.tv_sec &&
+            content->mtime.tv_nsec      == info->st.st_mtim.tv_nsec &&
+            content->generation         == info->generation) {
+            return entry;
+        }
+        cache_release(&Compressed, entry);
+    }
+    return NULL;
+}
+
+/**
+ * Lookup compressed content of file.
+ *
+ * @param   info        File information (from the file cache).
+ * @param   encoding    Content encoding.
+ * @return  Cache entry containing Content structure (or NULL if the file is
+ * not worth compressing).
+ *
+ * Compressible files between COMPRESS_MIN_FILE and COMPRESS_MAX_FILE (and an
+ * eighth of the CompressCacheSize budget) are compressed once, on the first
+ * request that accepts the encoding, and then served from the cache.  Like
+ * the content cache, entries are keyed by path (and encoding) and checked
+ * against the inode, size, and modification time of the file (and the
+ * mimetypes generation of their headers).
+ *
+ * Concurrent misses for the same key are coalesced like those of the CGI
+ * cache: the first request compresses the file while the others wait for it
+ * (and send the file uncompressed if it could not be cached).
+ *
+ * The returned entry must be released with compress_release.
+ **/
+CacheEntry *compress_lookup(FileInfo *info, Encoding encoding) {
+    pthread_once(&CompressedOnce, compress_init);
+
+    if (!CompressCacheSize || !Compressors[encoding] || !info->compressible ||
+        info->st.st_size < COMPRESS_MIN_FILE || info->st.st_size > COMPRESS_MAX_FILE ||
+        (size_t)info->st.st_size > CompressCacheSize / 8) {
+        return NULL;
+    }
+
+    char key[BUFSIZ];
+    if (snprintf(key, sizeof(key), "%s%s", info->path, EncodingSuffixes[encoding]) >= (int)sizeof(key)) {
+        return NULL;
+    }
+
+    CacheEntry *entry = compress_get(key, info);
+    if (entry) {
+        goto found;
+    }
+
+    /* Join flight for key, or lead a new one */
+    Flight *flight;
+    if (!flight_begin(&Flights, key, &flight)) {
+        if (!(entry = compress_get(key, info))) {
+            return NULL;
+        }
+        goto found;
+    }
+
+    /* A leader stores its content before finishing its flight, so check
+     * again in case one finished since the lookup above */
+    if (!(entry = compress_get(key, info))) {
+        Content *content = compress_load(info, encoding);
+        entry = content ? cache_put(&Compressed, key, content, sizeof(Content) + content->headers_length + content->length) : NULL;
+    }
+    flight_finish(&Flights, flight);
+
+    if (!entry) {
+        return NULL;
+    }
+
+found:
+    if (!((Content *)entry->data)->body) {
+        cache_release(&Compressed, entry);
+        return NULL;
+    }
+    return entry;
+}
+
+/**
+ * Release compressed content cache entry.
+ *
+ * @param   entry       Cache entry (may be NULL).
+ **/
+void compress_release(CacheEntry *entry) {
+    cache_release(&Compressed, entry);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
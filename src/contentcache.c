@@ -0,0 +1,146 @@
+/* contentcache.c: Hot Content Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define CONTENTCACHE_MAX_FILE   (256 * 1024)    /* Largest file worth caching */
+#define CONTENTCACHE_MIN_HITS   2               /* Requests before caching */
+
+/* Global Variables */
+
+static Cache            Contents;
+static pthread_once_t   ContentsOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Initialize content cache (once per process).
+ **/
+static void contentcache_init() {
+    cache_init(&Contents, ContentCacheSize ? SIZE_MAX : 0, ContentCacheSize, free);
+    Contents.counters = stats_cache(STATS_CACHE_CONTENT);
+}
+
+/**
+ * Check whether cached content still matches file.
+ *
+ * @param   content     Cached content.
+ * @param   info        File information.
+ * @return  Whether or not the content is current.
+ **/
+static bool contentcache_current(const Content *content, const FileInfo *info) {
+    return content->ino                == info->st.st_ino &&
+           content->size               == info->st.st_size &&
+           content->mtime.tv_sec       == info->st.st_mtim.tv_sec &&
+           content->mtime.tv_nsec      == info->st.st_mtim.tv_nsec &&
+           content->generation         == info->generation;
+}
+
+/**
+ * Read file and render its response headers.
+ *
+ * @param   info        File information.
+ * @return  Newly allocated Content structure (or NULL on error).
+ *
+ * The structure, headers, and body are allocated as one block.
+ **/
+static Content *contentcache_load(const FileInfo *info) {
+    char validators[BUFSIZ];
+    char headers[BUFSIZ];
+    validators_render(validators, sizeof(validators), info, ENCODING_IDENTITY);
+    int  hlength = snprintf(headers, sizeof(headers), "Content-Type: %s\r\nContent-Length: %zd\r\nAccept-Ranges: bytes\r\n%s%s",
+                            info->mimetype, (ssize_t)info->st.st_size, validators,
+                            compress_varies(info) ? "Vary: Accept-Encoding\r\n" : "");
+    if (hlength < 0 || (size_t)hlength >= sizeof(headers)) {
+        return NULL;
+    }
+
+    Content *content = malloc(sizeof(Content) + hlength + info->st.st_size);
+    if (!content) {
+        return NULL;
+    }
+
+    content->headers         = (char *)(content + 1);
+    content->headers_length  = hlength;
+    content->body            = content->headers + hlength;
+    content->length          = info->st.st_size;
+    content->size            = info->st.st_size;
+    content->ino             = info->st.st_ino;
+    content->mtime           = info->st.st_mtim;
+    content->generation      = info->generation;
+    memcpy(content->headers, headers, hlength);
+
+    for (size_t total = 0; total < content->length; ) {
+        ssize_t nread = pread(info->fd, content->body + total, content->length - total, total);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            free(content);
+            return NULL;
+        }
+        total += nread;
+    }
+
+    return content;
+}
+
+/**
+ * Lookup cached content of file.
+ *
+ * @param   info        File information (from the file cache).
+ * @return  Cache entry containing Content structure (or NULL if the file is
+ * not cached).
+ *
+ * Only small files (up to CONTENTCACHE_MAX_FILE and an eighth of the
+ * ContentCacheSize budget) are cached, and only once they have been
+ * requested CONTENTCACHE_MIN_HITS times, so large images and one-off
+ * requests bypass the cache.  Cached content is keyed by path and checked
+ * against the inode, size, and modification time of the file (and the
+ * mimetypes generation of its headers), so a changed file is reloaded.
+ * Entries are evicted in least recently used order to stay within the
+ * budget.
+ *
+ * The returned entry must be released with contentcache_release.
+ **/
+CacheEntry *contentcache_lookup(FileInfo *info) {
+    pthread_once(&ContentsOnce, contentcache_init);
+
+    if (!ContentCacheSize || info->st.st_size > CONTENTCACHE_MAX_FILE ||
+        (size_t)info->st.st_size > ContentCacheSize / 8) {
+        return NULL;
+    }
+
+    CacheEntry *entry = cache_get(&Contents, info->path);
+    if (entry) {
+        if (contentcache_current(entry->data, info)) {
+            return entry;
+        }
+        cache_release(&Contents, entry);
+    } else if (__atomic_add_fetch(&info->hits, 1, __ATOMIC_RELAXED) < CONTENTCACHE_MIN_HITS) {
+        return NULL;
+    }
+
+    Content *content = contentcache_load(info);
+    if (!content) {
+        return NULL;
+    }
+
+    return cache_put(&Contents, info->path, content, sizeof(Content) + content->headers_length + content->length);
+}
+
+/**
+ * Release content cache entry.
+ *
+ * @param   entry       Cache entry (may be NULL).
+ **/
+void contentcache_release(CacheEntry *entry) {
+    cache_release(&Contents, entry);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
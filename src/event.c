@@ -0,0 +1,453 @@
+/* event.c: Event-Driven HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define EVENT_MAX_EVENTS    1024
+
+/* Connection */
+
+typedef struct connection Connection;
+struct connection {
+    Request    *request;                /*< Request state of connection */
+    time_t      active;                 /*< Time of last activity */
+    bool        closing;                /*< Whether to close once queued output is sent */
+    Offload    *offload;                /*< Request handed to a helper thread */
+    Connection *prev;                   /*< Previous connection in idle list */
+    Connection *next;                   /*< Next connection in idle list (or offload queue) */
+};
+
+/* Global Variables */
+
+/* Idle connections ordered from least to most recently active, so expired
+ * connections are always found at the head */
+static Connection *IdleHead = NULL;
+static Connection *IdleTail = NULL;
+
+/* Epoll instance, and connection whose request is being handled (and
+ * whether it was handed to a helper thread, see event_offload) */
+static int         EventFd    = -1;
+static Connection *Handling   = NULL;
+static bool        Offloaded  = false;
+
+/* Requests waiting for a helper thread */
+static Connection     *OffloadHead  = NULL;
+static Connection     *OffloadTail  = NULL;
+static pthread_mutex_t OffloadLock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  OffloadReady = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Return current monotonic time in seconds.
+ **/
+static time_t event_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Append connection to tail of idle list.
+ *
+ * @param   c           Connection.
+ **/
+static void event_idle_push(Connection *c) {
+    c->active = event_now();
+    c->prev   = IdleTail;
+    c->next   = NULL;
+    if (IdleTail) {
+        IdleTail->next = c;
+    } else {
+        IdleHead = c;
+    }
+    IdleTail = c;
+}
+
+/**
+ * Remove connection from idle list.
+ *
+ * @param   c           Connection.
+ **/
+static void event_idle_remove(Connection *c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        IdleHead = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    } else {
+        IdleTail = c->prev;
+    }
+    c->prev = c->next = NULL;
+}
+
+/**
+ * Close connection (which also removes it from epoll).
+ *
+ * @param   c           Connection.
+ **/
+static void event_close(Connection *c) {
+    stats_connection(false);
+    free_request(c->request);
+    free(c);
+}
+
+/**
+ * Change the events epoll reports for connection.
+ *
+ * @param   c           Connection.
+ * @param   events      EPOLLIN to wait for requests, or EPOLLOUT to wait
+ *                      until queued output can be sent.
+ * @return  Whether or not the events were changed.
+ **/
+static bool event_watch(Connection *c, uint32_t events) {
+    struct epoll_event event = {
+        .events   = events == EPOLLIN ? EPOLLIN | EPOLLRDHUP : events,
+        .data.ptr = c,
+    };
+
+    if (epoll_ctl(EventFd, EPOLL_CTL_MOD, c->request->fd, &event) < 0) {
+        log("Unable to watch request: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Hand request of connection being handled to a helper thread.
+ *
+ * @param   offload     Offloaded request (see handle_request).
+ * @return  Whether or not the request was handed off.
+ *
+ * CGI scripts and workers block on their processes, so they are run by
+ * helper threads (see event_helper), which own the connection from then on
+ * and close it once the response is sent.
+ **/
+static bool event_offload(Offload *offload) {
+    Connection *c = Handling;
+
+    if (!c || epoll_ctl(EventFd, EPOLL_CTL_DEL, c->request->fd, NULL) < 0) {
+        return false;
+    }
+
+    c->offload = offload;
+    c->next    = NULL;
+
+    pthread_mutex_lock(&OffloadLock);
+    if (OffloadTail) {
+        OffloadTail->next = c;
+    } else {
+        OffloadHead = c;
+    }
+    OffloadTail = c;
+    pthread_cond_signal(&OffloadReady);
+    pthread_mutex_unlock(&OffloadLock);
+
+    Offloaded = true;
+    return true;
+}
+
+/**
+ * Run offloaded requests and close their connections.
+ *
+ * @param   arg         Unused.
+ * @return  Never returns.
+ *
+ * The request is finished with blocking writes, since nothing else waits on
+ * this thread.
+ **/
+static void *event_helper(void *arg) {
+    while (true) {
+        pthread_mutex_lock(&OffloadLock);
+        while (!OffloadHead) {
+            pthread_cond_wait(&OffloadReady, &OffloadLock);
+        }
+        Connection *c = OffloadHead;
+        OffloadHead = c->next;
+        if (!OffloadHead) {
+            OffloadTail = NULL;
+        }
+        pthread_mutex_unlock(&OffloadLock);
+
+        Request *r = c->request;
+        r->deferred = false;
+        r->offload  = NULL;
+        handle_offload(c->offload);
+        event_close(c);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start helper threads for offloaded requests.
+ *
+ * Threads helpers are started (or one per CPU, if not set).
+ **/
+static void event_start_helpers() {
+    size_t helpers = Threads ? Threads : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (size_t i = 0; i < helpers; i++) {
+        pthread_t thread;
+        int status = pthread_create(&thread, NULL, event_helper, NULL);
+        if (status != 0) {
+            fatal("Unable to create helper thread: %s", strerror(status));
+        }
+        pthread_detach(thread);
+    }
+}
+
+/**
+ * Raise the open file limit to the hard limit so we can hold many idle
+ * connections at once.
+ **/
+static void event_raise_fd_limit() {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+            debug("Unable to raise file limit: %s", strerror(errno));
+        }
+    }
+}
+
+/**
+ * Accept all pending connections and register them with the epoll instance.
+ *
+ * @param   efd         Epoll file descriptor.
+ * @param   sfd         Server socket file descriptor (non-blocking).
+ **/
+static void event_accept(int efd, int sfd) {
+    Request *request;
+
+    while ((request = accept_request(sfd))) {
+        Connection *c = calloc(1, sizeof(Connection));
+        if (!c) {
+            log("Unable to allocate connection: %s", strerror(errno));
+            free_request(request);
+            continue;
+        }
+        c->request = request;
+        request->deferred = true;
+        request->offload  = event_offload;
+        stats_connection(true);
+
+        struct epoll_event event = {
+            .events   = EPOLLIN | EPOLLRDHUP,
+            .data.ptr = c,
+        };
+
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, request->fd, &event) < 0) {
+            log("Unable to register request: %s", strerror(errno));
+            event_close(c);
+            continue;
+        }
+        event_idle_push(c);
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log("Unable to accept request: %s", strerror(errno));
+    }
+}
+
+/**
+ * Handle requests on a readable connection.
+ *
+ * @param   c           Connection.
+ * @param   eof         Whether the client has finished sending (so a
+ *                      partial request is answered rather than waited for).
+ *
+ * Any pipelined requests already buffered are answered before the
+ * connection is returned to the idle list, since epoll will not report data
+ * that has already been read from the socket.  A request is only handled
+ * once its header is complete, so a slow client never blocks the server,
+ * or once the header is overdue, which answers HTTP_STATUS_REQUEST_TIMEOUT
+ * without waiting (see request_expired).
+ *
+ * Responses never wait for the socket: whatever does not fit is queued (see
+ * transmit_resume), and the connection then waits for EPOLLOUT instead of
+ * further requests, staying in the idle list so a client that stops reading
+ * is closed after KeepAliveTimeout seconds.  CGI scripts and workers are
+ * handed to helper threads (see event_offload).
+ **/
+static void event_handle(Connection *c, bool eof) {
+    Request *r = c->request;
+    bool keep_alive;
+
+    event_idle_remove(c);
+
+    do {
+        if (check_request(r) == 0 && !request_expired(r) && !eof) {
+            keep_alive = true;
+            break;
+        }
+        Handling  = c;
+        Offloaded = false;
+        handle_request(r);
+        Handling  = NULL;
+        if (Offloaded) {
+            return;
+        }
+        keep_alive = r->keep_alive;
+        reset_request(r);
+    } while (keep_alive && r->offset < r->length && !r->pending);
+
+    if (!idle_request(r)) {
+        event_close(c);
+    } else if (r->pending) {
+        c->closing = !keep_alive || eof;
+        if (event_watch(c, EPOLLOUT)) {
+            event_idle_push(c);
+        } else {
+            event_close(c);
+        }
+    } else if (keep_alive && !eof) {
+        event_idle_push(c);
+    } else {
+        event_close(c);
+    }
+}
+
+/**
+ * Send output queued on a writable connection.
+ *
+ * @param   c           Connection.
+ *
+ * Once everything is sent, the connection is closed if its last response
+ * asked for that, and otherwise waits for requests again (answering any
+ * pipelined ones already buffered).
+ **/
+static void event_resume(Connection *c) {
+    Request *r = c->request;
+    int status = transmit_resume(r);
+
+    event_idle_remove(c);
+    if (status == 0) {
+        event_idle_push(c);
+    } else if (status < 0 || c->closing || !event_watch(c, EPOLLIN)) {
+        event_close(c);
+    } else if (r->offset < r->length) {
+        event_handle(c, false);
+    } else {
+        event_idle_push(c);
+    }
+}
+
+/**
+ * Close connections that have been idle for KeepAliveTimeout seconds.
+ **/
+static void event_expire() {
+    time_t now = event_now();
+
+    while (IdleHead && now - IdleHead->active >= KeepAliveTimeout) {
+        Connection *c = IdleHead;
+        event_idle_remove(c);
+        event_close(c);
+    }
+}
+
+/**
+ * Multiplex HTTP requests over epoll in a single process.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * The server socket is made non-blocking and every accepted connection is
+ * registered with epoll.  A connection is only handled once the client has
+ * actually sent data, so idle connections cost nothing but a file descriptor.
+ * Persistent connections go back to epoll between requests and are closed
+ * once idle for KeepAliveTimeout seconds.  Nothing on this thread waits for a
+ * client or a script (see event_handle).
+ **/
+int event_server(int sfd) {
+    struct epoll_event events[EVENT_MAX_EVENTS];
+
+    /* Prepare process for many connections */
+    event_raise_fd_limit();
+
+    /* Make server socket non-blocking */
+    int flags = fcntl(sfd, F_GETFL);
+    if (flags < 0 || fcntl(sfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        fatal("Unable to make server socket non-blocking: %s", strerror(errno));
+    }
+
+    /* Start threads for CGI scripts and workers */
+    event_start_helpers();
+
+    /* Register server socket with epoll */
+    int efd = EventFd = epoll_create1(EPOLL_CLOEXEC);
+    if (efd < 0) {
+        fatal("Unable to create epoll instance: %s", strerror(errno));
+    }
+
+    struct epoll_event event = {
+        .events   = EPOLLIN,
+        .data.ptr = NULL,
+    };
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &event) < 0) {
+        fatal("Unable to register server socket: %s", strerror(errno));
+    }
+
+    /* Wait for and dispatch events */
+    while (true) {
+        int n = epoll_wait(efd, events, EVENT_MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno != EINTR) {
+                log("Unable to wait for events: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            Connection *c = events[i].data.ptr;
+
+            /* Server socket: accept new connections */
+            if (!c) {
+                event_accept(efd, sfd);
+                continue;
+            }
+
+            /* Client socket with queued output: send more */
+            if (c->request->pending) {
+                event_resume(c);
+                continue;
+            }
+
+            /* Client socket: handle request if data arrived, otherwise the
+             * client hung up (answering any partial request it left) */
+            Request *r = c->request;
+            ssize_t nread = -1;
+            if (events[i].events & EPOLLIN) {
+                nread = fill_request(r, false);
+            }
+            if (nread > 0 || (nread == 0 && r->offset < r->length)) {
+                event_handle(c, nread == 0);
+            } else if (nread < 0 && errno == EAGAIN) {
+                continue;
+            } else {
+                event_idle_remove(c);
+                event_close(c);
+            }
+        }
+
+        event_expire();
+    }
+
+    /* Close server socket */
+    close(efd);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
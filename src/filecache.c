@@ -0,0 +1,426 @@
+/* filecache.c: File Metadata Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define FILECACHE_EVENTS        (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                                 IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+#define FILECACHE_DRAIN_NSEC    50000000    /* Drain inotify events every 50 ms */
+
+/* Global Variables */
+
+static Cache            Files;
+static pthread_once_t   FilesOnce    = PTHREAD_ONCE_INIT;
+static pthread_mutex_t  NotifyLock   = PTHREAD_MUTEX_INITIALIZER;
+static int              NotifyFd     = -1;
+static struct timespec  NotifyDrained;
+static pthread_mutex_t  WatchLock    = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    int     wd;
+    size_t  count;
+}                      *Watches      = NULL;   /* Number of entries using each watch */
+static size_t           WatchesSize  = 0;
+static size_t           WatchesCapacity = 0;
+
+/**
+ * Add inotify watch for directory (shared by all entries depending on it).
+ *
+ * @param   path        Path of directory.
+ * @return  Watch descriptor (or -1 on failure).
+ **/
+static int filecache_watch(const char *path) {
+    pthread_mutex_lock(&WatchLock);
+    int wd = inotify_add_watch(NotifyFd, path, FILECACHE_EVENTS);
+    if (wd < 0) {
+        goto done;
+    }
+
+    for (size_t i = 0; i < WatchesSize; i++) {
+        if (Watches[i].wd == wd) {
+            Watches[i].count++;
+            goto done;
+        }
+    }
+
+    if (WatchesSize == WatchesCapacity) {
+        size_t capacity = WatchesCapacity ? 2 * WatchesCapacity : 16;
+        void  *watches  = realloc(Watches, capacity * sizeof(*Watches));
+        if (!watches) {
+            inotify_rm_watch(NotifyFd, wd);
+            wd = -1;
+            goto done;
+        }
+        Watches         = watches;
+        WatchesCapacity = capacity;
+    }
+    Watches[WatchesSize].wd    = wd;
+    Watches[WatchesSize].count = 1;
+    WatchesSize++;
+
+done:
+    pthread_mutex_unlock(&WatchLock);
+    return wd;
+}
+
+/**
+ * Release inotify watch, which is removed once no entry uses it anymore.
+ *
+ * @param   wd          Watch descriptor (see filecache_watch).
+ **/
+static void filecache_unwatch(int wd) {
+    pthread_mutex_lock(&WatchLock);
+    for (size_t i = 0; i < WatchesSize; i++) {
+        if (Watches[i].wd == wd) {
+            if (--Watches[i].count == 0) {
+                /* Fails harmlessly if the kernel already removed it (ie. directory deleted) */
+                inotify_rm_watch(NotifyFd, wd);
+                Watches[i] = Watches[--WatchesSize];
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&WatchLock);
+}
+
+/**
+ * Free file information.
+ *
+ * @param   data        FileInfo structure.
+ **/
+static void filecache_free(void *data) {
+    FileInfo *info = data;
+    if (info->fd >= 0) {
+        close(info->fd);
+    }
+    for (Encoding e = ENCODING_GZIP; e < ENCODING_COUNT; e++) {
+        if (info->sidecars[e] >= 0) {
+            close(info->sidecars[e]);
+        }
+    }
+    for (size_t i = 0; i < info->nwds; i++) {
+        filecache_unwatch(info->wds[i]);
+    }
+    free(info->wds);
+    free(info->path);
+    free(info);
+}
+
+/**
+ * Initialize file cache and inotify instance (once per process).
+ **/
+static void filecache_init() {
+    cache_init(&Files, FileCacheSize, 0, filecache_free);
+    Files.counters = stats_cache(STATS_CACHE_FILE);
+    if (FileCacheSize) {
+        NotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (NotifyFd < 0) {
+            log("Unable to initialize inotify: %s", strerror(errno));
+        }
+    }
+}
+
+/**
+ * Check whether file information is invalidated by an inotify event.
+ *
+ * @param   data        FileInfo structure.
+ * @param   arg         Inotify event.
+ * @return  Whether or not file is invalidated by event.
+ *
+ * Any event on the innermost watch (the containing directory, or the
+ * directory itself) counts, while on the watches of its ancestors only
+ * events naming the next component of the path (ie. a renamed directory or
+ * a re-pointed symlink) or concerning the ancestor itself do.
+ **/
+static bool filecache_watched(void *data, void *arg) {
+    FileInfo                   *info  = data;
+    const struct inotify_event *event = arg;
+    const char                 *name  = info->path + strlen(RootPath);
+
+    for (size_t i = 0; i < info->nwds; i++) {
+        name += *name == '/';
+        size_t length = strcspn(name, "/");
+        if (info->wds[i] == event->wd) {
+            if (i + 1 == info->nwds || !event->len ||
+                (strlen(event->name) == length && strncmp(event->name, name, length) == 0)) {
+                return true;
+            }
+        }
+        name += length;
+    }
+    return false;
+}
+
+/**
+ * Invalidate cached files affected by pending inotify events.
+ *
+ * Events are drained at most every FILECACHE_DRAIN_NSEC, using the coarse
+ * monotonic clock (which needs no syscall), so lookups in the steady state
+ * never enter the kernel.  A change can therefore be served stale for up to
+ * that interval.
+ **/
+static void filecache_drain() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    pthread_mutex_lock(&NotifyLock);
+    long elapsed = (now.tv_sec - NotifyDrained.tv_sec) * 1000000000L + (now.tv_nsec - NotifyDrained.tv_nsec);
+    if (elapsed < FILECACHE_DRAIN_NSEC) {
+        pthread_mutex_unlock(&NotifyLock);
+        return;
+    }
+    NotifyDrained = now;
+
+    char buffer[BUFSIZ] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t nread;
+    while ((nread = read(NotifyFd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + nread; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                cache_purge(&Files, NULL, NULL);
+            } else {
+                cache_purge(&Files, filecache_watched, event);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    pthread_mutex_unlock(&NotifyLock);
+}
+
+/**
+ * Open precompressed variants of file.
+ *
+ * @param   info        File information.
+ * @param   path        Path of file relative to RootPath.
+ *
+ * A sidecar (ie. foo.html.gz next to foo.html) is only used if it is a
+ * regular file at least as new as the file itself, so a stale sidecar is
+ * ignored rather than served.  Sidecars live in the same directory, so the
+ * existing watch on it invalidates them too.
+ **/
+static void filecache_sidecars(FileInfo *info, const char *path) {
+    for (Encoding e = ENCODING_GZIP; e < ENCODING_COUNT; e++) {
+        char sidecar[PATH_MAX];
+        if (snprintf(sidecar, sizeof(sidecar), "%s%s", path, EncodingSuffixes[e]) >= (int)sizeof(sidecar)) {
+            continue;
+        }
+
+        int fd = open_request_path(sidecar, O_RDONLY | O_NONBLOCK);
+        if (fd < 0) {
+            continue;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+            st.st_mtim.tv_sec < info->st.st_mtim.tv_sec ||
+            (st.st_mtim.tv_sec == info->st.st_mtim.tv_sec && st.st_mtim.tv_nsec < info->st.st_mtim.tv_nsec)) {
+            close(fd);
+            continue;
+        }
+
+        info->sidecars[e]      = fd;
+        info->sidecar_sizes[e] = st.st_size;
+    }
+}
+
+/**
+ * Check whether file is executable.
+ *
+ * @param   fd          Descriptor of file.
+ * @param   path        Path of file.
+ * @return  Whether or not the server may execute the file.
+ **/
+static bool filecache_executable(int fd, const char *path) {
+    if (faccessat(fd, "", X_OK, AT_EMPTY_PATH) == 0) {
+        return true;
+    }
+    /* Kernels before 5.8 have no faccessat2 (which supports AT_EMPTY_PATH) */
+    return (errno == EINVAL || errno == ENOSYS) && access(path, X_OK) == 0;
+}
+
+/**
+ * Watch every directory from RootPath down to file for changes.
+ *
+ * @param   info        File information.
+ *
+ * Watching only the containing directory would miss a renamed ancestor or a
+ * re-pointed symlink along the path, so each directory on the path (and a
+ * directory itself) is watched.  If any watch fails, none are kept, which
+ * leaves the file uncacheable.
+ **/
+static void filecache_watches(FileInfo *info) {
+    size_t rootlen = strlen(RootPath);
+    size_t count   = 1 + S_ISDIR(info->st.st_mode);
+    for (const char *c = info->path + rootlen + 1; c < info->path + strlen(info->path); c++) {
+        count += *c == '/';
+    }
+    if (streq(info->path, RootPath)) {
+        count = 1;
+    }
+
+    info->wds = calloc(count, sizeof(int));
+    if (!info->wds) {
+        return;
+    }
+
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", info->path);
+    for (size_t end = rootlen; info->nwds < count; end += 1 + strcspn(info->path + end + 1, "/")) {
+        directory[end] = 0;
+        int wd = filecache_watch(directory);
+        directory[end] = info->path[end];
+        if (wd < 0) {
+            while (info->nwds) {
+                filecache_unwatch(info->wds[--info->nwds]);
+            }
+            return;
+        }
+        info->wds[info->nwds++] = wd;
+    }
+}
+
+/**
+ * Resolve path and gather file information.
+ *
+ * @param   path        Normalized path relative to RootPath (see normalize_uri).
+ * @return  Newly allocated FileInfo structure (or NULL if not found).
+ *
+ * The path is opened once (beneath RootPath, see open_request_path), and
+ * everything else is determined from that descriptor, which is kept for
+ * regular files.  It is opened with O_NONBLOCK so FIFOs cannot stall the
+ * server (which does not affect regular files).
+ **/
+static FileInfo *filecache_resolve(const char *path) {
+    int fd = -1;
+    FileInfo *info = calloc(1, sizeof(FileInfo));
+    if (!info) {
+        return NULL;
+    }
+    info->fd         = -1;
+    info->generation = mimetypes_generation();
+    for (Encoding e = ENCODING_IDENTITY; e < ENCODING_COUNT; e++) {
+        info->sidecars[e] = -1;
+    }
+
+    /* Determine request path (execute-only scripts cannot be opened for reading) */
+    bool readable = (fd = open_request_path(path, O_RDONLY | O_NONBLOCK)) >= 0;
+    if (!readable && errno == EACCES) {
+        fd = open_request_path(path, O_PATH);
+    }
+    info->path = fd < 0 ? NULL : request_path(path);
+    trace_mark(PATH);
+    if (!info->path) {
+        goto fail;
+    }
+
+    /* Determine file type */
+    if (fstat(fd, &info->st) < 0) {
+        trace_mark(STAT);
+        goto fail;
+    }
+    info->executable = !S_ISDIR(info->st.st_mode) && filecache_executable(fd, info->path);
+    trace_mark(STAT);
+
+    if (S_ISDIR(info->st.st_mode)) {
+        info->mimetype = "text/html";
+    } else if (!info->executable) {
+        info->mimetype = determine_mimetype(info->path);
+        trace_mark(MIMETYPE);
+        if (!readable) {
+            goto fail;
+        }
+        info->fd = fd;
+        fd       = -1;
+        info->compressible = compress_compressible(info->mimetype);
+        filecache_sidecars(info, path);
+        validators_init(info);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (NotifyFd >= 0) {
+        filecache_watches(info);
+    }
+
+    return info;
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    filecache_free(info);
+    return NULL;
+}
+
+/**
+ * Lookup file information for URI.
+ *
+ * @param   uri         Resource path of URI.
+ * @return  Cache entry containing FileInfo structure (or NULL if the URI does
+ * not resolve to an existing file under RootPath).
+ *
+ * The URI is normalized first (see normalize_uri), so differently spelled
+ * URIs of the same resource share an entry.  On a miss, this opens the path
+ * beneath RootPath, stats it, checks whether it is executable, determines
+ * its mimetype, and keeps regular files open.  The results are cached by
+ * normalized URI (up to FileCacheSize entries) and invalidated through
+ * inotify watches on every directory along its path (or a reload of the mimetypes),
+ * so repeated requests for the same resource need no syscalls at all.
+ *
+ * The returned entry must be released with filecache_release.
+ **/
+CacheEntry *filecache_lookup(const char *uri) {
+    pthread_once(&FilesOnce, filecache_init);
+
+    if (NotifyFd >= 0) {
+        filecache_drain();
+    }
+
+    char path[PATH_MAX];
+    if (!normalize_uri(uri, path, sizeof(path))) {
+        return NULL;
+    }
+
+    /* Entries resolved before a mimetypes reload are replaced */
+    size_t      generation = mimetypes_generation();
+    CacheEntry *entry      = cache_get(&Files, path);
+    if (entry) {
+        if (((FileInfo *)entry->data)->generation == generation) {
+            return entry;
+        }
+        cache_release(&Files, entry);
+    }
+
+    FileInfo *info = filecache_resolve(path);
+    if (!info) {
+        return NULL;
+    }
+
+    /* Only cache what can be invalidated */
+    if (!info->nwds) {
+        return cache_entry(&Files, path, info, 0);
+    }
+
+    return cache_put(&Files, path, info, 0);
+}
+
+/**
+ * Release file cache entry.
+ *
+ * @param   entry       Cache entry (may be NULL).
+ **/
+void filecache_release(CacheEntry *entry) {
+    cache_release(&Files, entry);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
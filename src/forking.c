@@ -18,6 +18,10 @@
  * handle the request.
  **/
 int forking_server(int sfd) {
+    /* Each child handles a single connection, so caching file information
+     * (and setting up inotify for it) would be wasted work */
+    FileCacheSize = 0;
+
     /* Accept and handle HTTP request */
     while (true) {
     	/* Accept request */
@@ -27,6 +31,9 @@ int forking_server(int sfd) {
             continue;
         }
 
+        /* Reload mimetypes (if requested) so children inherit them */
+        mimetypes_refresh();
+
 
 	/* Ignore children */
         signal(SIGCHLD, SIG_IGN);
@@ -38,7 +45,9 @@ int forking_server(int sfd) {
         }
         else if(pid == 0) {
             close(sfd);
-            handle_request(request);
+            logger_synchronous();
+            handle_connection(request);
+            free_request(request);
             exit(EXIT_SUCCESS);
         }
         else {
@@ -0,0 +1,30 @@
+/* globals.c: Server Configuration */
+
+#include "spidey.h"
+
+/*
+ * Defaults of the server's configuration (overridden by spidey's command
+ * line options).  They live in the library so every program linked with it
+ * (ie. bin/microbench) runs with the same defaults as the server.
+ */
+
+/* Global Variables */
+char *Port            = "9898";
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath        = "www";
+size_t Workers        = 0;
+size_t WorkerRequests = 0;
+size_t Threads        = 0;
+int KeepAliveTimeout  = 5;
+size_t FileCacheSize  = 256;
+size_t ContentCacheSize = 0;
+size_t CompressCacheSize = 16 * 1024 * 1024;
+size_t CGIWorkers     = 4;
+size_t CGICacheSize   = 8 * 1024 * 1024;
+char *AccessLogPath   = NULL;
+size_t AccessSampling = 1;
+char *TracePath       = NULL;
+size_t TraceSampling  = 1;
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -4,10 +4,13 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -15,7 +18,31 @@
 Status handle_browse_request(Request *request);
 Status handle_file_request(Request *request);
 Status handle_cgi_request(Request *request);
+Status handle_worker_request(Request *request);
+Status handle_stats_request(Request *request);
 Status handle_error(Request *request, Status status);
+void   write_response_headers(Request *request, Status status, const char *mimetype, ssize_t length);
+const char *connection_header(Request *request);
+static int compare_names(const void *a, const void *b);
+static void transmit_content(Request *request, Content *content);
+static Status handle_range_request(Request *request, ByteRange *ranges, int count);
+static Status handle_not_modified(Request *request, Encoding encoding);
+static Status handle_page_request(Request *request, Listing *listing, size_t offset, size_t limit);
+static Status handle_stream_request(Request *request, ListingReader *reader, char **names, size_t n, size_t offset, size_t limit);
+static bool query_number(const char *query, const char *name, size_t *value);
+static bool handle_defer(Request *request, Status (*handle)(Request *), StatsHandler handler, const struct timespec *started, size_t sent, TraceRecord *trace);
+static void handle_finish(Request *request, Status result, StatsHandler handler, const struct timespec *started, size_t sent, TraceRecord *trace);
+
+/* Request handed to another thread to finish (see handle_defer) */
+struct offload {
+    Request         *request;           /*< Request being handled */
+    Status         (*handle)(Request *);/*< Handler to run */
+    StatsHandler     handler;           /*< Metrics of handler */
+    struct timespec  started;           /*< Time request was started */
+    size_t           sent;              /*< Bytes sent on connection before request */
+    TraceRecord     *trace;             /*< Trace record (or NULL if not sampled) */
+    TraceRecord      record;            /*< Storage of trace record */
+};
 
 /**
  * Handle HTTP Request.
@@ -23,102 +50,499 @@ Status handle_error(Request *request, Status status);
  * @param   r           HTTP Request structure
  * @return  Status of the HTTP request.
  *
- * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * This parses a request, looks up the request path and its file information
+ * in the file cache, and then dispatches to the appropriate handler type.
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
+ *
+ * Every request is timed and counted in the metrics of the handler it was
+ * dispatched to, and sampled requests (see logger_sample) are also recorded
+ * in the access log and the trace file (see trace_begin).
+ *
+ * If the request has an offload function (see event_server), CGI scripts and
+ * workers are handed to it instead of being run here, and the request is
+ * finished by handle_offload on another thread.  HTTP_STATUS_OK is returned
+ * and the request (and its connection) must no longer be touched.
  **/
 Status  handle_request(Request *r) {
     Status result;
+    StatsHandler handler = STATS_ERROR;
+    struct timespec started;
+    size_t sent = transmit_sent(r);
+    TraceRecord record;
+    TraceRecord *trace = trace_begin(r, &record);
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    /* Open socket stream (without it, nothing can be sent) */
+    if (!open_request(r)) {
+        r->keep_alive = false;
+        result = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        goto done;
+    }
 
     /* Parse request */
-    if(parse_request(r) < 0) {
-        result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
-        return result;
+    result = parse_request(r);
+    trace_mark(PARSE);
+    if(result != HTTP_STATUS_OK) {
+        r->keep_alive = false;
+        result = handle_error(r, result);
+        goto done;
     }
 
-    /* Determine request path */
-    r->path = determine_request_path( r->uri );
-    if(!(r->path)){
+    /* Report metrics */
+    if (streq(r->uri, STATS_URI)) {
+        handler = STATS_STATS;
+        result  = handle_stats_request(r);
+        goto done;
+    }
+
+    /* Determine request path and file information */
+    r->file = filecache_lookup( r->uri );
+    if(!(r->file)){
       debug("Cannot determine request path");
       result = handle_error(r, HTTP_STATUS_NOT_FOUND);
-      return result;
+      goto done;
     }
+    FileInfo *info = r->file->data;
+    r->path = info->path;
     debug("HTTP REQUEST PATH: %s", r->path);
 
     /* Dispatch to appropriate request handler type based on file type */
-  struct stat s;
-
-  if(stat(r->path, &s) == 0){
-    if( S_ISDIR(s.st_mode)){
-      debug("directory");
-      result = handle_browse_request( r );
-    }
-    if(access((r->path), X_OK) == 0) {
-        debug("cgi");
-        result = handle_cgi_request(r);
-    }
-    else {
-      debug("file");
-      result = handle_file_request( r );
-    }
+  if( S_ISDIR(info->st.st_mode)){
+    debug("directory");
+    handler = STATS_BROWSE;
+    result = handle_browse_request( r );
+  }
+  else if(info->executable && cgi_is_worker(r->path)) {
+      debug("worker");
+      handler = STATS_WORKER;
+      if (r->offload && handle_defer(r, handle_worker_request, handler, &started, sent, trace)) {
+          return HTTP_STATUS_OK;
+      }
+      result = handle_worker_request(r);
+  }
+  else if(info->executable) {
+      debug("cgi");
+      handler = STATS_CGI;
+      if (r->offload && handle_defer(r, handle_cgi_request, handler, &started, sent, trace)) {
+          return HTTP_STATUS_OK;
+      }
+      result = handle_cgi_request(r);
   }
-  else{
-    result = handle_error( r , HTTP_STATUS_BAD_REQUEST );
+  else {
+    debug("file");
+    handler = STATS_FILE;
+    result = handle_file_request( r );
   }
   log("HTTP REQUEST STATUS: %s", http_status_string(result));
 
+done:
+    handle_finish(r, result, handler, &started, sent, trace);
     return result;
 }
 
+/**
+ * Finish HTTP Request handed to another thread by handle_request.
+ *
+ * @param   offload     Offloaded request (freed when done).
+ *
+ * This runs the handler on the calling thread and then records the request
+ * as handle_request would have.  The connection is left to the caller.
+ **/
+void    handle_offload(Offload *offload) {
+    Request *r = offload->request;
+
+    TraceCurrent = offload->trace;
+
+    Status result = offload->handle(r);
+    log("HTTP REQUEST STATUS: %s", http_status_string(result));
+
+    handle_finish(r, result, offload->handler, &offload->started, offload->sent, offload->trace);
+    free(offload);
+}
+
+/**
+ * Hand HTTP Request to the offload function of the request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   handle      Handler to run.
+ * @param   handler     Metrics of handler.
+ * @param   started     Time request was started.
+ * @param   sent        Bytes sent on connection before request.
+ * @param   trace       Trace record of request (or NULL).
+ * @return  Whether or not the request was handed off (otherwise the handler
+ * must be run inline).
+ *
+ * The trace record lives on the stack of handle_request, so it is copied.
+ **/
+static bool handle_defer(Request *r, Status (*handle)(Request *), StatsHandler handler, const struct timespec *started, size_t sent, TraceRecord *trace) {
+    Offload *offload = malloc(sizeof(Offload));
+    if (!offload) {
+        return false;
+    }
+
+    offload->request = r;
+    offload->handle  = handle;
+    offload->handler = handler;
+    offload->started = *started;
+    offload->sent    = sent;
+    offload->trace   = NULL;
+    if (trace) {
+        offload->record = *trace;
+        offload->trace  = &offload->record;
+    }
+
+    TraceCurrent = NULL;
+    if (!r->offload(offload)) {
+        TraceCurrent = trace;
+        free(offload);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Record metrics, access log, and trace of a finished HTTP Request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   result      Status of the request.
+ * @param   handler     Metrics of handler.
+ * @param   started     Time request was started.
+ * @param   sent        Bytes sent on connection before request.
+ * @param   trace       Trace record of request (or NULL).
+ **/
+static void handle_finish(Request *r, Status result, StatsHandler handler, const struct timespec *started, size_t sent, TraceRecord *trace) {
+    sent = transmit_sent(r) - sent;
+    stats_request(handler, result, started, sent);
+    if (logger_sample()) {
+        logger_access(r, result, started, sent);
+    }
+    TRACE_PROBE(LAST_BYTE);
+    if (trace) {
+        trace_end(trace, result, handler);
+    }
+}
+
+/**
+ * Handle HTTP requests on a persistent connection.
+ *
+ * @param   r           HTTP Request structure
+ * @return  Number of requests handled.
+ *
+ * This handles requests until the client asks to close the connection, the
+ * connection is idle for KeepAliveTimeout seconds, or a response cannot be
+ * delimited (ie. CGI output).  Responses to pipelined requests that are
+ * already buffered are not flushed until the pipeline is drained.
+ **/
+size_t  handle_connection(Request *r) {
+    size_t handled = 0;
+
+    stats_connection(true);
+    while (true) {
+        handle_request(r);
+        handled++;
+        if (!r->keep_alive) {
+            break;
+        }
+
+        reset_request(r);
+        if (r->offset == r->length && !idle_request(r)) {
+            break;
+        }
+
+        if (!wait_request(r, KeepAliveTimeout * 1000)) {
+            break;
+        }
+    }
+    stats_connection(false);
+
+    return handled;
+}
+
+/**
+ * Write HTTP response status line and common headers.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      HTTP status of response.
+ * @param   mimetype    Content-Type of response.
+ * @param   length      Content-Length of response (or -1 if unknown).
+ *
+ * The response uses the same HTTP version as the request.  The caller must
+ * terminate the headers with a blank line.
+ **/
+void    write_response_headers(Request *r, Status status, const char *mimetype, ssize_t length) {
+    fprintf(r->stream, "HTTP/1.%d %s\r\n", r->version, http_status_string(status));
+    fprintf(r->stream, "Content-Type: %s\r\n", mimetype);
+
+    if (length >= 0) {
+        fprintf(r->stream, "Content-Length: %zd\r\n", length);
+    } else {
+        r->keep_alive = false;
+    }
+
+    fputs(connection_header(r), r->stream);
+}
+
+/**
+ * Return Connection header needed for response (if any).
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Connection header line (or empty string).
+ *
+ * Only the non-default behavior of the request's HTTP version is announced.
+ **/
+const char *connection_header(Request *r) {
+    if (r->version >= 1 && !r->keep_alive) {
+        return "Connection: close\r\n";
+    } else if (r->version < 1 && r->keep_alive) {
+        return "Connection: keep-alive\r\n";
+    }
+    return "";
+}
+
 /**
  * Handle browse request.
  *
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP browse request.
  *
- * This lists the contents of a directory in HTML.
+ * This lists the contents of a directory in HTML, sorted by name.  Rendered
+ * listings are cached per directory until it changes, so repeated requests
+ * are answered with a single writev, and requests that page through the
+ * directory with "?offset=N&limit=M" are rendered from the cached names (see
+ * handle_page_request).
+ *
+ * Directories with more than LISTING_MAX_SORTED entries are instead streamed
+ * in directory order as the entries are read (see handle_stream_request).
  *
- * If the path cannot be opened or scanned as a directory, then handle error
- * with HTTP_STATUS_NOT_FOUND.
+ * If the path cannot be opened as a directory, then handle error with
+ * HTTP_STATUS_NOT_FOUND.
  **/
 Status  handle_browse_request(Request *r) {
-  struct dirent **entries;
-  int n;
-
-  /* Open a directory for reading or scanning */
-  n = scandir(r->path, &entries, 0, alphasort);
-  if (!n) {
-    debug("Could not scan directory: %s", strerror(errno));
-      handle_error(r, HTTP_STATUS_NOT_FOUND);
-  }
+    FileInfo     *info   = r->file->data;
+    ListingReader reader;
+    size_t        offset = 0;
+    size_t        limit  = SIZE_MAX;
+    bool          paged  = query_number(r->query, "offset", &offset);
+    paged = query_number(r->query, "limit", &limit) || paged;
+    limit = limit ? limit : 1;
+
+    /* Answer from listing cache */
+    CacheEntry *entry = listing_lookup(r->uri, info);
+    if (entry) {
+        Listing *listing = entry->data;
+        Status   status  = HTTP_STATUS_OK;
+        if (paged) {
+            status = handle_page_request(r, listing, offset, limit);
+        } else {
+            transmit_content(r, &listing->content);
+        }
+        listing_release(entry);
+        return status;
+    }
 
-  /* Write HTTP Header with OK Status and text/html Content-Type */
-  fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
-  fprintf(r->stream, "Content-Type: text/html\r\n");
-  fprintf(r->stream, "\r\n");
-
-  /* For each entry in directory, emit HTML list item */
-  fprintf(r->stream, "<ul>\n");
-  for( int i = 0; i < n; i++){
-    if (streq(entries[i]->d_name, ".")) {
-        free(entries[i]);
-        continue;
-    }
-    char buffer[512];
-    if(strcmp(r->uri, "/"))
-        sprintf(buffer, "%s/%s", r->uri, entries[i]->d_name);
-    else
-        sprintf(buffer, "%s%s", r->uri, entries[i]->d_name);
-    debug("Possible link: %s", buffer); 
-    fprintf(r->stream, "<li><a href=\"%s\">%s</a></li>\n", buffer,  entries[i]->d_name);
-    free(entries[i]);
-  }
-  free(entries);
-  fprintf(r->stream, "<ul>\n");
-  /* Return OK */
-  return HTTP_STATUS_OK;
+    if (!listing_open(&reader, r->path)) {
+        debug("Could not open directory: %s", strerror(errno));
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    }
+
+    /* Collect entry names (in the request arena) */
+    size_t      capacity = 64;
+    size_t      n        = 0;
+    char      **names    = arena_alloc(&r->arena, capacity * sizeof(char *));
+    const char *name;
+
+    while (names && n < LISTING_MAX_SORTED && (name = listing_next(&reader))) {
+        if (n == capacity) {
+            char **grown = arena_alloc(&r->arena, 2 * capacity * sizeof(char *));
+            if (grown) {
+                memcpy(grown, names, capacity * sizeof(char *));
+                capacity *= 2;
+            }
+            names = grown;
+        }
+        if (names && !(names[n++] = arena_strdup(&r->arena, name))) {
+            names = NULL;
+        }
+    }
+
+    if (!names) {
+        listing_close(&reader);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Too many entries to sort: stream the rest of the directory */
+    if (n == LISTING_MAX_SORTED) {
+        Status status = handle_stream_request(r, &reader, names, n, offset, limit);
+        listing_close(&reader);
+        return status;
+    }
+    listing_close(&reader);
+
+    /* Render, cache, and send sorted listing */
+    qsort(names, n, sizeof(char *), compare_names);
+
+    Listing *listing = listing_render(r->uri, info, names, n);
+    if (!listing || !(entry = listing_store(info, listing))) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    Status status = HTTP_STATUS_OK;
+    if (paged) {
+        status = handle_page_request(r, listing, offset, limit);
+    } else {
+        transmit_content(r, &listing->content);
+    }
+    listing_release(entry);
+    return status;
+}
+
+/**
+ * Send one page of a cached directory listing.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   listing     Cached listing of directory.
+ * @param   offset      Number of entries to skip.
+ * @param   limit       Maximum number of entries to list (at least 1).
+ * @return  Status of the HTTP browse request.
+ *
+ * The page is rendered in the request arena, so its length is known and the
+ * connection can be kept alive.  If entries remain past the page, a link to
+ * the next page is appended.
+ **/
+static Status handle_page_request(Request *r, Listing *listing, size_t offset, size_t limit) {
+    size_t first = offset < listing->count ? offset : listing->count;
+    size_t last  = limit < listing->count - first ? first + limit : listing->count;
+    size_t length = strlen("<ul>\n</ul>\n");
+    char   next[BUFSIZ] = "";
+
+    for (size_t i = first; i < last; i++) {
+        length += listing_item(NULL, 0, listing->uri, listing->names[i]);
+    }
+    if (last < listing->count) {
+        length += snprintf(next, sizeof(next), "<li><a rel=\"next\" href=\"%s?offset=%zu&limit=%zu\">...</a></li>\n",
+                           listing->uri, last, limit);
+    }
+
+    char *body = arena_alloc(&r->arena, length + 1);
+    if (!body) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
 
+    char *p = stpcpy(body, "<ul>\n");
+    for (size_t i = first; i < last; i++) {
+        p += listing_item(p, length + 1 - (p - body), listing->uri, listing->names[i]);
+    }
+    p = stpcpy(p, next);
+    strcpy(p, "</ul>\n");
+
+    write_response_headers(r, HTTP_STATUS_OK, "text/html", length);
+    fputs("\r\n", r->stream);
+    fwrite(body, 1, length, r->stream);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Stream directory listing.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   reader      Open listing reader.
+ * @param   names       Names already read from reader.
+ * @param   n           Number of names already read.
+ * @param   offset      Number of entries to skip.
+ * @param   limit       Maximum number of entries to list.
+ * @return  Status of the HTTP browse request.
+ *
+ * Entries are written as they are read, in directory order, so memory use
+ * does not depend on the size of the directory.  Since the length of the
+ * listing is unknown, the connection is closed afterwards.  If the limit cuts
+ * the listing short, a link to the next page is appended.
+ **/
+static Status handle_stream_request(Request *r, ListingReader *reader, char **names, size_t n, size_t offset, size_t limit) {
+    char        item[BUFSIZ];
+    const char *name;
+    size_t      index = 0;
+    size_t      count = 0;
+
+    write_response_headers(r, HTTP_STATUS_OK, "text/html", -1);
+    fprintf(r->stream, "\r\n<ul>\n");
+
+    while ((name = index < n ? names[index] : listing_next(reader))) {
+        if (index++ < offset) {
+            continue;
+        }
+        if (count == limit) {
+            fprintf(r->stream, "<li><a rel=\"next\" href=\"%s?offset=%zu&limit=%zu\">...</a></li>\n",
+                    r->uri, offset + limit, limit);
+            break;
+        }
+
+        int length = listing_item(item, sizeof(item), r->uri, name);
+        if (length > 0 && fwrite(item, 1, length, r->stream) != (size_t)length) {
+            break;
+        }
+        count++;
+    }
+
+    fprintf(r->stream, "</ul>\n");
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Parse numeric query parameter.
+ *
+ * @param   query       Query string (ie. "offset=100&limit=50").
+ * @param   name        Name of parameter.
+ * @param   value       Set to value of parameter (unchanged if absent).
+ * @return  Whether or not the parameter is present.
+ **/
+static bool query_number(const char *query, const char *name, size_t *value) {
+    size_t length = strlen(name);
+
+    for (const char *s = query; s && *s; s += strcspn(s, "&"), s += (*s == '&')) {
+        if (strncmp(s, name, length) == 0 && s[length] == '=') {
+            *value = strtoull(s + length + 1, NULL, 10);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Compare directory entry names (for qsort).
+ *
+ * @param   a           Pointer to first name.
+ * @param   b           Pointer to second name.
+ * @return  Ordering of names (like alphasort).
+ **/
+static int compare_names(const void *a, const void *b) {
+    return strcoll(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Transmit cached response.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   content     Cached content (with pre-rendered headers).
+ *
+ * The status line, headers, and body are sent in a single writev.
+ **/
+static void transmit_content(Request *r, Content *content) {
+    const char *status     = r->version >= 1 ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.0 200 OK\r\n";
+    const char *connection = connection_header(r);
+    struct iovec iov[] = {
+        {(void *)status,      strlen(status)},
+        {content->headers,    content->headers_length},
+        {(void *)connection,  strlen(connection)},
+        {"\r\n",             2},
+        {content->body,       content->length},
+    };
+
+    if (transmit_iov(r, iov, sizeof(iov) / sizeof(iov[0])) < 0) {
+      debug("Unable to transmit content: %s", strerror(errno));
+      r->keep_alive = false;
+    }
 }
 
 /**
@@ -127,51 +551,195 @@ Status  handle_browse_request(Request *r) {
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * This transmits the contents of the specified file (already opened by the
+ * file cache) to the socket without copying them through user space (see
+ * transmit_file).
  *
- * If the path cannot be opened for reading, then handle error with
- * HTTP_STATUS_NOT_FOUND.
+ * Small, frequently requested files are answered from the content cache
+ * instead, with the status line, pre-rendered headers, and body sent in a
+ * single writev.
+ *
+ * Range requests are answered with just the requested bytes of the file (see
+ * handle_range_request).
+ *
+ * Responses carry ETag and Last-Modified validators, and conditional
+ * requests for a current copy are answered with 304 Not Modified.
+ *
+ * If the client accepts a content encoding, a precompressed sidecar (ie.
+ * foo.html.gz) is sent when present, otherwise text-like files are
+ * compressed once and answered from the compressed content cache.
  **/
 Status  handle_file_request(Request *r) {
-    char *mimetype = NULL;
-    size_t nread;
+    FileInfo   *info       = r->file->data;
+    CacheEntry *compressed = NULL;
+    char        validators[BUFSIZ];
+
+    /* Select representation: ranges are always of the uncompressed file,
+     * otherwise use a compressed variant if the client accepts one */
+    Encoding encoding = r->known[HEADER_RANGE] ? ENCODING_IDENTITY : compress_negotiate(r, info);
+    if (encoding != ENCODING_IDENTITY && info->sidecars[encoding] < 0) {
+        compressed = compress_lookup(info, encoding);
+        if (!compressed) {
+            encoding = ENCODING_IDENTITY;
+        }
+    }
 
-    /* Open file for reading */
-    FILE *fs = fopen( r->path , "r");   // TODO:  make sure you wanna open r
-    if( !fs ){
-      debug("Unable to open file: %s", strerror(errno));
-      handle_error(r, HTTP_STATUS_NOT_FOUND);
+    /* Answer conditional request without a body if client copy is current */
+    if (validators_not_modified(r, info, encoding)) {
+        compress_release(compressed);
+        return handle_not_modified(r, encoding);
+    }
+    validators_render(validators, sizeof(validators), info, encoding);
+
+    /* Answer with requested byte ranges */
+    if (r->known[HEADER_RANGE] && validators_if_range(r, info)) {
+        ByteRange ranges[RANGE_MAX];
+        int       count = range_parse(r->known[HEADER_RANGE], info->st.st_size, ranges, RANGE_MAX);
+        if (count != 0) {
+            return handle_range_request(r, ranges, count);
+        }
     }
 
-    /* Determine mimetype */
-    mimetype =  determine_mimetype(r->path);
-    if( !mimetype ){
-      goto fail;
+    /* Answer with precompressed sidecar */
+    if (encoding != ENCODING_IDENTITY && !compressed) {
+        write_response_headers(r, HTTP_STATUS_OK, info->mimetype, info->sidecar_sizes[encoding]);
+        fprintf(r->stream, "%sContent-Encoding: %s\r\nVary: Accept-Encoding\r\n\r\n", validators, EncodingNames[encoding]);
+
+        if (transmit_file(r, info->sidecars[encoding], 0, info->sidecar_sizes[encoding]) != info->sidecar_sizes[encoding]) {
+          debug("Unable to transmit file: %s", strerror(errno));
+          r->keep_alive = false;
+        }
+        return HTTP_STATUS_OK;
     }
 
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->stream, "Content-Type: %s\r\n", mimetype);
-    fprintf(r->stream, "\r\n");
+    /* Answer from compressed content cache */
+    if (compressed) {
+        transmit_content(r, compressed->data);
+        compress_release(compressed);
+        return HTTP_STATUS_OK;
+    }
+
+    /* Answer from content cache */
+    CacheEntry *entry = contentcache_lookup(info);
+    if (entry) {
+        transmit_content(r, entry->data);
+        contentcache_release(entry);
+        return HTTP_STATUS_OK;
+    }
+
+    /* Write HTTP Headers with OK status, determined Content-Type, and Length */
+    write_response_headers(r, HTTP_STATUS_OK, info->mimetype, info->st.st_size);
+    fprintf(r->stream, "Accept-Ranges: bytes\r\n%s%s\r\n", validators, compress_varies(info) ? "Vary: Accept-Encoding\r\n" : "");
 
-    /* Read from file and write to socket in chunks */
-    char buffer[BUFSIZ];
-    nread = fread(buffer, 1, BUFSIZ, fs);
-    while (nread > 0 ){
-      fwrite(buffer, 1, nread, r->stream);
-      nread = fread(buffer, 1, BUFSIZ, fs);
+    /* Transmit file to socket (a short transmission leaves the connection
+     * out of sync, so it cannot be reused) */
+    if (transmit_file(r, info->fd, 0, info->st.st_size) != info->st.st_size) {
+      debug("Unable to transmit file: %s", strerror(errno));
+      r->keep_alive = false;
     }
 
-    /* Close file, deallocate mimetype, return OK */
-    fclose(fs);
-    free(mimetype);
+    /* Return OK */
     return HTTP_STATUS_OK;
+}
 
-fail:
-    /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-    free(mimetype);
-    fclose(fs);
-    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+/**
+ * Handle conditional request for a current file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   encoding    Content encoding of selected representation.
+ * @return  HTTP_STATUS_NOT_MODIFIED.
+ *
+ * The response consists of just the status line and the validators of the
+ * representation, so the client reuses its cached copy.
+ **/
+static Status handle_not_modified(Request *r, Encoding encoding) {
+    FileInfo *info = r->file->data;
+    char      validators[BUFSIZ];
+
+    validators_render(validators, sizeof(validators), info, encoding);
+    fprintf(r->stream, "HTTP/1.%d %s\r\n%s%s%s\r\n", r->version, http_status_string(HTTP_STATUS_NOT_MODIFIED),
+            validators, compress_varies(info) ? "Vary: Accept-Encoding\r\n" : "", connection_header(r));
+    return HTTP_STATUS_NOT_MODIFIED;
+}
+
+/**
+ * Handle range request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   ranges      Satisfiable byte ranges of file.
+ * @param   count       Number of ranges (or -1 if none are satisfiable).
+ * @return  Status of the HTTP range request.
+ *
+ * A single range is sent as the body of a 206 Partial Content response with
+ * a Content-Range header.  Multiple ranges are sent as a multipart/byteranges
+ * body, whose length is computed up front so the connection can be kept
+ * alive.  Each span is transmitted from the file with zero-copy offsets.
+ *
+ * If no range can be satisfied, then respond with
+ * HTTP_STATUS_RANGE_NOT_SATISFIABLE and the size of the file.
+ *
+ * Ranges always apply to the identity encoding, but like the full response
+ * they are marked as varying with Accept-Encoding if the file may be sent
+ * compressed, so caches do not mix up representations.
+ **/
+static Status handle_range_request(Request *r, ByteRange *ranges, int count) {
+    static const char *Boundary = "SPIDEY_BYTERANGES";
+    FileInfo   *info = r->file->data;
+    off_t       size = info->st.st_size;
+    const char *vary = compress_varies(info) ? "Vary: Accept-Encoding\r\n" : "";
+    char        validators[BUFSIZ];
+
+    validators_render(validators, sizeof(validators), info, ENCODING_IDENTITY);
+
+    if (count < 0) {
+        const char *status_string = http_status_string(HTTP_STATUS_RANGE_NOT_SATISFIABLE);
+        write_response_headers(r, HTTP_STATUS_RANGE_NOT_SATISFIABLE, "text/html", strlen(status_string) + 1);
+        fprintf(r->stream, "%sContent-Range: bytes */%jd\r\n\r\n", vary, (intmax_t)size);
+        fprintf(r->stream, "%s\n", status_string);
+        return HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+    }
+
+    if (count == 1) {
+        write_response_headers(r, HTTP_STATUS_PARTIAL_CONTENT, info->mimetype, ranges[0].length);
+        fprintf(r->stream, "Accept-Ranges: bytes\r\n%s%sContent-Range: bytes %jd-%jd/%jd\r\n\r\n", validators, vary,
+                (intmax_t)ranges[0].offset, (intmax_t)(ranges[0].offset + ranges[0].length - 1), (intmax_t)size);
+
+        if (transmit_file(r, info->fd, ranges[0].offset, ranges[0].length) != ranges[0].length) {
+          debug("Unable to transmit range: %s", strerror(errno));
+          r->keep_alive = false;
+        }
+        return HTTP_STATUS_PARTIAL_CONTENT;
+    }
+
+    /* Determine length of multipart body */
+    const char *format = "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %jd-%jd/%jd\r\n\r\n";
+    ssize_t     length = snprintf(NULL, 0, "\r\n--%s--\r\n", Boundary);
+    for (int i = 0; i < count; i++) {
+        length += snprintf(NULL, 0, format, Boundary, info->mimetype, (intmax_t)ranges[i].offset,
+                           (intmax_t)(ranges[i].offset + ranges[i].length - 1), (intmax_t)size);
+        length += ranges[i].length;
+    }
+
+    /* Write HTTP Headers with Partial Content status and multipart type */
+    char mimetype[BUFSIZ];
+    snprintf(mimetype, sizeof(mimetype), "multipart/byteranges; boundary=%s", Boundary);
+    write_response_headers(r, HTTP_STATUS_PARTIAL_CONTENT, mimetype, length);
+    fprintf(r->stream, "Accept-Ranges: bytes\r\n%s%s\r\n", validators, vary);
+
+    /* Write each part header followed by its span of the file */
+    for (int i = 0; i < count; i++) {
+        fprintf(r->stream, format, Boundary, info->mimetype, (intmax_t)ranges[i].offset,
+                (intmax_t)(ranges[i].offset + ranges[i].length - 1), (intmax_t)size);
+
+        if (transmit_file(r, info->fd, ranges[i].offset, ranges[i].length) != ranges[i].length) {
+          debug("Unable to transmit range: %s", strerror(errno));
+          r->keep_alive = false;
+          return HTTP_STATUS_PARTIAL_CONTENT;
+        }
+    }
+    fprintf(r->stream, "\r\n--%s--\r\n", Boundary);
+
+    return HTTP_STATUS_PARTIAL_CONTENT;
 }
 
 /**
@@ -180,62 +748,83 @@ fail:
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * This runs the specified executable and streams its output to the socket
+ * (see cgi_request).
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * If the script cannot be started, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR, and if it does not finish its output in
+ * time, with HTTP_STATUS_GATEWAY_TIMEOUT.
+ *
+ * The script writes its own response headers, so the length of the response
+ * is unknown and the connection is closed afterwards.
  **/
 Status  handle_cgi_request(Request *r) {
-    FILE *pfs;
-    char buffer[BUFSIZ];
-
-    /* Export CGI environment variables from request:
-     * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
-    setenv("QUERY_STRING",   r->query, 1);
-    setenv("DOCUMENT_ROOT",  RootPath, 1);
-    setenv("REMOTE_ADDR",    r->host, 1);
-    setenv("REMOTE_PORT",    r->port, 1);
-    setenv("REQUEST_METHOD", r->method, 1);
-    setenv("REQUEST_URI",    r->uri, 1);
-    setenv("SCRIPT_FILENAME",r->path, 1);
-    setenv("SERVER_PORT",    Port, 1);
-
-    /* Export CGI environment variables from request headers */
-    for(Header* h = r->headers; h; h = h->next) {
-        char var_name[BUFSIZ];
-        char *temp = strdup(h->name);
-        for(char *c = temp; *c; c++) {
-            if(*c == '-')
-                *c = '_';
-            else
-                *c = toupper(*c);
-        }
+    r->keep_alive = false;
 
-        sprintf(var_name, "HTTP_%s", temp); 
-        setenv(var_name, h->data, 1);
-        free(temp);
+    Status status = cgi_request(r);
+    if (status != HTTP_STATUS_OK) {
+        return handle_error(r, status);
     }
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Handle persistent worker request
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP worker request.
+ *
+ * This passes the request to a persistent worker of the script (see
+ * cgi_worker_request), which avoids starting a process per request.
+ *
+ * If no worker can handle the request, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR (or HTTP_STATUS_GATEWAY_TIMEOUT if the
+ * worker did not respond in time).
+ *
+ * Like a CGI script, the worker writes its own response headers, so the
+ * connection is closed afterwards.
+ **/
+Status  handle_worker_request(Request *r) {
+    r->keep_alive = false;
 
-    /* POpen CGI Script */
-    pfs = popen(r->path ,"r");
-    if(!pfs) {
-        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    Status status = cgi_worker_request(r);
+    if (status != HTTP_STATUS_OK) {
+        return handle_error(r, status);
     }
+    return HTTP_STATUS_OK;
+}
 
-    /* Copy data from popen to socket */
-    size_t nread = fread(buffer, 1, BUFSIZ, pfs);
-    while(nread > 0) {
-        fwrite(buffer, 1, nread, r->stream);
-        nread = fread(buffer, 1, BUFSIZ, pfs);
+/**
+ * Handle metrics request
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP metrics request.
+ *
+ * This writes the metrics of all server processes (see stats_render) in the
+ * Prometheus text format.
+ *
+ * If the metrics cannot be rendered, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ **/
+Status  handle_stats_request(Request *r) {
+    size_t length;
+    char  *metrics = stats_render(&length);
+    if (!metrics) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
 
-    /* Close popen, return OK */
-    pclose(pfs);
+    write_response_headers(r, HTTP_STATUS_OK, "text/plain; version=0.0.4", length);
+    fputs("Cache-Control: no-store\r\n\r\n", r->stream);
+
+    struct iovec iov = {metrics, length};
+    if (transmit_iov(r, &iov, 1) < 0) {
+        debug("Unable to transmit metrics: %s", strerror(errno));
+        r->keep_alive = false;
+    }
+    free(metrics);
     return HTTP_STATUS_OK;
 }
 
-
 /**
  * Handle displaying error page
  *
@@ -249,8 +838,7 @@ Status  handle_error(Request *r, Status status) {
     const char *status_string = http_status_string(status);
 
     /* Write HTTP Header */
-    fprintf(r->stream, "HTTP/1.0 %s\r\n", status_string);
-    fprintf(r->stream, "Content-Type: text/html\r\n");
+    write_response_headers(r, status, "text/html", strlen(status_string) + 1);
     fprintf(r->stream, "\r\n");
 
     /* Write HTML Description of Error*/
@@ -0,0 +1,234 @@
+/* listing.c: Directory Listings */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define LISTING_CACHE_ENTRIES   64                  /* Directories with cached listings */
+#define LISTING_CACHE_BUDGET    (8 * 1024 * 1024)   /* Bytes of cached listings */
+
+/* Directory entry as returned by getdents64 */
+
+struct linux_dirent64 {
+    ino64_t         d_ino;
+    off64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
+
+/* Global Variables */
+
+static Cache            Listings;
+static pthread_once_t   ListingsOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Initialize listing cache (once per process).
+ **/
+static void listing_init() {
+    cache_init(&Listings, LISTING_CACHE_ENTRIES, LISTING_CACHE_BUDGET, free);
+    Listings.counters = stats_cache(STATS_CACHE_LISTING);
+}
+
+/**
+ * Open directory for reading.
+ *
+ * @param   reader      Listing reader structure.
+ * @param   path        Path of directory.
+ * @return  Whether or not the directory was opened.
+ **/
+bool listing_open(ListingReader *reader, const char *path) {
+    reader->fd     = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    reader->offset = 0;
+    reader->length = 0;
+    return reader->fd >= 0;
+}
+
+/**
+ * Read next directory entry name.
+ *
+ * @param   reader      Listing reader structure.
+ * @return  Name of next entry (valid until the next call), or NULL at the
+ * end of the directory or on error.
+ *
+ * Entries are read in batches with getdents64 into the reader's buffer, in
+ * the order the filesystem returns them, so no per-entry allocation or
+ * sorting happens.  The "." entry is skipped.
+ **/
+const char *listing_next(ListingReader *reader) {
+    while (true) {
+        if (reader->offset >= reader->length) {
+            long nread = syscall(SYS_getdents64, reader->fd, reader->buffer, sizeof(reader->buffer));
+            if (nread <= 0) {
+                return NULL;
+            }
+            reader->offset = 0;
+            reader->length = nread;
+        }
+
+        struct linux_dirent64 *entry = (struct linux_dirent64 *)(reader->buffer + reader->offset);
+        reader->offset += entry->d_reclen;
+
+        if (!streq(entry->d_name, ".")) {
+            return entry->d_name;
+        }
+    }
+}
+
+/**
+ * Close directory.
+ *
+ * @param   reader      Listing reader structure.
+ **/
+void listing_close(ListingReader *reader) {
+    if (reader->fd >= 0) {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+}
+
+/**
+ * Render listing item for a directory entry.
+ *
+ * @param   buffer      Buffer to render into (or NULL to just measure).
+ * @param   size        Size of buffer.
+ * @param   uri         URI of directory.
+ * @param   name        Name of entry.
+ * @return  Length of item (like snprintf).
+ **/
+int listing_item(char *buffer, size_t size, const char *uri, const char *name) {
+    const char *separator = streq(uri, "/") ? "" : "/";
+    return snprintf(buffer, size, "<li><a href=\"%s%s%s\">%s</a></li>\n", uri, separator, name, name);
+}
+
+/**
+ * Render complete listing of a directory.
+ *
+ * @param   uri         URI of directory.
+ * @param   info        File information of directory.
+ * @param   names       Sorted names of entries.
+ * @param   count       Number of entries.
+ * @return  Newly allocated Listing structure (or NULL on error).
+ *
+ * The structure, names, headers, and body are allocated as one block, like
+ * the content cache, so the listing can be sent with transmit_content and
+ * pages of it can be rendered without reading the directory again.
+ **/
+Listing *listing_render(const char *uri, const FileInfo *info, char **names, size_t count) {
+    size_t length  = strlen("<ul>\n</ul>\n");
+    size_t strings = strlen(uri) + 1;
+    for (size_t i = 0; i < count; i++) {
+        length  += listing_item(NULL, 0, uri, names[i]);
+        strings += strlen(names[i]) + 1;
+    }
+
+    char headers[BUFSIZ];
+    int  hlength = snprintf(headers, sizeof(headers), "Content-Type: text/html\r\nContent-Length: %zu\r\n", length);
+    if (hlength < 0 || (size_t)hlength >= sizeof(headers)) {
+        return NULL;
+    }
+
+    Listing *listing = malloc(sizeof(Listing) + count * sizeof(char *) + hlength + length + 1 + strings);
+    if (!listing) {
+        return NULL;
+    }
+
+    Content *content        = &listing->content;
+    listing->names          = (char **)(listing + 1);
+    listing->count          = count;
+    content->headers        = (char *)(listing->names + count);
+    content->headers_length = hlength;
+    content->body           = content->headers + hlength;
+    content->length         = length;
+    content->size           = info->st.st_size;
+    content->ino            = info->st.st_ino;
+    content->mtime          = info->st.st_mtim;
+    content->generation     = info->generation;
+    memcpy(content->headers, headers, hlength);
+
+    char *p = stpcpy(content->body, "<ul>\n");
+    for (size_t i = 0; i < count; i++) {
+        p += listing_item(p, length + 1 - (p - content->body), uri, names[i]);
+    }
+    p = stpcpy(p, "</ul>\n") + 1;
+
+    listing->uri = p;
+    p = stpcpy(p, uri) + 1;
+    for (size_t i = 0; i < count; i++) {
+        listing->names[i] = p;
+        p = stpcpy(p, names[i]) + 1;
+    }
+
+    return listing;
+}
+
+/**
+ * Lookup cached listing of directory.
+ *
+ * @param   uri         URI of directory.
+ * @param   info        File information of directory.
+ * @return  Cache entry containing Listing structure (or NULL if the listing
+ * is not cached or the directory has changed since).
+ *
+ * Listings are keyed by the path of the directory, so the query string of
+ * the request cannot add entries, and checked against the inode and
+ * modification time of the directory, which changes whenever an entry is
+ * added, removed, or renamed.  Since the links are relative to the URI, a
+ * listing rendered for a different URI of the same directory is a miss.
+ *
+ * The returned entry must be released with listing_release.
+ **/
+CacheEntry *listing_lookup(const char *uri, const FileInfo *info) {
+    pthread_once(&ListingsOnce, listing_init);
+
+    CacheEntry *entry = cache_get(&Listings, info->path);
+    if (entry) {
+        Listing *listing = entry->data;
+        Content *content = &listing->content;
+        if (content->ino          == info->st.st_ino &&
+            content->mtime.tv_sec  == info->st.st_mtim.tv_sec &&
+            content->mtime.tv_nsec == info->st.st_mtim.tv_nsec &&
+            streq(listing->uri, uri)) {
+            return entry;
+        }
+        cache_release(&Listings, entry);
+    }
+    return NULL;
+}
+
+/**
+ * Cache rendered listing of directory.
+ *
+ * @param   info        File information of directory.
+ * @param   listing     Rendered listing (ownership passes to the cache).
+ * @return  Cache entry containing Listing structure.
+ *
+ * The returned entry must be released with listing_release.
+ **/
+CacheEntry *listing_store(const FileInfo *info, Listing *listing) {
+    pthread_once(&ListingsOnce, listing_init);
+
+    /* The last string in the block ends the allocation */
+    char *last = listing->count ? listing->names[listing->count - 1] : listing->uri;
+    char *end  = last + strlen(last) + 1;
+    return cache_put(&Listings, info->path, listing, end - (char *)listing);
+}
+
+/**
+ * Release listing cache entry.
+ *
+ * @param   entry       Cache entry (may be NULL).
+ **/
+void listing_release(CacheEntry *entry) {
+    cache_release(&Listings, entry);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
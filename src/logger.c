@@ -0,0 +1,453 @@
+/* logger.c: Asynchronous Logging */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * Each thread formats its messages into its own ring buffer, which a
+ * background writer thread drains to the log files in batches.  A ring has
+ * exactly one producer (its thread) and one consumer (the writer, or
+ * logger_flush), so it needs no lock: the producer publishes records by
+ * advancing head, and the consumer frees space by advancing tail.  When a
+ * ring is full, messages are dropped (and counted) rather than blocking the
+ * thread.
+ *
+ * The writer sleeps on an eventfd once all rings are empty, and a producer
+ * only signals it if it announced that it is about to sleep (see
+ * logger_wake).  Once woken, it lets messages accumulate briefly, so a busy
+ * server signals it about once per LOGGER_BATCH_NSEC.  Short-lived
+ * processes (ie. forked children, see logger_synchronous) write their
+ * messages right away instead of starting a writer of their own.
+ *
+ * Each record is a 2 byte length and a 1 byte channel, followed by the
+ * formatted line.
+ */
+
+/* Constants */
+
+#define LOGGER_RING_SIZE    (64 * 1024)     /* Bytes per ring (power of two) */
+#define LOGGER_RECORD_MAX   1024            /* Longest line (longer ones are truncated) */
+#define LOGGER_HEADER       3               /* Bytes of record header */
+#define LOGGER_IDLE_NSEC    10000000        /* Writer sleep when rings are empty (without eventfd) */
+#define LOGGER_BATCH_NSEC   1000000         /* Writer delay after being woken up */
+
+typedef struct logger_ring LoggerRing;
+struct logger_ring {
+    char         data[LOGGER_RING_SIZE];    /*< Records */
+    size_t       head;                      /*< Offset of next record (producer) */
+    size_t       tail;                      /*< Offset of oldest record (consumer) */
+    size_t       dropped;                   /*< Records that did not fit */
+    LoggerRing  *next;                      /*< Next ring */
+};
+
+/* Global Variables */
+
+static LoggerRing          *Rings      = NULL;
+static __thread LoggerRing *ThreadRing = NULL;
+static pthread_mutex_t      RingsLock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t      DrainLock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t       LoggerOnce = PTHREAD_ONCE_INIT;
+static pid_t                WriterPid  = 0;
+static pid_t                LoggerPid  = 0;
+static int                  Channels[] = {STDERR_FILENO, -1, -1};
+static int                  Wakeup     = -1;        /* eventfd the writer sleeps on */
+static bool                 Sleeping   = false;     /* Whether the writer waits for Wakeup */
+static bool                 Synchronous = false;    /* Whether messages are written right away */
+static __thread size_t      Sampled    = 0;
+
+/**
+ * Write all data to log file.
+ *
+ * @param   fd          Log file descriptor.
+ * @param   data        Data to write.
+ * @param   length      Length of data.
+ *
+ * Errors are ignored, since there is nowhere left to report them.
+ **/
+static void logger_output(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        data   += n;
+        length -= n;
+    }
+}
+
+/**
+ * Drain all rings to the log files (caller must hold DrainLock).
+ *
+ * @return  Number of records written.
+ **/
+static size_t logger_drain() {
+    static char buffers[LOG_CHANNELS][LOGGER_RING_SIZE];
+    size_t      lengths[LOG_CHANNELS] = {0};
+    size_t      count = 0;
+
+    for (LoggerRing *ring = __atomic_load_n(&Rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+
+        while (tail < head) {
+            unsigned char header[LOGGER_HEADER];
+            for (size_t i = 0; i < LOGGER_HEADER; i++) {
+                header[i] = ring->data[(tail + i) & (LOGGER_RING_SIZE - 1)];
+            }
+            size_t  length  = header[0] | header[1] << 8;
+            int     channel = header[2];
+            size_t  offset  = (tail + LOGGER_HEADER) & (LOGGER_RING_SIZE - 1);
+            size_t  first   = length < LOGGER_RING_SIZE - offset ? length : LOGGER_RING_SIZE - offset;
+
+            if (lengths[channel] + length > LOGGER_RING_SIZE) {
+                logger_output(Channels[channel], buffers[channel], lengths[channel]);
+                lengths[channel] = 0;
+            }
+            memcpy(buffers[channel] + lengths[channel], ring->data + offset, first);
+            memcpy(buffers[channel] + lengths[channel] + first, ring->data, length - first);
+            lengths[channel] += length;
+
+            tail += LOGGER_HEADER + length;
+            count++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        size_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            char message[BUFSIZ];
+            int  length = snprintf(message, sizeof(message), "[%5d] LOG   %10s:%-4d Dropped %zu log messages\n",
+                                   LoggerPid, __FILE__, __LINE__, dropped);
+            logger_output(STDERR_FILENO, message, length);
+        }
+    }
+
+    for (int channel = 0; channel < LOG_CHANNELS; channel++) {
+        logger_output(Channels[channel], buffers[channel], lengths[channel]);
+    }
+    return count;
+}
+
+/**
+ * Wake writer if it is sleeping (async-signal-safe).
+ *
+ * Only the first producer to find the writer asleep signals the eventfd.
+ **/
+void logger_wake() {
+    if (__atomic_load_n(&Sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&Sleeping, false, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(Wakeup, &one, sizeof(one)) < 0) {
+            return;
+        }
+    }
+}
+
+/**
+ * Write log files (and scheduled allocation reports) until the process
+ * exits.
+ *
+ * @param   arg         Unused.
+ * @return  Never.
+ *
+ * Once the rings are empty, the writer announces that it is going to sleep
+ * and then drains them once more before it does, since messages queued
+ * before the announcement was visible do not wake it up.
+ **/
+static void *logger_writer(void *arg) {
+    while (true) {
+        /* Signal handlers only schedule reports, which are written here */
+        arena_refresh();
+
+        pthread_mutex_lock(&DrainLock);
+        size_t count = logger_drain();
+        pthread_mutex_unlock(&DrainLock);
+
+        if (count) {
+            __atomic_store_n(&Sleeping, false, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        if (!__atomic_load_n(&Sleeping, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&Sleeping, true, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        uint64_t value;
+        if (read(Wakeup, &value, sizeof(value)) < 0 && errno != EINTR) {
+            struct timespec idle = {0, LOGGER_IDLE_NSEC};
+            nanosleep(&idle, NULL);
+        } else {
+            /* Let messages accumulate, since producers do not signal an awake writer */
+            struct timespec batch = {0, LOGGER_BATCH_NSEC};
+            nanosleep(&batch, NULL);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Write all buffered log messages (ie. at exit).
+ **/
+void logger_flush() {
+    pthread_mutex_lock(&DrainLock);
+    logger_drain();
+    pthread_mutex_unlock(&DrainLock);
+}
+
+/**
+ * Hold rings steady while forking.
+ **/
+static void logger_prepare() {
+    pthread_mutex_lock(&DrainLock);
+}
+
+/**
+ * Resume writer after forking.
+ **/
+static void logger_parent() {
+    pthread_mutex_unlock(&DrainLock);
+}
+
+/**
+ * Reset logger in child process.
+ *
+ * Buffered messages belong to the parent (which writes them), and the
+ * writer thread does not exist in the child, so the rings are emptied and a
+ * new writer (with its own eventfd) is started by the next message, unless
+ * the child writes synchronously.
+ **/
+static void logger_child() {
+    pthread_mutex_init(&DrainLock, NULL);
+    pthread_mutex_init(&RingsLock, NULL);
+    for (LoggerRing *ring = Rings; ring; ring = ring->next) {
+        ring->tail    = ring->head;
+        ring->dropped = 0;
+    }
+    if (Wakeup >= 0) {
+        close(Wakeup);
+    }
+    Wakeup    = eventfd(0, EFD_CLOEXEC);
+    Sleeping  = false;
+    LoggerPid = getpid();
+}
+
+/**
+ * Register fork and exit handlers (once per process).
+ **/
+static void logger_init() {
+    LoggerPid = getpid();
+    Wakeup    = eventfd(0, EFD_CLOEXEC);
+    pthread_atfork(logger_prepare, logger_parent, logger_child);
+    atexit(logger_flush);
+}
+
+/**
+ * Write messages of current process as soon as they are queued.
+ *
+ * Meant for short-lived forked children (ie. in forking mode), which would
+ * otherwise each start a writer thread of their own.
+ **/
+void logger_synchronous() {
+    Synchronous = true;
+}
+
+/**
+ * Start writer thread of current process (if it is not running).
+ *
+ * The writer blocks all signals, so handlers always run on server threads.
+ **/
+static void logger_spawn() {
+    pthread_mutex_lock(&RingsLock);
+    if (WriterPid != LoggerPid) {
+        sigset_t  all, old;
+        pthread_t thread;
+
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        if (pthread_create(&thread, NULL, logger_writer, NULL) == 0) {
+            pthread_detach(thread);
+            WriterPid = LoggerPid;
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    pthread_mutex_unlock(&RingsLock);
+}
+
+/**
+ * Open log files and start writer thread.
+ *
+ * @return  Whether or not the access log and trace file (if any) were
+ * opened (errno is set on failure).
+ **/
+bool logger_start() {
+    pthread_once(&LoggerOnce, logger_init);
+
+    if (AccessLogPath) {
+        Channels[LOG_ACCESS] = streq(AccessLogPath, "-") ? STDERR_FILENO :
+                               open(AccessLogPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (Channels[LOG_ACCESS] < 0) {
+            return false;
+        }
+    }
+
+    if (TracePath) {
+        Channels[LOG_TRACE] = open(TracePath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (Channels[LOG_TRACE] < 0 || !trace_header(Channels[LOG_TRACE])) {
+            return false;
+        }
+    }
+
+    logger_spawn();
+    return true;
+}
+
+/**
+ * Lookup ring of current thread, creating it if necessary.
+ *
+ * @return  Ring of current thread (or NULL on failure).
+ **/
+static LoggerRing *logger_ring() {
+    if (ThreadRing) {
+        return ThreadRing;
+    }
+
+    pthread_once(&LoggerOnce, logger_init);
+    LoggerRing *ring = calloc(1, sizeof(LoggerRing));
+    if (ring) {
+        pthread_mutex_lock(&RingsLock);
+        ring->next = Rings;
+        __atomic_store_n(&Rings, ring, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&RingsLock);
+    }
+    return ThreadRing = ring;
+}
+
+/**
+ * Queue line (or binary record) to log channel.
+ *
+ * @param   channel     Log channel (LOG_ERROR, LOG_ACCESS, or LOG_TRACE).
+ * @param   line        Line to write.
+ * @param   length      Length of line (at most LOGGER_RECORD_MAX).
+ *
+ * If the ring of the current thread is full, the line is dropped.  If no
+ * ring can be allocated, the line is written directly.
+ **/
+void logger_queue(LogChannel channel, const char *line, size_t length) {
+    LoggerRing *ring = logger_ring();
+    if (!ring) {
+        logger_output(Channels[channel], line, length);
+        return;
+    }
+    if (WriterPid != LoggerPid && !Synchronous) {
+        logger_spawn();
+    }
+
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (LOGGER_RING_SIZE - (head - tail) < LOGGER_HEADER + length) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    unsigned char header[LOGGER_HEADER] = {length & 0xff, length >> 8, channel};
+    for (size_t i = 0; i < LOGGER_HEADER; i++) {
+        ring->data[(head + i) & (LOGGER_RING_SIZE - 1)] = header[i];
+    }
+
+    size_t offset = (head + LOGGER_HEADER) & (LOGGER_RING_SIZE - 1);
+    size_t first  = length < LOGGER_RING_SIZE - offset ? length : LOGGER_RING_SIZE - offset;
+    memcpy(ring->data + offset, line, first);
+    memcpy(ring->data, line + first, length - first);
+
+    __atomic_store_n(&ring->head, head + LOGGER_HEADER + length, __ATOMIC_SEQ_CST);
+
+    if (Synchronous) {
+        logger_flush();
+    } else {
+        logger_wake();
+    }
+}
+
+/**
+ * Log message (see the log, debug, and fatal macros).
+ *
+ * @param   level       Name of level (ie. "LOG  ").
+ * @param   file        Source file of message.
+ * @param   line        Source line of message.
+ * @param   format      printf format of message.
+ **/
+void logger_write(const char *level, const char *file, int line, const char *format, ...) {
+    pthread_once(&LoggerOnce, logger_init);
+
+    char buffer[LOGGER_RECORD_MAX];
+    int  length = snprintf(buffer, sizeof(buffer), "[%5d] %s %10s:%-4d ", LoggerPid, level, file, line);
+
+    va_list args;
+    va_start(args, format);
+    if (length < (int)sizeof(buffer)) {
+        length += vsnprintf(buffer + length, sizeof(buffer) - length, format, args);
+    }
+    va_end(args);
+
+    if (length > (int)sizeof(buffer) - 1) {
+        length = sizeof(buffer) - 1;
+    }
+    buffer[length++] = '\n';
+    logger_queue(LOG_ERROR, buffer, length);
+}
+
+/**
+ * Decide whether to record request in the access log.
+ *
+ * @return  Whether or not this is one of every AccessSampling requests
+ * (counted per thread).
+ **/
+bool logger_sample() {
+    return Channels[LOG_ACCESS] >= 0 && AccessSampling && ++Sampled % AccessSampling == 0;
+}
+
+/**
+ * Record request in the access log.
+ *
+ * @param   r           Request structure.
+ * @param   status      Status of response.
+ * @param   started     Time request handling started (CLOCK_MONOTONIC).
+ * @param   bytes       Bytes of response.
+ *
+ * Each line holds the time (in seconds since the epoch), client address,
+ * method, URI, status code, response bytes, and duration in microseconds,
+ * separated by spaces:
+ *
+ *      1700000000.123 127.0.0.1 GET /index.html 200 1234 56
+ **/
+void logger_access(Request *r, Status status, const struct timespec *started, size_t bytes) {
+    struct timespec now, finished;
+    clock_gettime(CLOCK_REALTIME, &now);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    long duration = (finished.tv_sec - started->tv_sec) * 1000000 + (finished.tv_nsec - started->tv_nsec) / 1000;
+    char buffer[LOGGER_RECORD_MAX];
+    int  length = snprintf(buffer, sizeof(buffer), "%jd.%03ld %s %s %s%s%s %d %zu %ld\n",
+                           (intmax_t)now.tv_sec, now.tv_nsec / 1000000, request_host(r),
+                           r->method ? r->method : "-", r->uri ? r->uri : "-",
+                           r->query && *r->query ? "?" : "", r->query && *r->query ? r->query : "",
+                           atoi(http_status_string(status)), bytes, duration);
+    if (length >= (int)sizeof(buffer)) {
+        buffer[sizeof(buffer) - 2] = '\n';
+        length = sizeof(buffer) - 1;
+    }
+    logger_queue(LOG_ACCESS, buffer, length);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,268 @@
+/* microbench: Microbenchmarks of Request Hot Paths */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+
+/*
+ * Each benchmark runs one hot path of request handling in a tight loop,
+ * without sockets or a load generator, and reports the time and heap
+ * allocations per operation.  Allocations are counted by interposing malloc,
+ * calloc, and realloc (so calls made inside libc, ie. by realpath, count
+ * too).
+ *
+ * The benchmarks link a copy of the library built with NDEBUG, so debug
+ * logging is compiled out and the hot paths run as in a production build.
+ * The server configuration (ie. FileCacheSize) keeps the server's defaults.
+ */
+
+/* Global Variables */
+
+static Request *Bench = NULL;
+static volatile const void *Sink;       /* Keeps results from being discarded */
+static size_t   Mallocs = 0;
+
+/* Request header sent by a typical browser */
+static const char BrowserRequest[] =
+    "GET /html/index.html?user=pparker&session=1 HTTP/1.1\r\n"
+    "Host: localhost:9898\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "If-None-Match: \"5e8f-1a2b\"\r\n"
+    "If-Modified-Since: Sat, 01 Feb 2020 00:00:00 GMT\r\n"
+    "\r\n";
+
+/* Allocation Counting */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    __atomic_add_fetch(&Mallocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    __atomic_add_fetch(&Mallocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&Mallocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+/* Benchmarks */
+
+/**
+ * Load browser request into request buffer (as if read from the socket).
+ **/
+static void load_request() {
+    reset_request(Bench);
+    memcpy(Bench->buffer, BrowserRequest, sizeof(BrowserRequest) - 1);
+    Bench->offset  = 0;
+    Bench->scanned = 0;
+    Bench->length  = sizeof(BrowserRequest) - 1;
+}
+
+static void bench_parse_request(size_t iterations) {
+    for (size_t i = 0; i < iterations; i++) {
+        load_request();
+        if (parse_request(Bench) != HTTP_STATUS_OK) {
+            fatal("Unable to parse request");
+        }
+    }
+}
+
+static void bench_determine_request_path(size_t iterations) {
+    for (size_t i = 0; i < iterations; i++) {
+        char *path = determine_request_path("/html/index.html");
+        Sink = path;
+        free(path);
+    }
+}
+
+static void bench_filecache_lookup(size_t iterations) {
+    for (size_t i = 0; i < iterations; i++) {
+        CacheEntry *entry = filecache_lookup("/html/index.html");
+        Sink = entry;
+        filecache_release(entry);
+    }
+}
+
+static void bench_determine_mimetype(size_t iterations) {
+    static const char *paths[] = {"www/html/index.html", "www/images/a.png", "www/song.txt", "www/README"};
+
+    for (size_t i = 0; i < iterations; i++) {
+        Sink = determine_mimetype(paths[i % 4]);
+    }
+}
+
+static void bench_http_status_string(size_t iterations) {
+    for (size_t i = 0; i < iterations; i++) {
+        Sink = http_status_string(i % (HTTP_STATUS_NOT_MODIFIED + 1));
+    }
+}
+
+static void bench_cgi_environment(size_t iterations) {
+    load_request();
+    if (parse_request(Bench) != HTTP_STATUS_OK) {
+        fatal("Unable to parse request");
+    }
+    Bench->path = "/var/www/scripts/env.sh";
+
+    for (size_t i = 0; i < iterations; i++) {
+        size_t length;
+        Sink = cgi_environment(Bench, &length);
+        arena_reset(&Bench->arena);
+    }
+}
+
+static void bench_request_host(size_t iterations) {
+    for (size_t i = 0; i < iterations; i++) {
+        Bench->host[0] = '\0';         /* Format again, as for each connection */
+        Sink = request_host(Bench);
+    }
+}
+
+typedef struct {
+    const char *name;
+    void      (*run)(size_t iterations);
+} Benchmark;
+
+static Benchmark Benchmarks[] = {
+    {"parse_request",           bench_parse_request},
+    {"determine_request_path",  bench_determine_request_path},
+    {"filecache_lookup",        bench_filecache_lookup},
+    {"determine_mimetype",      bench_determine_mimetype},
+    {"http_status_string",      bench_http_status_string},
+    {"cgi_environment",         bench_cgi_environment},
+    {"request_host",            bench_request_host},
+    {NULL,                      NULL},
+};
+
+/* Functions */
+
+/**
+ * Display usage message and exit with specified status code.
+ *
+ * @param   progname    Program Name
+ * @param   status      Exit status.
+ */
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [hmnr] [benchmark...]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -m path       Path to mimetypes file\n");
+    fprintf(stderr, "    -n count      Iterations of each benchmark (100000)\n");
+    fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "Benchmarks:\n");
+    for (Benchmark *b = Benchmarks; b->name; b++) {
+        fprintf(stderr, "    %s\n", b->name);
+    }
+    exit(status);
+}
+
+/**
+ * Run benchmark and report time and allocations per operation.
+ *
+ * @param   b           Benchmark.
+ * @param   iterations  Number of operations.
+ **/
+static void run_benchmark(Benchmark *b, size_t iterations) {
+    struct timespec started, finished;
+
+    b->run(iterations / 10 + 1);        /* Warm up caches */
+
+    size_t mallocs = __atomic_load_n(&Mallocs, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    b->run(iterations);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    mallocs = __atomic_load_n(&Mallocs, __ATOMIC_RELAXED) - mallocs;
+
+    double nsec = (finished.tv_sec - started.tv_sec) * 1e9 + (finished.tv_nsec - started.tv_nsec);
+    printf("%-24s %12zu %12.1f %12.2f\n", b->name, iterations, nsec / iterations, (double)mallocs / iterations);
+}
+
+/**
+ * Run selected (or all) benchmarks.
+ **/
+int main(int argc, char *argv[]) {
+    size_t iterations = 100000;
+
+    /* Parse command line options */
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        switch (arg[1]) {
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS);
+                break;
+            case 'm':
+                MimeTypesPath = argv[argind++];
+                break;
+            case 'n':
+                iterations = strtoul(argv[argind++], NULL, 10);
+                break;
+            case 'r':
+                RootPath = argv[argind++];
+                break;
+            default:
+                usage(argv[0], EXIT_FAILURE);
+                break;
+        }
+        if (argind > argc || !iterations) {
+            usage(argv[0], EXIT_FAILURE);
+        }
+    }
+
+    /* Setup server state used by hot paths */
+    char buffer[BUFSIZ];
+    if (!(RootPath = realpath(RootPath, buffer))) {
+        fprintf(stderr, "Unable to determine root path: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (!mimetypes_load(MimeTypesPath)) {
+        fprintf(stderr, "Unable to load mimetypes from %s\n", MimeTypesPath);
+    }
+    if (!(Bench = calloc(1, sizeof(Request)))) {
+        fprintf(stderr, "Unable to allocate request: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    Bench->fd = -1;
+    arena_init(&Bench->arena, NULL, REQUEST_ARENA_SIZE);
+    struct sockaddr_in *address = (struct sockaddr_in *)&Bench->address;
+    address->sin_family = AF_INET;
+    address->sin_port   = htons(54321);
+    inet_pton(AF_INET, "127.0.0.1", &address->sin_addr);
+
+    /* Run benchmarks */
+    printf("%-24s %12s %12s %12s\n", "BENCHMARK", "ITERATIONS", "NS/OP", "ALLOCS/OP");
+    for (Benchmark *b = Benchmarks; b->name; b++) {
+        bool selected = argind == argc;
+        for (int i = argind; i < argc && !selected; i++) {
+            selected = streq(argv[i], b->name);
+        }
+        if (selected) {
+            run_benchmark(b, iterations);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,264 @@
+/* mimetypes.c: MIME Type Index */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+/* Constants */
+
+#define MIMETYPES_MIN_CAPACITY  1024    /* Must be a power of two */
+
+/* MIME Type Index */
+
+typedef struct {
+    const char *extension;              /*< File extension (without dot) */
+    const char *mimetype;               /*< Interned mimetype */
+} MimeEntry;
+
+typedef struct mime_index MimeIndex;
+struct mime_index {
+    char       *strings;                /*< Contents of mime.types file */
+    MimeEntry  *entries;                /*< Open addressing hash table */
+    size_t      capacity;               /*< Number of slots (power of two) */
+    size_t      size;                   /*< Number of extensions */
+    struct stat st;                     /*< Status of mime.types file when loaded */
+    MimeIndex  *retired;                /*< Previous index (never freed) */
+};
+
+/* Global Variables */
+
+static MimeIndex *Index = NULL;         /*< Current index */
+static size_t     Generation = 0;       /*< Number of indexes published */
+static volatile sig_atomic_t Reload = 0;
+
+/**
+ * Hash file extension (case-insensitive FNV-1a).
+ *
+ * @param   s           File extension.
+ * @return  Hash of extension.
+ **/
+static size_t mimetypes_hash(const char *s) {
+    size_t hash = 2166136261u;
+    for (; *s; s++) {
+        hash ^= (unsigned char)tolower(*s);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Insert extension into index unless it is already present (so the first
+ * rule in the file wins).
+ *
+ * @param   index       MIME type index.
+ * @param   extension   File extension.
+ * @param   mimetype    Interned mimetype.
+ * @return  Whether or not the index has room for the extension.
+ **/
+static bool mimetypes_insert(MimeIndex *index, const char *extension, const char *mimetype) {
+    if ((index->size + 1) * 2 > index->capacity) {
+        /* Grow table to keep load factor at or below one half */
+        MimeEntry *old      = index->entries;
+        size_t     capacity = index->capacity;
+
+        index->entries = calloc(capacity * 2, sizeof(MimeEntry));
+        if (!index->entries) {
+            index->entries = old;
+            return false;
+        }
+        index->capacity = capacity * 2;
+        index->size     = 0;
+
+        for (size_t i = 0; i < capacity; i++) {
+            if (old[i].extension) {
+                mimetypes_insert(index, old[i].extension, old[i].mimetype);
+            }
+        }
+        free(old);
+    }
+
+    size_t mask = index->capacity - 1;
+    for (size_t i = mimetypes_hash(extension) & mask; ; i = (i + 1) & mask) {
+        if (!index->entries[i].extension) {
+            index->entries[i].extension = extension;
+            index->entries[i].mimetype  = mimetype;
+            index->size++;
+            return true;
+        }
+        if (strcasecmp(index->entries[i].extension, extension) == 0) {
+            return true;
+        }
+    }
+}
+
+/**
+ * Free MIME type index.
+ *
+ * @param   index       MIME type index.
+ **/
+static void mimetypes_free(MimeIndex *index) {
+    if (index) {
+        free(index->strings);
+        free(index->entries);
+        free(index);
+    }
+}
+
+/**
+ * Load MIME type index from mime.types file.
+ *
+ * @param   path        Path to mime.types file.
+ * @return  Whether or not the index was loaded.
+ *
+ * The whole file is read into memory once and tokenized in place, so every
+ * mimetype string is stored exactly once and lookups never allocate.  The
+ * new index replaces the current one atomically and bumps the generation
+ * (see mimetypes_generation).  Replaced indexes are never freed: lookups may
+ * still be in flight on other threads, and cached FileInfo structures point
+ * at their interned mimetypes.  Reloading an unchanged file (same inode,
+ * size, and modification time) therefore keeps the current index instead
+ * of retiring it.
+ **/
+bool mimetypes_load(const char *path) {
+    MimeIndex *index = calloc(1, sizeof(MimeIndex));
+    if (!index) {
+        return false;
+    }
+
+    /* Read contents of file (unless it is already loaded) */
+    FILE *fs = fopen(path, "r");
+    if (!fs) {
+        debug("Unable to open %s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    MimeIndex *current = __atomic_load_n(&Index, __ATOMIC_ACQUIRE);
+    if (fstat(fileno(fs), &index->st) == 0 && current &&
+        current->st.st_ino           == index->st.st_ino &&
+        current->st.st_size          == index->st.st_size &&
+        current->st.st_mtim.tv_sec   == index->st.st_mtim.tv_sec &&
+        current->st.st_mtim.tv_nsec  == index->st.st_mtim.tv_nsec) {
+        fclose(fs);
+        mimetypes_free(index);
+        return true;
+    }
+
+    size_t length   = 0;
+    size_t capacity = BUFSIZ;
+    index->strings  = malloc(capacity);
+    while (index->strings) {
+        length += fread(index->strings + length, 1, capacity - length - 1, fs);
+        if (length < capacity - 1) {
+            break;
+        }
+        capacity *= 2;
+        char *strings = realloc(index->strings, capacity);
+        if (!strings) {
+            free(index->strings);
+        }
+        index->strings = strings;
+    }
+    fclose(fs);
+
+    if (!index->strings) {
+        goto fail;
+    }
+    index->strings[length] = '\0';
+
+    /* Build hash table: <MIMETYPE> <EXT1> <EXT2> ... */
+    index->capacity = MIMETYPES_MIN_CAPACITY;
+    index->entries  = calloc(index->capacity, sizeof(MimeEntry));
+    if (!index->entries) {
+        goto fail;
+    }
+
+    char *lineptr;
+    for (char *line = strtok_r(index->strings, "\n", &lineptr); line; line = strtok_r(NULL, "\n", &lineptr)) {
+        if (line[0] == '#') {
+            continue;
+        }
+
+        char *saveptr;
+        char *mimetype = strtok_r(line, WHITESPACE, &saveptr);
+        char *extension;
+        while (mimetype && (extension = strtok_r(NULL, WHITESPACE, &saveptr))) {
+            if (!mimetypes_insert(index, extension, mimetype)) {
+                goto fail;
+            }
+        }
+    }
+
+    /* Publish index (keeping the replaced one reachable) */
+    index->retired = __atomic_exchange_n(&Index, index, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&Generation, 1, __ATOMIC_RELEASE);
+
+    debug("Loaded %zu extensions from %s", index->size, path);
+    return true;
+
+fail:
+    mimetypes_free(index);
+    return false;
+}
+
+/**
+ * Lookup mimetype of file extension.
+ *
+ * @param   extension   File extension (without dot, case-insensitive).
+ * @return  Interned mimetype (or NULL if not found).
+ **/
+const char *mimetypes_lookup(const char *extension) {
+    mimetypes_refresh();
+
+    MimeIndex *index = __atomic_load_n(&Index, __ATOMIC_ACQUIRE);
+    if (!index) {
+        return NULL;
+    }
+
+    size_t mask = index->capacity - 1;
+    for (size_t i = mimetypes_hash(extension) & mask; index->entries[i].extension; i = (i + 1) & mask) {
+        if (strcasecmp(index->entries[i].extension, extension) == 0) {
+            return index->entries[i].mimetype;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Lookup generation of MIME type index (after any scheduled reload).
+ *
+ * @return  Number of indexes loaded so far.
+ *
+ * Callers that keep looked up mimetypes (ie. the file cache) record the
+ * generation and treat them as stale once it changes.
+ **/
+size_t mimetypes_generation() {
+    mimetypes_refresh();
+    return __atomic_load_n(&Generation, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Schedule reload of MIME type index (SIGHUP handler).
+ *
+ * @param   signum      Signal number.
+ **/
+void mimetypes_reload(int signum) {
+    Reload = 1;
+}
+
+/**
+ * Reload MIME type index from MimeTypesPath if a reload was scheduled.
+ **/
+void mimetypes_refresh() {
+    if (Reload && __atomic_exchange_n(&Reload, 0, __ATOMIC_ACQ_REL)) {
+        if (mimetypes_load(MimeTypesPath)) {
+            log("Reloaded mimetypes from %s", MimeTypesPath);
+        } else {
+            log("Unable to reload mimetypes from %s", MimeTypesPath);
+        }
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,213 @@
+/* prefork.c: Pre-Forked HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Worker Slot */
+
+typedef struct {
+    pid_t   pid;                        /*< Process ID of worker (0 if none) */
+    time_t  started;                    /*< Time worker was started */
+} Worker;
+
+/* Global Variables */
+
+static volatile sig_atomic_t Stopping  = 0;
+static volatile sig_atomic_t Reloading = 0;
+
+/**
+ * Record request to stop server.
+ *
+ * @param   signum      Signal number.
+ **/
+static void prefork_stop(int signum) {
+    Stopping = 1;
+}
+
+/**
+ * Record request to reload workers' mimetypes.
+ *
+ * @param   signum      Signal number.
+ **/
+static void prefork_reload(int signum) {
+    Reloading = 1;
+}
+
+/**
+ * Serve requests on a private SO_REUSEPORT listening socket.
+ *
+ * @param   id          Worker identifier.
+ *
+ * The worker handles up to WorkerRequests requests (or forever if 0) and then
+ * exits so the parent can replace it.  Before exiting it drains any
+ * connections already queued on its socket so they are not reset.
+ **/
+static void prefork_worker(int id) {
+    int sfd = socket_listen(Port, true);
+    if (sfd < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    debug("Worker %d listening on port %s", id, Port);
+
+    size_t handled = 0;
+    while (!WorkerRequests || handled < WorkerRequests) {
+        /* Accept request */
+        Request *request = accept_request(sfd);
+        if (!request) {
+            log("Unable to accept request: %s", strerror(errno));
+            continue;
+        }
+
+        /* Handle requests on connection */
+        handled += handle_connection(request);
+
+        /* Free request */
+        free_request(request);
+    }
+
+    /* Drain already queued connections before retiring */
+    int flags = fcntl(sfd, F_GETFL);
+    if (flags >= 0 && fcntl(sfd, F_SETFL, flags | O_NONBLOCK) == 0) {
+        Request *request;
+        while ((request = accept_request(sfd))) {
+            handle_connection(request);
+            free_request(request);
+        }
+    }
+
+    close(sfd);
+    debug("Worker %d retiring after %zu requests", id, handled);
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * Start worker in specified slot.
+ *
+ * @param   worker      Worker slot.
+ * @param   id          Worker identifier.
+ * @return  Whether or not worker was started.
+ **/
+static bool prefork_spawn(Worker *worker, int id) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        log("Unable to create worker process: %s", strerror(errno));
+        return false;
+    }
+
+    if (pid == 0) {
+        signal(SIGINT,  SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGHUP,  mimetypes_reload);
+        prefork_worker(id);
+    }
+
+    worker->pid     = pid;
+    worker->started = time(NULL);
+    return true;
+}
+
+/**
+ * Handle HTTP requests with a pool of long-lived worker processes.
+ *
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Each worker opens its own SO_REUSEPORT listening socket so the kernel
+ * shards incoming connections between them.  The parent only supervises:
+ * whenever a worker exits (because it reached its request limit or crashed),
+ * it is replaced.  The parent never listens itself (see socket_available),
+ * so no connection is ever queued on a socket nobody accepts from.  SIGHUP is
+ * forwarded to the workers so they reload their mimetypes.
+ **/
+int prefork_server() {
+    if (!Workers) {
+        Workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    Worker *workers = calloc(Workers, sizeof(Worker));
+    if (!workers) {
+        fatal("Unable to allocate workers: %s", strerror(errno));
+    }
+
+    struct sigaction action = {
+        .sa_handler = prefork_stop,
+    };
+    sigaction(SIGINT,  &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = prefork_reload;
+    sigaction(SIGHUP,  &action, NULL);
+
+    /* Start workers */
+    for (size_t i = 0; i < Workers; i++) {
+        prefork_spawn(&workers[i], i);
+    }
+
+    /* Supervise workers */
+    while (!Stopping) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        /* Forward reload request to workers */
+        if (Reloading) {
+            Reloading = 0;
+            for (size_t i = 0; i < Workers; i++) {
+                if (workers[i].pid) {
+                    kill(workers[i].pid, SIGHUP);
+                }
+            }
+        }
+
+        if (pid < 0) {
+            if (errno == ECHILD) {
+                sleep(1);
+            }
+        } else {
+            bool failed = true;
+            if (WIFSIGNALED(status)) {
+                log("Worker %d crashed: %s", pid, strsignal(WTERMSIG(status)));
+            } else if (WEXITSTATUS(status) != EXIT_SUCCESS) {
+                log("Worker %d failed with status %d", pid, WEXITSTATUS(status));
+            } else {
+                failed = false;
+            }
+
+            for (size_t i = 0; i < Workers; i++) {
+                if (workers[i].pid == pid) {
+                    workers[i].pid = 0;
+                    /* Avoid spinning on workers that fail immediately */
+                    if (failed && time(NULL) - workers[i].started < 1) {
+                        sleep(1);
+                    }
+                }
+            }
+        }
+
+        /* Replace missing workers */
+        for (size_t i = 0; i < Workers && !Stopping; i++) {
+            if (!workers[i].pid) {
+                prefork_spawn(&workers[i], i);
+            }
+        }
+    }
+
+    /* Stop workers */
+    for (size_t i = 0; i < Workers; i++) {
+        if (workers[i].pid) {
+            kill(workers[i].pid, SIGTERM);
+        }
+    }
+    while (waitpid(-1, NULL, 0) > 0);
+
+    free(workers);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,110 @@
+/* range.c: HTTP Byte Ranges */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * Parse a non-negative decimal byte position.
+ *
+ * @param   s           String to parse.
+ * @param   end         Set to first character after number.
+ * @param   value       Set to parsed value.
+ * @return  Whether or not a number was parsed.
+ **/
+static bool range_number(const char *s, const char **end, off_t *value) {
+    if (!isdigit((unsigned char)*s)) {
+        return false;
+    }
+
+    errno = 0;
+    char *stop;
+    unsigned long long n = strtoull(s, &stop, 10);
+    if (errno == ERANGE || n > (unsigned long long)INT64_MAX) {
+        return false;
+    }
+
+    *end   = stop;
+    *value = n;
+    return true;
+}
+
+/**
+ * Parse Range header.
+ *
+ * @param   header      Range header (ie. "bytes=0-99,200-,-50").
+ * @param   size        Size of file.
+ * @param   ranges      Array to store satisfiable ranges in.
+ * @param   capacity    Capacity of ranges array.
+ * @return  Number of satisfiable ranges, 0 if the header should be ignored
+ * (malformed, not in bytes, or too many ranges), or -1 if no range can be
+ * satisfied.
+ *
+ * Ranges are clamped to the size of the file and returned in the order they
+ * were requested.  Ranges that start past the end of the file are dropped.
+ **/
+int range_parse(const char *header, off_t size, ByteRange *ranges, size_t capacity) {
+    size_t count = 0;
+    size_t total = 0;
+
+    if (strncasecmp(header, "bytes=", 6) != 0) {
+        return 0;
+    }
+
+    for (const char *s = header + 6; *s; ) {
+        off_t first, last;
+
+        s += strspn(s, " \t");
+        if (*s == '-') {
+            /* Suffix range: last N bytes */
+            off_t suffix;
+            if (!range_number(s + 1, &s, &suffix)) {
+                return 0;
+            }
+            first = suffix < size ? size - suffix : 0;
+            last  = size - 1;
+            if (suffix == 0) {
+                first = size;
+            }
+        } else {
+            if (!range_number(s, &s, &first) || *s++ != '-') {
+                return 0;
+            }
+            if (!range_number(s, &s, &last)) {
+                last = size - 1;
+            } else if (last < first) {
+                return 0;
+            }
+            if (last >= size) {
+                last = size - 1;
+            }
+        }
+
+        s += strspn(s, " \t");
+        if (*s == ',') {
+            s++;
+        } else if (*s) {
+            return 0;
+        }
+
+        if (++total > capacity) {
+            return 0;
+        }
+        if (first < size) {
+            ranges[count].offset = first;
+            ranges[count].length = last - first + 1;
+            count++;
+        }
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+    return count ? (int)count : -1;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
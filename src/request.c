@@ -2,72 +2,197 @@
 
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-int parse_request_method(Request *r);
-int parse_request_headers(Request *r);
+int parse_request_method(Request *r, char *line);
+int parse_request_headers(Request *r, char *lines);
+
+/* Constants */
+
+/* Names of headers that can be looked up directly (indexed by KnownHeader) */
+static const char *KnownHeaders[] = {
+    "Host",
+    "Connection",
+    "Content-Length",
+    "Range",
+    "If-Range",
+    "If-None-Match",
+    "If-Modified-Since",
+    "Accept-Encoding",
+    "Transfer-Encoding",
+};
+
+/* Global Variables */
+
+/* Released request structs, reused by accept_request */
+static Request        *Pool[REQUEST_POOL_SIZE];
+static size_t          PoolSize = 0;
+static pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Released client stream buffers, reused by open_request */
+static char           *Buffers[REQUEST_POOL_SIZE];
+static size_t          BufferCount = 0;
+
+/**
+ * Return current monotonic time in seconds.
+ **/
+static time_t request_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Allocate request struct, reusing a released one if possible.
+ *
+ * @return  Request structure with no connection or buffered data.
+ **/
+static Request *request_alloc() {
+    Request *r = NULL;
+
+    pthread_mutex_lock(&PoolLock);
+    if (PoolSize > 0) {
+        r = Pool[--PoolSize];
+    }
+    pthread_mutex_unlock(&PoolLock);
+
+    if (r) {
+        __atomic_add_fetch(&Allocations.requests_recycled, 1, __ATOMIC_RELAXED);
+        r->stream   = NULL;
+        r->output   = NULL;
+        r->offset   = 0;
+        r->length   = 0;
+        r->scanned  = 0;
+        r->started  = 0;
+        r->deferred = false;
+        r->offload  = NULL;
+        return r;
+    }
+
+    r = calloc(1, sizeof(Request));
+    if (r) {
+        __atomic_add_fetch(&Allocations.requests_allocated, 1, __ATOMIC_RELAXED);
+        arena_init(&r->arena, NULL, REQUEST_ARENA_SIZE);
+    }
+    return r;
+}
 
 /**
  * Accept request from server socket.
  *
  * @param   sfd         Server socket file descriptor.
- * @return  Newly allocated Request structure.
+ * @return  Newly allocated Request structure (or NULL with errno set, ie. to
+ * EAGAIN once a non-blocking server socket has no pending connections).
  *
  * This function does the following:
  *
- *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  1. Allocates a request struct (reusing a released one if possible).
+ *  2. Accepts a non-blocking client connection from the server socket.
+ *  3. Returns the request struct.
+ *
+ * The client socket stream is not opened until a request is handled (see
+ * open_request), so idle connections hold no output buffer.
+ *
+ * The client address is only stored; it is formatted by request_host and
+ * request_port the first time a log line or CGI script needs it.
  *
  * The returned request struct must be deallocated using free_request.
  **/
 Request * accept_request(int sfd) {
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
+    socklen_t length = sizeof(struct sockaddr_storage);
+    int status;
 
-    /* Allocate request struct (zeroed) */
-    Request *r = calloc(1, sizeof(Request));
+    /* Allocate request struct */
+    Request *r = request_alloc();
     if (!r){
       debug("Unable to allocate requests: %s", strerror(errno));
       goto fail;
     }
 
-    /* Accept a client */
-    r->fd = accept(sfd, &raddr, &rlen);
+    /* Accept a client (reads and writes wait with poll, see fill_request and
+     * transmit_wait) */
+    r->fd = accept4(sfd, (struct sockaddr *)&r->address, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (r->fd < 0){
-      debug("Unable to accept: %s", strerror(errno));
-      goto fail;
-    }
-
-    /* Lookup client information */  //NI_NUMERICHOST (ip Address) | NI_NUMERICSERV (port #) of client
-    int status = getnameinfo(&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV );
-    if(status <0 ){
-      debug("Unable to getnameinfo: %s", gai_strerror(status) );
-      goto fail;
-    }
-
-    /* Open socket stream */
-    r->stream = fdopen(r->fd, "w+");
-    if(!r->stream){
-      debug("Unable to fdopen: %s", strerror(errno));
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          debug("Unable to accept: %s", strerror(errno));
+      }
       goto fail;
     }
+    r->accepted = TracePath ? trace_now() : 0;
+    r->host[0]  = '\0';
+    r->sent     = 0;
+    trace_mark(ACCEPT);
 
-    log("Accepted request from %s:%s", r->host, r->port);
     return r;
 
 fail:
-    /* Deallocate request struct */
+    /* Deallocate request struct (preserving errno for the caller) */
+    status = errno;
     free_request(r);
+    errno = status;
     return NULL;
 }
 
+/**
+ * Format client address and port of request (once per connection).
+ *
+ * @param   r           Request structure.
+ **/
+static void request_format_peer(Request *r) {
+    const void *address = NULL;
+    unsigned    port    = 0;
+
+    switch (r->address.ss_family) {
+        case AF_INET:
+            address = &((struct sockaddr_in *)&r->address)->sin_addr;
+            port    = ntohs(((struct sockaddr_in *)&r->address)->sin_port);
+            break;
+        case AF_INET6:
+            address = &((struct sockaddr_in6 *)&r->address)->sin6_addr;
+            port    = ntohs(((struct sockaddr_in6 *)&r->address)->sin6_port);
+            break;
+    }
+
+    if (!address || !inet_ntop(r->address.ss_family, address, r->host, sizeof(r->host))) {
+        strcpy(r->host, "unknown");
+    }
+    snprintf(r->port, sizeof(r->port), "%u", port);
+}
+
+/**
+ * Lookup client address of request.
+ *
+ * @param   r           Request structure.
+ * @return  Numeric client address (ie. "127.0.0.1").
+ **/
+const char *request_host(Request *r) {
+    if (!r->host[0]) {
+        request_format_peer(r);
+    }
+    return r->host;
+}
+
+/**
+ * Lookup client port of request.
+ *
+ * @param   r           Request structure.
+ * @return  Numeric client port.
+ **/
+const char *request_port(Request *r) {
+    if (!r->host[0]) {
+        request_format_peer(r);
+    }
+    return r->port;
+}
+
 /**
  * Deallocate request struct.
  *
@@ -75,63 +200,403 @@ fail:
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
- *  2. Frees all allocated strings in request struct.
- *  3. Frees all of the headers (including any allocated fields).
- *  4. Frees request struct.
+ *  1. Closes the request socket stream and file descriptor (discarding any
+ *     output still queued for it, see transmit_resume).
+ *  2. Releases any per-request state (via reset_request).
+ *  3. Returns request struct to the pool (or frees it if the pool is full).
  **/
 void free_request(Request *r) {
     if (!r) {
     	return;
     }
 
-    /* Close socket or fd */
-    fclose(r->stream);// for file stream
-    //close(r->fd); //for file descriptor
+    /* Close socket stream and fd */
+    idle_request(r);
+    if (r->fd >= 0) {
+        close(r->fd);
+        r->fd = -1;
+    }
+    transmit_discard(r);
 
-    /* Free allocated strings */
-    free(r->method);
-    free(r->uri);
-    free(r->path);
-    free(r->query);
+    /* Release per-request state */
+    reset_request(r);
 
-    /* Free headers */
-    Header *h = r->headers;
-    while(h) {
-        Header *temp = h;
-        free(h->name); 
-        free(h->data);
-        h = h->next;
-        free(temp);
+    /* Recycle or free request */
+    pthread_mutex_lock(&PoolLock);
+    if (PoolSize < REQUEST_POOL_SIZE) {
+        Pool[PoolSize++] = r;
+        r = NULL;
     }
+    pthread_mutex_unlock(&PoolLock);
 
-    /* Free request */
     free(r);
 }
 
+/**
+ * Open client socket stream of request (if it is not already open).
+ *
+ * @param   r           Request structure.
+ * @return  Whether or not the stream is open.
+ *
+ * The stream counts bytes sent (see transmit_write) and is buffered with a
+ * BUFSIZ buffer taken from a pool shared by all requests, which is given back
+ * by idle_request once the connection has nothing left to respond to.
+ **/
+bool open_request(Request *r) {
+    if (r->stream) {
+        return true;
+    }
+
+    pthread_mutex_lock(&PoolLock);
+    r->output = BufferCount > 0 ? Buffers[--BufferCount] : NULL;
+    pthread_mutex_unlock(&PoolLock);
+
+    if (!r->output && !(r->output = malloc(BUFSIZ))) {
+        debug("Unable to allocate stream buffer: %s", strerror(errno));
+        return false;
+    }
+
+    cookie_io_functions_t functions = {.write = transmit_write};
+    r->stream = fopencookie(r, "w", functions);
+    if (!r->stream) {
+        debug("Unable to fopencookie: %s", strerror(errno));
+        idle_request(r);
+        return false;
+    }
+    setvbuf(r->stream, r->output, _IOFBF, BUFSIZ);
+    trace_mark(STREAM);
+    return true;
+}
+
+/**
+ * Flush and close client socket stream of idle request.
+ *
+ * @param   r           Request structure.
+ * @return  Whether or not all buffered output was written (or queued, see
+ * transmit_write).
+ *
+ * The client socket itself stays open, and the stream buffer is returned to
+ * the pool (or freed if the pool is full).
+ **/
+bool idle_request(Request *r) {
+    bool flushed = true;
+
+    if (r->stream) {
+        flushed   = fclose(r->stream) == 0;
+        r->stream = NULL;
+    }
+
+    if (r->output) {
+        pthread_mutex_lock(&PoolLock);
+        if (BufferCount < REQUEST_POOL_SIZE) {
+            Buffers[BufferCount++] = r->output;
+            r->output = NULL;
+        }
+        pthread_mutex_unlock(&PoolLock);
+        free(r->output);
+        r->output = NULL;
+    }
+
+    return flushed;
+}
+
+/**
+ * Reset request struct for the next request on the same connection.
+ *
+ * @param   r           Request structure.
+ *
+ * This releases all per-request state, but keeps the client socket, stream,
+ * and any data already buffered from the client (ie. pipelined requests).
+ * The parsed request itself only consists of views into the buffer, and
+ * anything else allocated while handling it comes from the request arena,
+ * which is simply rewound.
+ **/
+void reset_request(Request *r) {
+    /* Release file information (which owns path) */
+    filecache_release(r->file);
+    arena_reset(&r->arena);
+
+    r->method         = NULL;
+    r->uri            = NULL;
+    r->path           = NULL;
+    r->file           = NULL;
+    r->query          = NULL;
+    r->version        = 0;
+    r->keep_alive     = false;
+    r->nheaders       = 0;
+    r->body           = NULL;
+    r->body_length    = 0;
+    r->content_length = 0;
+    r->started        = r->offset < r->length ? request_now() : 0;
+    memset(r->known, 0, sizeof(r->known));
+}
+
+/**
+ * Check whether the pending request header has taken too long to arrive.
+ *
+ * @param   r           Request structure.
+ * @return  Whether or not REQUEST_HEADER_TIMEOUT seconds have passed since
+ * the first byte of a still incomplete header was received.
+ *
+ * The per-read timeout alone does not stop a client that trickles in a
+ * header a byte at a time, so the whole header must arrive in time.
+ **/
+bool request_expired(Request *r) {
+    return r->started && request_now() - r->started >= REQUEST_HEADER_TIMEOUT;
+}
+
+/**
+ * Read more data from client socket into request buffer.
+ *
+ * @param   r           Request structure.
+ * @param   block       Whether or not to wait for data.
+ * @return  Number of bytes read, 0 on end of stream or a full buffer, or -1
+ * on error (errno is EAGAIN if no data is available and block is false, or
+ * ETIMEDOUT if the client sent nothing for KeepAliveTimeout seconds or did
+ * not complete the request header within REQUEST_HEADER_TIMEOUT seconds).
+ *
+ * Consumed data is discarded first (moving any partial request to the front
+ * of the buffer), so this must not be called while a parsed request is still
+ * in use.
+ **/
+ssize_t fill_request(Request *r, bool block) {
+    /* Compact buffer */
+    if (r->offset > 0) {
+        memmove(r->buffer, r->buffer + r->offset, r->length - r->offset);
+        r->length  -= r->offset;
+        r->scanned -= r->scanned > r->offset ? r->offset : r->scanned;
+        r->offset   = 0;
+    }
+
+    if (r->length == sizeof(r->buffer)) {
+        return 0;
+    }
+
+    /* Client sockets are non-blocking, so blocking reads wait with poll (for
+     * at most KeepAliveTimeout seconds) */
+    ssize_t nread;
+    while ((nread = recv(r->fd, r->buffer + r->length, sizeof(r->buffer) - r->length, MSG_DONTWAIT)) < 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (!block || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            break;
+        }
+
+        /* Wait no longer than the header deadline (if a header is pending) */
+        int timeout = KeepAliveTimeout;
+        if (r->started && !r->method) {
+            time_t remaining = r->started + REQUEST_HEADER_TIMEOUT - request_now();
+            timeout = remaining < timeout ? remaining : timeout;
+        }
+        if (timeout <= 0) {
+            errno = ETIMEDOUT;
+            break;
+        }
+
+        struct pollfd pfd = {.fd = r->fd, .events = POLLIN};
+        int status;
+        do {
+            status = poll(&pfd, 1, timeout * 1000);
+        } while (status < 0 && errno == EINTR);
+        if (status <= 0) {
+            errno = status ? errno : ETIMEDOUT;
+            break;
+        }
+    }
+
+    if (nread > 0) {
+        r->length += nread;
+        if (!r->started && !r->method) {
+            r->started = request_now();
+        }
+    }
+    return nread;
+}
+
+/**
+ * Check whether a complete request header is buffered.
+ *
+ * @param   r           Request structure.
+ * @return  1 if complete, 0 if more data is needed, or -1 if the header does
+ * not fit in the buffer.
+ *
+ * The search resumes where the previous check stopped, so a request that
+ * trickles in over many reads is only scanned once.
+ **/
+int check_request(Request *r) {
+    if (r->scanned < r->offset) {
+        r->scanned = r->offset;
+    }
+
+    for (char *p = r->buffer + r->scanned; (p = memchr(p, '\n', r->buffer + r->length - p)); p++) {
+        /* Blank line: "\n\n" or "\n\r\n" */
+        if ((p + 1 < r->buffer + r->length && p[1] == '\n') ||
+            (p + 2 < r->buffer + r->length && p[1] == '\r' && p[2] == '\n')) {
+            r->scanned = p - r->buffer;
+            return 1;
+        }
+        r->scanned = p - r->buffer;
+    }
+
+    if (r->offset == 0 && r->length == sizeof(r->buffer)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Wait for the next request on a connection.
+ *
+ * @param   r           Request structure.
+ * @param   timeout     Number of milliseconds to wait.
+ * @return  Whether or not there is data to parse.
+ *
+ * Returns immediately if a pipelined request is already buffered; otherwise
+ * waits for the client to send more data, returning false if the connection
+ * is closed or remains idle for the timeout.
+ **/
+bool wait_request(Request *r, int timeout) {
+    if (r->offset < r->length) {
+        return true;
+    }
+
+    struct pollfd pfd = {.fd = r->fd, .events = POLLIN};
+    if (poll(&pfd, 1, timeout) <= 0) {
+        return false;
+    }
+
+    return fill_request(r, false) > 0;
+}
+
 /**
  * Parse HTTP Request.
  *
  * @param   r           Request structure.
- * @return  -1 on error and 0 on success.
+ * @return  HTTP_STATUS_OK on success, or the error status to respond with.
+ *
+ * This reads from the client socket until a complete request header is in
+ * the buffer (the header must fit in it, otherwise the request is rejected
+ * with HTTP_STATUS_HEADERS_TOO_LARGE, and it must arrive within
+ * REQUEST_HEADER_TIMEOUT seconds, otherwise it is rejected with
+ * HTTP_STATUS_REQUEST_TIMEOUT).  It then parses the request method,
+ * any query, and then the headers in place: the method, uri, query, and
+ * header names and data are NUL-terminated views into the buffer, so parsing
+ * never allocates.
+ *
+ * It also determines whether the connection should be kept alive: HTTP/1.1
+ * connections persist unless the client sends "Connection: close", while
+ * HTTP/1.0 connections only persist with "Connection: keep-alive".
  *
- * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * Chunked request bodies are not supported: requests with a
+ * Transfer-Encoding are rejected with HTTP_STATUS_NOT_IMPLEMENTED (or
+ * HTTP_STATUS_BAD_REQUEST if they also have a Content-Length), and since
+ * every error closes the connection, the body is never parsed as a request.
  **/
-int parse_request(Request *r) {
+Status parse_request(Request *r) {
+    /* Read until header is complete */
+    int complete;
+    while ((complete = check_request(r)) == 0) {
+        ssize_t nread = fill_request(r, true);
+        if (nread < 0 && errno == ETIMEDOUT && request_expired(r)) {
+            return HTTP_STATUS_REQUEST_TIMEOUT;
+        }
+        if (nread <= 0) {
+            return HTTP_STATUS_BAD_REQUEST;
+        }
+    }
+    if (complete < 0) {
+        return HTTP_STATUS_HEADERS_TOO_LARGE;
+    }
+
+    /* Split request line from header lines and consume header */
+    char *start = r->buffer + r->offset;
+    char *end   = r->buffer + r->scanned;
+    char *lines = memchr(start, '\n', end - start + 1);
+    r->offset   = r->scanned + (end[1] == '\n' ? 2 : 3);
+    *lines      = '\0';
+    *end        = '\0';
+    if (lines < end) {
+        lines++;
+    }
+
     /* Parse HTTP Request Method */
-    int m = parse_request_method(r);
+    if (parse_request_method(r, start) < 0) {
+        return HTTP_STATUS_BAD_REQUEST;
+    }
 
     /* Parse HTTP Request Headers*/
-    int h = parse_request_headers(r);
+    int status = parse_request_headers(r, lines);
+    if (status < 0) {
+        return HTTP_STATUS_BAD_REQUEST;
+    }
+    if (status > 0) {
+        return HTTP_STATUS_HEADERS_TOO_LARGE;
+    }
+
+    /* Determine connection persistence */
+    const char *connection = r->known[HEADER_CONNECTION];
+    if (r->version >= 1) {
+        r->keep_alive = !connection || !strcasestr(connection, "close");
+    } else {
+        r->keep_alive = connection && strcasestr(connection, "keep-alive");
+    }
+
+    /* Reject bodies whose length we cannot determine: chunked bodies are not
+     * decoded, and a Content-Length next to a Transfer-Encoding is ambiguous,
+     * so either would otherwise be read as the next pipelined request */
+    const char *content_length = r->known[HEADER_CONTENT_LENGTH];
+    if (r->known[HEADER_TRANSFER_ENCODING]) {
+        return content_length ? HTTP_STATUS_BAD_REQUEST : HTTP_STATUS_NOT_IMPLEMENTED;
+    }
+
+    /* Consume buffered part of request body (the rest is left on the socket
+     * for handlers that read it, so the connection cannot persist) */
+    if (content_length) {
+        char *end;
+        if (!isdigit((unsigned char)*content_length)) {
+            return HTTP_STATUS_BAD_REQUEST;
+        }
+        r->content_length = strtoul(content_length, &end, 10);
+        if (*end) {
+            return HTTP_STATUS_BAD_REQUEST;
+        }
+        r->body           = r->buffer + r->offset;
+        r->body_length    = r->length - r->offset;
+        if (r->content_length <= r->body_length) {
+            r->body_length = r->content_length;
+        } else {
+            r->keep_alive = false;
+        }
+        r->offset += r->body_length;
+    }
 
-    return m + h;
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Lookup HTTP Request Header.
+ *
+ * @param   r           Request structure.
+ * @param   name        Name of header (case-insensitive).
+ * @return  Data of header (or NULL if not present).
+ *
+ * Common headers can be read directly from r->known instead.
+ **/
+const char *request_header(Request *r, const char *name) {
+    for (size_t i = 0; i < r->nheaders; i++) {
+        if (strcasecmp(r->headers[i].name, name) == 0) {
+            return r->headers[i].data;
+        }
+    }
+    return NULL;
 }
 
 /**
  * Parse HTTP Request Method and URI.
  *
  * @param   r           Request structure.
+ * @param   line        Request line (NUL-terminated, in request buffer).
  * @return  -1 on error and 0 on success.
  *
  * HTTP Requests come in the form
@@ -143,23 +608,33 @@ int parse_request(Request *r) {
  *  GET / HTTP/1.1
  *  GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function extracts the method, uri, query (if it exists), and version.
  **/
-int parse_request_method(Request *r) {
-    char buffer[BUFSIZ];
-
-    /* Read line from socket */
-    if (!fgets(buffer, BUFSIZ, r->stream)){
+int parse_request_method(Request *r, char *line) {
+    /* Parse method, uri, and version */
+    char *method  = skip_whitespace(line);
+    char *uri     = skip_nonwhitespace(method);
+    if (!*uri) {
         goto fail;
     }
-      /* Parse method and uri */
-    char *method = strtok(buffer, WHITESPACE);
-    char *uri    = strtok(NULL  , WHITESPACE);
+    *uri++ = '\0';
+
+    uri = skip_whitespace(uri);
+    char *version = skip_nonwhitespace(uri);
+    if (*version) {
+        *version++ = '\0';
+        version = skip_whitespace(version);
+        *skip_nonwhitespace(version) = '\0';
+    }
 
-    if(!method || !uri){
+    if(!*method || !*uri){
       goto fail;
     }
 
+    if (streq(version, "HTTP/1.1")) {
+        r->version = 1;
+    }
+
     /* Parse query from uri */
     char *query = strchr(uri, '?');
     if(!query) {
@@ -169,9 +644,9 @@ int parse_request_method(Request *r) {
     }
 
     /* Record method, uri, and query in request struct */
-    r->method = strdup(method);
-    r->uri    = strdup(uri);
-    r->query  = strdup(query);
+    r->method = method;
+    r->uri    = uri;
+    r->query  = query;
 
     debug("HTTP METHOD: %s", r->method);
     debug("HTTP URI:    %s", r->uri);
@@ -187,7 +662,8 @@ fail:
  * Parse HTTP Request Headers.
  *
  * @param   r           Request structure.
- * @return  -1 on error and 0 on success.
+ * @param   lines       Header lines (NUL-terminated, in request buffer).
+ * @return  -1 on error, 1 if there are too many headers, and 0 on success.
  *
  * HTTP Headers come in the form:
  *
@@ -202,46 +678,58 @@ fail:
  *  Accept-Encoding: gzip, deflate
  *  Connection: keep-alive
  *
- * This function parses the stream from the request socket using the following
- * pseudo-code:
+ * This function splits each line in place into the fixed-size headers array
+ * of the request using the following pseudo-code:
  *
- *  while (buffer = read_from_socket() and buffer is not empty):
- *      name, data  = buffer.split(':')
- *      header      = new Header(name, data)
- *      headers.append(header)
+ *  for line in lines.split('\n'):
+ *      name, data  = line.split(':')
+ *      headers.append(Header(name, data.strip()))
+ *      if name is a known header: known[name] = data
  **/
-int parse_request_headers(Request *r) {
-
-    Header *curr = NULL;
-    Header *prev = NULL;
-    char buffer[BUFSIZ];
-    char *name;
-    char *data;
+int parse_request_headers(Request *r, char *lines) {
+    char *line = lines;
+
+    while (*line) {
+        char *next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        } else {
+            next = line + strlen(line);
+        }
 
-    /* Parse headers from socket */
-    while(fgets(buffer, BUFSIZ, r->stream) && strlen(buffer) > 2){
-        curr = calloc(1, sizeof(Header));
-        if(!curr)
-            goto fail;
-        if(prev)
-            prev->next = curr;
-        else
-            r->headers = curr;
-
-        name = strtok(buffer, ":");
-        data = strtok(NULL, "\n");
-        if(!name || !data) {
+        char *data = strchr(line, ':');
+        if (!data || data == line) {
             goto fail;
         }
-        curr->name = strdup(name);
-        curr->data = strdup(data);
+        *data++ = '\0';
+
+        /* Trim whitespace (and carriage return) around data */
+        data = skip_whitespace(data);
+        char *tail = data + strlen(data);
+        while (tail > data && isspace((unsigned char)tail[-1])) {
+            *--tail = '\0';
+        }
+
+        if (r->nheaders == REQUEST_MAX_HEADERS) {
+            return 1;
+        }
+        Header *h = &r->headers[r->nheaders++];
+        h->name = line;
+        h->data = data;
+
+        for (size_t i = 0; i < HEADER_COUNT; i++) {
+            if (strcasecmp(line, KnownHeaders[i]) == 0) {
+                r->known[i] = data;
+                break;
+            }
+        }
 
-        prev = curr;
+        line = next;
     }
 
   #ifndef NDEBUG
-      for (Header *header = r->headers; header; header = header->next) {
-      	debug("HTTP HEADER %s = %s", header->name, header->data);
+      for (size_t i = 0; i < r->nheaders; i++) {
+      	debug("HTTP HEADER %s = %s", r->headers[i].name, r->headers[i].data);
       }
   #endif
       return 0;
@@ -23,8 +23,8 @@ int single_server(int sfd) {
         continue;
       }
 
-  	/* Handle request */
-      handle_request(request);
+  	/* Handle requests on connection */
+      handle_connection(request);
 
   	/* Free request */
       free_request(request);
@@ -9,16 +9,25 @@
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define SOCKET_DEFER_ACCEPT     1       /* Seconds to wait for request data before accept anyway */
+#define SOCKET_FASTOPEN_QUEUE   256     /* Pending TCP Fast Open connections */
+
 /**
- * Allocate socket, bind it, and listen to specified port.
+ * Allocate socket and bind it to specified port.
  *
- * @param   port        Port number to bind to and listen on.
- * @return  Allocated server socket file descriptor.
+ * @param   port        Port number to bind to.
+ * @param   shared      Whether other sockets (ie. prefork workers) may also
+ *                      listen on port (SO_REUSEPORT).
+ * @param   backlog     Length of queue to listen with (or 0 to only bind).
+ * @return  Allocated server socket file descriptor (or -1 on failure).
  **/
-int socket_listen(const char *port) {
+static int socket_bind(const char *port, bool shared, int backlog) {
     /* Lookup server address information */
     struct addrinfo hints = {
         .ai_family      = AF_UNSPEC,    /* Use either IPv4 or IPv6 */
@@ -41,6 +50,33 @@ int socket_listen(const char *port) {
             continue;
         }
 
+        /* Allow restarting while old connections linger in TIME_WAIT */
+        int on = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+            fprintf(stderr, "setsockopt failed: %s\n", strerror(errno));
+        }
+
+        /* Allow other sockets (ie. prefork workers) to share port */
+        if (shared && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            fprintf(stderr, "setsockopt failed: %s\n", strerror(errno));
+        }
+
+        /* Only wake accept once the client has sent data, allow clients to
+         * send their request with the SYN (TCP Fast Open), and send
+         * responses without waiting for delayed ACKs (response headers and
+         * body are separate writes) */
+        int defer = SOCKET_DEFER_ACCEPT;
+        if (setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)) < 0) {
+            fprintf(stderr, "setsockopt TCP_DEFER_ACCEPT failed: %s\n", strerror(errno));
+        }
+        int queue = SOCKET_FASTOPEN_QUEUE;
+        if (setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)) < 0) {
+            fprintf(stderr, "setsockopt TCP_FASTOPEN failed: %s\n", strerror(errno));
+        }
+        if (setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+            fprintf(stderr, "setsockopt TCP_NODELAY failed: %s\n", strerror(errno));
+        }
+
         /* Bind socket to port */
         if (bind(server_fd, p->ai_addr, p->ai_addrlen) < 0) {
             fprintf(stderr, "bind failed: %s\n", strerror(errno));
@@ -50,7 +86,7 @@ int socket_listen(const char *port) {
         }
 
         /* Listen on socket */
-        if (listen(server_fd, SOMAXCONN) < 0) {
+        if (backlog && listen(server_fd, backlog) < 0) {
             fprintf(stderr, "listen failed: %s\n", strerror(errno));
             close(server_fd);
             server_fd = -1;
@@ -63,4 +99,37 @@ int socket_listen(const char *port) {
 
 }
 
+/**
+ * Allocate socket, bind it, and listen to specified port.
+ *
+ * @param   port        Port number to bind to and listen on.
+ * @param   shared      Whether other sockets (ie. prefork workers) may also
+ *                      listen on port (SO_REUSEPORT).
+ * @return  Allocated server socket file descriptor.
+ *
+ * Sockets that are not shared make a second server fail to bind the port,
+ * instead of silently taking half of its connections.
+ **/
+int socket_listen(const char *port, bool shared) {
+    return socket_bind(port, shared, SOMAXCONN);
+}
+
+/**
+ * Check that nothing else listens to specified port.
+ *
+ * @param   port        Port number to check.
+ * @return  Whether or not an unshared socket could be bound to port.
+ *
+ * The socket is closed again right away, so it never joins (or takes
+ * connections from) a group of shared sockets that listen on the port later.
+ **/
+bool socket_available(const char *port) {
+    int fd = socket_bind(port, false, 0);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,16 +3,32 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 
 #include <unistd.h>
 
-/* Global Variables */
-char *Port	      =  "9898"; // might want to change to 9421
-char *MimeTypesPath   = "/etc/mime.types";
-char *DefaultMimeType = "text/plain";
-char *RootPath	      = "www";
+/* Names of concurrency modes (indexed by ServerMode) */
+static const char *ModeNames[] = {
+    "Single",
+    "Forking",
+    "Event",
+    "Prefork",
+    "Threaded",
+    "Unknown",
+};
+
+/**
+ * Ignore SIGPIPE.
+ *
+ * @param   signum      Signal number.
+ *
+ * Installed instead of SIG_IGN so writes to closed client sockets fail with
+ * EPIPE, while CGI scripts still start with the default disposition.
+ **/
+void sigpipe_handler(int signum) {
+}
 
 /**
  * Display usage message and exit with specified status code.
@@ -21,14 +37,27 @@ char *RootPath	      = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hacCFgkmMnpPrRstTwz]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -a path       Access log (- for stderr)\n");
+    fprintf(stderr, "    -c mode       Single, Forking, Event, Prefork, or Threaded mode\n");
+    fprintf(stderr, "    -C bytes      Memory budget of hot content cache\n");
+    fprintf(stderr, "    -F entries    Number of files in metadata cache\n");
+    fprintf(stderr, "    -g bytes      Memory budget of CGI response cache\n");
+    fprintf(stderr, "    -k seconds    Keep-alive idle timeout\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -n requests   Requests per prefork worker before restart\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
+    fprintf(stderr, "    -P workers    Persistent workers per *.worker script\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -R requests   Trace one in this many requests to trace file\n");
+    fprintf(stderr, "    -s requests   Log one in this many requests to access log\n");
+    fprintf(stderr, "    -t threads    Number of worker threads (CGI threads in event mode)\n");
+    fprintf(stderr, "    -T path       Trace file of request phases (see trace_summary)\n");
+    fprintf(stderr, "    -w workers    Number of prefork workers\n");
+    fprintf(stderr, "    -z bytes      Memory budget of compressed content cache\n");
     exit(status);
 }
 
@@ -48,32 +77,80 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
     while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
         char *arg = argv[argind++];
     	switch (arg[1]) {
+	    case 'a':
+	    	AccessLogPath = argv[argind++];
+	    	break;
 	    case 'c':
 	    	if (streq(argv[argind], "single")) {
 	    	  *mode = SINGLE;
         }
         else if (streq(argv[argind], "forking")) {
 	    	  *mode = FORKING;
+	    	}
+        else if (streq(argv[argind], "event")) {
+	    	  *mode = EVENT;
+	    	}
+        else if (streq(argv[argind], "prefork")) {
+	    	  *mode = PREFORK;
+	    	}
+        else if (streq(argv[argind], "threaded")) {
+	    	  *mode = THREADED;
 	    	} else {
 	    	    return false;
 	    	}
 	    	argind++;
 	    	break;
+	    case 'C':
+	    	ContentCacheSize = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 'F':
+	    	FileCacheSize = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 'g':
+	    	CGICacheSize = strtoul(argv[argind++], NULL, 10);
+	    	break;
 	    case 'h':
 	    	usage(argv[0], EXIT_SUCCESS);
 	    	break;
+	    case 'k':
+	    	KeepAliveTimeout = atoi(argv[argind++]);
+	    	break;
 	    case 'm':
 	    	MimeTypesPath = argv[argind++];
 	    	break;
 	    case 'M':
 	    	DefaultMimeType = argv[argind++];
 	    	break;
+	    case 'n':
+	    	WorkerRequests = strtoul(argv[argind++], NULL, 10);
+	    	break;
 	    case 'p':
 	    	Port = argv[argind++];
 	    	break;
+	    case 'P':
+	    	CGIWorkers = strtoul(argv[argind++], NULL, 10);
+	    	break;
 	    case 'r':
 	    	RootPath = argv[argind++];
 	    	break;
+	    case 'R':
+	    	TraceSampling = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 's':
+	    	AccessSampling = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 't':
+	    	Threads = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 'T':
+	    	TracePath = argv[argind++];
+	    	break;
+	    case 'w':
+	    	Workers = strtoul(argv[argind++], NULL, 10);
+	    	break;
+	    case 'z':
+	    	CompressCacheSize = strtoul(argv[argind++], NULL, 10);
+	    	break;
 	    default:
 	        return false;
 	    	break;
@@ -90,14 +167,36 @@ int main(int argc, char *argv[]) {
     ServerMode mode = SINGLE;
 
     /* Parse command line options */
-    parse_options(argc, argv, &mode);
+    if (!parse_options(argc, argv, &mode)) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    /* Start logger (log messages are written by a background thread) */
+    if (!logger_start()) {
+        log("Unable to open log files: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Share metrics between all server processes */
+    stats_init();
 
-    /* Listen to server socket */
-    int server_fd = socket_listen(Port);
-    if (server_fd < 0){
+    /* Handle client disconnects as write errors */
+    signal(SIGPIPE, sigpipe_handler);
+
+    /* Listen to server socket (in prefork mode, the workers listen to their
+     * own sockets, so only check that the port is free) */
+    int server_fd = -1;
+    if (mode == PREFORK ? !socket_available(Port) : (server_fd = socket_listen(Port, false)) < 0) {
         return EXIT_FAILURE;
     }
 
+    /* Load mimetypes index (reloaded on SIGHUP) */
+    if (!mimetypes_load(MimeTypesPath)) {
+        log("Unable to load mimetypes from %s", MimeTypesPath);
+    }
+    signal(SIGHUP, mimetypes_reload);
+    signal(SIGUSR1, arena_report);
+
     /* Determine real RootPath */
     char buffer[BUFSIZ];
     if(!(RootPath = realpath(RootPath, buffer)))
@@ -107,13 +206,33 @@ int main(int argc, char *argv[]) {
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    debug("ConcurrencyMode = %s", ModeNames[mode]);
+
+    /* Each forked connection would start (and kill) its own CGI workers, and
+     * fill (and discard) its own CGI response cache */
+    if (mode == FORKING) {
+        CGIWorkers   = 0;
+        CGICacheSize = 0;
+    }
 
-    /* Start either forking or single HTTP server */
-    if(mode == SINGLE)
-        single_server(server_fd);
-    else
-        forking_server(server_fd);
+    /* Start appropriate HTTP server */
+    switch (mode) {
+        case FORKING:
+            forking_server(server_fd);
+            break;
+        case EVENT:
+            event_server(server_fd);
+            break;
+        case PREFORK:
+            prefork_server();
+            break;
+        case THREADED:
+            threaded_server(server_fd);
+            break;
+        default:
+            single_server(server_fd);
+            break;
+    }
 
     return EXIT_SUCCESS; // changed from status b/c compile error
 }
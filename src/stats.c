@@ -0,0 +1,234 @@
+/* stats.c: Server Metrics */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define STATS_BUCKETS       16              /* Latency buckets (plus +Inf) */
+#define STATS_STATUSES      16              /* Status codes counted */
+
+/* Upper bounds of latency buckets in microseconds */
+static const long Buckets[STATS_BUCKETS] = {
+    100, 250, 500,
+    1000, 2500, 5000,
+    10000, 25000, 50000,
+    100000, 250000, 500000,
+    1000000, 2500000, 5000000,
+    10000000,
+};
+
+/* Names of handlers (indexed by StatsHandler) */
+static const char *HandlerNames[] = {
+    "browse",
+    "file",
+    "cgi",
+    "worker",
+    "error",
+    "stats",
+};
+
+/* Names of caches (indexed by StatsCache) */
+static const char *CacheNames[] = {
+    "file",
+    "content",
+    "compressed",
+    "listing",
+    "cgi",
+};
+
+typedef struct {
+    size_t      buckets[STATS_BUCKETS + 1]; /*< Requests per bucket (last is +Inf) */
+    size_t      count;                  /*< Number of requests */
+    size_t      usec;                   /*< Total duration in microseconds */
+} Histogram;
+
+typedef struct {
+    Histogram       handlers[STATS_HANDLERS];   /*< Latency by handler */
+    size_t          responses[STATS_STATUSES];  /*< Responses by Status */
+    size_t          accepted;                   /*< Connections accepted */
+    long            active;                     /*< Connections open */
+    size_t          bytes;                      /*< Bytes sent */
+    CacheCounters   caches[STATS_CACHES];       /*< Cache counters */
+    time_t          started;                    /*< Start time of server */
+} StatsData;
+
+/* Global Variables */
+
+static StatsData  Local;
+static StatsData *Stats = &Local;
+
+/**
+ * Allocate metrics in shared memory.
+ *
+ * This must be called before forking, so that every process of the server
+ * updates (with atomic operations) and reports the same counters.  If the
+ * mapping fails, each process keeps its own counters.
+ **/
+void stats_init() {
+    StatsData *shared = mmap(NULL, sizeof(StatsData), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        log("Unable to map shared metrics: %s", strerror(errno));
+    } else {
+        Stats = shared;
+    }
+    Stats->started = time(NULL);
+}
+
+/**
+ * Lookup counters of cache.
+ *
+ * @param   cache       Cache to lookup.
+ * @return  Shared counters of cache (see Cache).
+ **/
+CacheCounters *stats_cache(StatsCache cache) {
+    return &Stats->caches[cache];
+}
+
+/**
+ * Record opened or closed connection.
+ *
+ * @param   opened      Whether the connection was opened (or closed).
+ **/
+void stats_connection(bool opened) {
+    if (opened) {
+        __atomic_add_fetch(&Stats->accepted, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&Stats->active, opened ? 1 : -1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Record handled request.
+ *
+ * @param   handler     Handler of request.
+ * @param   status      Status of response.
+ * @param   started     Time request handling started (CLOCK_MONOTONIC).
+ * @param   bytes       Bytes of response.
+ **/
+void stats_request(StatsHandler handler, Status status, const struct timespec *started, size_t bytes) {
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    long usec = (finished.tv_sec - started->tv_sec) * 1000000 + (finished.tv_nsec - started->tv_nsec) / 1000;
+    int  bucket = 0;
+    while (bucket < STATS_BUCKETS && usec > Buckets[bucket]) {
+        bucket++;
+    }
+
+    Histogram *h = &Stats->handlers[handler];
+    __atomic_add_fetch(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->usec, usec, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Stats->responses[status < STATS_STATUSES ? status : 0], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Stats->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Load counter.
+ *
+ * @param   counter     Counter to load.
+ * @return  Value of counter.
+ **/
+static size_t stats_load(size_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * Render metrics in the Prometheus text format.
+ *
+ * @param   length      Set to length of rendered metrics.
+ * @return  Newly allocated metrics (or NULL on error).
+ *
+ * https://prometheus.io/docs/instrumenting/exposition_formats/
+ **/
+char *stats_render(size_t *length) {
+    char *buffer = NULL;
+    FILE *stream = open_memstream(&buffer, length);
+    if (!stream) {
+        return NULL;
+    }
+
+    fprintf(stream, "# HELP spidey_start_time_seconds Start time of the server since the epoch.\n");
+    fprintf(stream, "# TYPE spidey_start_time_seconds gauge\n");
+    fprintf(stream, "spidey_start_time_seconds %jd\n", (intmax_t)Stats->started);
+
+    fprintf(stream, "# HELP spidey_connections_accepted_total Connections accepted.\n");
+    fprintf(stream, "# TYPE spidey_connections_accepted_total counter\n");
+    fprintf(stream, "spidey_connections_accepted_total %zu\n", stats_load(&Stats->accepted));
+
+    fprintf(stream, "# HELP spidey_connections_active Connections currently open.\n");
+    fprintf(stream, "# TYPE spidey_connections_active gauge\n");
+    fprintf(stream, "spidey_connections_active %ld\n", __atomic_load_n(&Stats->active, __ATOMIC_RELAXED));
+
+    fprintf(stream, "# HELP spidey_sent_bytes_total Bytes of responses sent (including headers).\n");
+    fprintf(stream, "# TYPE spidey_sent_bytes_total counter\n");
+    fprintf(stream, "spidey_sent_bytes_total %zu\n", stats_load(&Stats->bytes));
+
+    fprintf(stream, "# HELP spidey_responses_total Responses by status code.\n");
+    fprintf(stream, "# TYPE spidey_responses_total counter\n");
+    for (Status s = 0; s < STATS_STATUSES; s++) {
+        const char *string = http_status_string(s);
+        size_t      count  = stats_load(&Stats->responses[s]);
+        if (string && count) {
+            fprintf(stream, "spidey_responses_total{code=\"%d\"} %zu\n", atoi(string), count);
+        }
+    }
+
+    fprintf(stream, "# HELP spidey_request_duration_seconds Time to handle requests by handler.\n");
+    fprintf(stream, "# TYPE spidey_request_duration_seconds histogram\n");
+    for (StatsHandler handler = 0; handler < STATS_HANDLERS; handler++) {
+        Histogram  *h     = &Stats->handlers[handler];
+        const char *name  = HandlerNames[handler];
+        size_t      total = 0;
+
+        for (int bucket = 0; bucket <= STATS_BUCKETS; bucket++) {
+            total += stats_load(&h->buckets[bucket]);
+            if (bucket < STATS_BUCKETS) {
+                fprintf(stream, "spidey_request_duration_seconds_bucket{handler=\"%s\",le=\"%g\"} %zu\n",
+                        name, Buckets[bucket] / 1e6, total);
+            } else {
+                fprintf(stream, "spidey_request_duration_seconds_bucket{handler=\"%s\",le=\"+Inf\"} %zu\n", name, total);
+            }
+        }
+        fprintf(stream, "spidey_request_duration_seconds_sum{handler=\"%s\"} %.6f\n", name, stats_load(&h->usec) / 1e6);
+        fprintf(stream, "spidey_request_duration_seconds_count{handler=\"%s\"} %zu\n", name, stats_load(&h->count));
+    }
+
+    fprintf(stream, "# HELP spidey_cache_hits_total Successful cache lookups.\n");
+    fprintf(stream, "# TYPE spidey_cache_hits_total counter\n");
+    for (StatsCache cache = 0; cache < STATS_CACHES; cache++) {
+        fprintf(stream, "spidey_cache_hits_total{cache=\"%s\"} %zu\n", CacheNames[cache], stats_load(&Stats->caches[cache].hits));
+    }
+    fprintf(stream, "# HELP spidey_cache_misses_total Failed cache lookups.\n");
+    fprintf(stream, "# TYPE spidey_cache_misses_total counter\n");
+    for (StatsCache cache = 0; cache < STATS_CACHES; cache++) {
+        fprintf(stream, "spidey_cache_misses_total{cache=\"%s\"} %zu\n", CacheNames[cache], stats_load(&Stats->caches[cache].misses));
+    }
+    fprintf(stream, "# HELP spidey_cache_evictions_total Entries evicted from caches.\n");
+    fprintf(stream, "# TYPE spidey_cache_evictions_total counter\n");
+    for (StatsCache cache = 0; cache < STATS_CACHES; cache++) {
+        fprintf(stream, "spidey_cache_evictions_total{cache=\"%s\"} %zu\n", CacheNames[cache], stats_load(&Stats->caches[cache].evictions));
+    }
+    fprintf(stream, "# HELP spidey_cache_hit_ratio Fraction of cache lookups that succeeded.\n");
+    fprintf(stream, "# TYPE spidey_cache_hit_ratio gauge\n");
+    for (StatsCache cache = 0; cache < STATS_CACHES; cache++) {
+        size_t hits   = stats_load(&Stats->caches[cache].hits);
+        size_t misses = stats_load(&Stats->caches[cache].misses);
+        fprintf(stream, "spidey_cache_hit_ratio{cache=\"%s\"} %g\n", CacheNames[cache],
+                hits + misses ? (double)hits / (hits + misses) : 0.0);
+    }
+
+    if (fclose(stream) != 0) {
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,581 @@
+/* thor: HTTP Load Generator */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Each hammer is one client connection, and all of them are multiplexed by a
+ * single epoll loop, so thousands of connections cost only file descriptors.
+ *
+ * In closed-loop mode (the default), a hammer throws its next request as soon
+ * as the previous one completes.  In open-loop mode (-r), requests are thrown
+ * on a fixed schedule, and each latency is measured from the time the request
+ * was scheduled rather than sent: when the server falls behind and every
+ * hammer is busy, the requests that are waiting accumulate that delay too
+ * (correcting for coordinated omission).
+ *
+ * Latencies are recorded in a log-linear (HDR) histogram with 128 linear
+ * sub-buckets per power of two, which bounds the error of any percentile to
+ * under 1%.
+ */
+
+/* Constants */
+
+#define THOR_SUB_BITS       7                       /* Sub-buckets per power of two (log2) */
+#define THOR_SUB_COUNT      (1 << THOR_SUB_BITS)
+#define THOR_SUB_HALF       (THOR_SUB_COUNT / 2)
+#define THOR_BUCKETS        (THOR_SUB_COUNT + (64 - THOR_SUB_BITS) * THOR_SUB_HALF)
+#define THOR_HEADER_MAX     8192                    /* Longest response header */
+#define THOR_EVENTS         1024                    /* Events per epoll_wait */
+
+typedef enum {
+    HAMMER_IDLE,                        /**< No request in flight */
+    HAMMER_CONNECTING,                  /**< Waiting for connect */
+    HAMMER_WRITING,                     /**< Writing request */
+    HAMMER_READING,                     /**< Reading response */
+} HammerState;
+
+typedef struct {
+    int         fd;                     /*< Socket (-1 = not connected) */
+    HammerState state;                  /*< State of current request */
+    uint64_t    intended;               /*< Time request was scheduled (ns) */
+    size_t      request;                /*< Index of request (in Requests) */
+    size_t      written;                /*< Bytes of request written */
+    char        header[THOR_HEADER_MAX];/*< Response header (so far) */
+    size_t      length;                 /*< Length of response header */
+    bool        parsed;                 /*< Whether the header was parsed */
+    int         code;                   /*< Status code of response */
+    long        remaining;              /*< Body bytes left (-1 = until close) */
+    bool        reusable;               /*< Whether server keeps connection open */
+} Hammer;
+
+/* Global Variables */
+
+static struct addrinfo *Address;
+static char    **Requests;              /* Request of each URL (thrown in turn) */
+static size_t   *RequestLengths;
+static size_t    NRequests  = 0;
+static bool      KeepAlive  = false;
+static Hammer   *Hammers;
+static size_t   *Idle;                  /* Stack of idle hammers */
+static size_t    NIdle      = 0;
+static int       EpollFd;
+
+static uint64_t  Histogram[THOR_BUCKETS];
+static size_t    Completed  = 0;
+static size_t    Errors     = 0;
+static size_t    Failures   = 0;        /* Responses with status >= 400 */
+static size_t    Received   = 0;        /* Bytes received */
+
+/* Functions */
+
+/**
+ * Display usage message and exit with specified status code.
+ *
+ * @param   progname    Program Name
+ * @param   status      Exit status.
+ */
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [-h HAMMERS -t THROWS -d SECONDS -r RATE -k -j] URL...\n", progname);
+    fprintf(stderr, "    -h  HAMMERS     Number of concurrent connections (1)\n");
+    fprintf(stderr, "    -t  THROWS      Number of requests per hammer    (1)\n");
+    fprintf(stderr, "    -d  SECONDS     Throw requests for this long (instead of -t)\n");
+    fprintf(stderr, "    -r  RATE        Throw requests at this rate per second (open loop)\n");
+    fprintf(stderr, "    -k              Keep connections alive between requests\n");
+    fprintf(stderr, "    -j              Report results as JSON\n");
+    fprintf(stderr, "Multiple URLs (of the same host) are requested in turn.\n");
+    exit(status);
+}
+
+/**
+ * Read monotonic clock.
+ *
+ * @return  CLOCK_MONOTONIC time in nanoseconds.
+ **/
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Lookup histogram bucket of value.
+ *
+ * @param   value       Latency in nanoseconds.
+ * @return  Index of bucket.
+ *
+ * Values below THOR_SUB_COUNT have a bucket each; above that, each power of
+ * two is split into THOR_SUB_HALF buckets.
+ **/
+static size_t histogram_index(uint64_t value) {
+    if (value < THOR_SUB_COUNT) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (THOR_SUB_BITS - 1);
+    return THOR_SUB_COUNT + (shift - 1) * THOR_SUB_HALF + (value >> shift) - THOR_SUB_HALF;
+}
+
+/**
+ * Lookup middle value of histogram bucket.
+ *
+ * @param   index       Index of bucket.
+ * @return  Latency in nanoseconds.
+ **/
+static uint64_t histogram_value(size_t index) {
+    if (index < THOR_SUB_COUNT) {
+        return index;
+    }
+    int      shift = (index - THOR_SUB_COUNT) / THOR_SUB_HALF + 1;
+    uint64_t sub   = (index - THOR_SUB_COUNT) % THOR_SUB_HALF + THOR_SUB_HALF;
+    return (sub << shift) + ((1ULL << shift) >> 1);
+}
+
+/**
+ * Lookup percentile of recorded latencies.
+ *
+ * @param   percentile  Percentile (0 - 100).
+ * @param   count       Number of recorded latencies.
+ * @return  Latency in microseconds.
+ **/
+static double histogram_percentile(double percentile, size_t count) {
+    size_t target = (size_t)(percentile / 100.0 * count + 0.5);
+    size_t total  = 0;
+
+    if (target < 1) {
+        target = 1;
+    }
+    for (size_t index = 0; index < THOR_BUCKETS; index++) {
+        total += Histogram[index];
+        if (total >= target) {
+            return histogram_value(index) / 1000.0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parse URL into address (of the first URL) and request.
+ *
+ * @param   url         URL (ie. http://localhost:9898/index.html).
+ * @return  Whether or not the URL was parsed and its host resolved.
+ **/
+static bool parse_url(const char *url) {
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV] = "80";
+
+    if (strncmp(url, "http://", 7) == 0) {
+        url += 7;
+    }
+
+    const char *slash   = strchr(url, '/');
+    const char *path    = slash ? slash : "/";
+    size_t      hostlen = slash ? (size_t)(slash - url) : strlen(url);
+    if (hostlen >= sizeof(host)) {
+        return false;
+    }
+    memcpy(host, url, hostlen);
+    host[hostlen] = '\0';
+
+    char *colon = strrchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        snprintf(port, sizeof(port), "%s", colon + 1);
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int status = Address ? 0 : getaddrinfo(host, port, &hints, &Address);
+    if (status != 0) {
+        fprintf(stderr, "Unable to lookup %s:%s: %s\n", host, port, gai_strerror(status));
+        return false;
+    }
+
+    int length = asprintf(&Requests[NRequests], "GET %s HTTP/1.1\r\nHost: %.*s\r\nConnection: %s\r\n\r\n",
+                          path, (int)hostlen, url, KeepAlive ? "keep-alive" : "close");
+    if (length < 0) {
+        return false;
+    }
+    RequestLengths[NRequests++] = length;
+    return true;
+}
+
+/**
+ * Watch socket of hammer for its current state.
+ *
+ * @param   h           Hammer.
+ * @param   op          EPOLL_CTL_ADD or EPOLL_CTL_MOD.
+ **/
+static void hammer_watch(Hammer *h, int op) {
+    struct epoll_event event = {
+        .events   = h->state == HAMMER_READING ? EPOLLIN : EPOLLOUT,
+        .data.ptr = h,
+    };
+    epoll_ctl(EpollFd, op, h->fd, &event);
+}
+
+/**
+ * Finish current request of hammer.
+ *
+ * @param   h           Hammer.
+ * @param   success     Whether or not a complete response was received.
+ **/
+static void hammer_finish(Hammer *h, bool success) {
+    if (success) {
+        uint64_t latency = now() - h->intended;
+        Histogram[histogram_index(latency)]++;
+        if (h->code >= 400) {
+            Failures++;
+        }
+    } else {
+        Errors++;
+    }
+    Completed++;
+
+    if (!success || !KeepAlive || !h->reusable) {
+        close(h->fd);
+        h->fd = -1;
+    }
+    h->state = HAMMER_IDLE;
+    Idle[NIdle++] = h - Hammers;
+}
+
+/**
+ * Throw request from hammer.
+ *
+ * @param   h           Hammer.
+ * @param   request     Index of request.
+ * @param   intended    Time request was scheduled.
+ **/
+static void hammer_throw(Hammer *h, size_t request, uint64_t intended) {
+    h->request  = request;
+    h->intended = intended;
+    h->written  = 0;
+    h->length   = 0;
+    h->parsed   = false;
+    h->code     = 0;
+
+    if (h->fd >= 0) {
+        h->state = HAMMER_WRITING;
+        hammer_watch(h, EPOLL_CTL_MOD);
+        return;
+    }
+
+    h->fd = socket(Address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (h->fd < 0) {
+        hammer_finish(h, false);
+        return;
+    }
+    if (connect(h->fd, Address->ai_addr, Address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        hammer_finish(h, false);
+        return;
+    }
+    h->state = HAMMER_CONNECTING;
+    hammer_watch(h, EPOLL_CTL_ADD);
+}
+
+/**
+ * Find end of response header of hammer.
+ *
+ * @param   h           Hammer.
+ * @return  Length of header including the blank line (or 0 if incomplete).
+ *
+ * CGI scripts often terminate lines with a bare LF, so that is accepted too.
+ **/
+static size_t hammer_header(Hammer *h) {
+    char *crlf = memmem(h->header, h->length, "\r\n\r\n", 4);
+    char *lf   = memmem(h->header, h->length, "\n\n", 2);
+
+    if (lf && (!crlf || lf < crlf)) {
+        return lf + 2 - h->header;
+    }
+    return crlf ? (size_t)(crlf + 4 - h->header) : 0;
+}
+
+/**
+ * Parse response header of hammer.
+ *
+ * @param   h           Hammer.
+ * @param   end         Length of header (including blank line).
+ *
+ * Responses without a Content-Length are read until the server closes the
+ * connection, which is also expected if the server did not agree to keep it
+ * alive.
+ **/
+static void hammer_parse(Hammer *h, size_t end) {
+    char  saved = h->header[end - 1];
+    h->header[end - 1] = '\0';
+
+    int minor = 0;
+    sscanf(h->header, "HTTP/1.%d %d", &minor, &h->code);
+
+    const char *length = strcasestr(h->header, "\nContent-Length:");
+    h->remaining = length ? strtol(length + 16, NULL, 10) : -1;
+
+    const char *connection = strcasestr(h->header, "\nConnection:");
+    if (connection) {
+        connection += 12;
+        connection += strspn(connection, " \t");
+        h->reusable = strncasecmp(connection, "keep-alive", 10) == 0;
+    } else {
+        h->reusable = minor >= 1;
+    }
+    if (h->remaining < 0) {
+        h->reusable = false;
+    }
+
+    h->header[end - 1] = saved;
+    h->parsed = true;
+}
+
+/**
+ * Read response of hammer.
+ *
+ * @param   h           Hammer.
+ **/
+static void hammer_read(Hammer *h) {
+    static char buffer[64 * 1024];
+
+    while (true) {
+        char   *data  = h->parsed ? buffer : h->header + h->length;
+        size_t  space = h->parsed ? sizeof(buffer) : sizeof(h->header) - h->length;
+        ssize_t n     = read(h->fd, data, space);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            hammer_finish(h, n == 0 && h->parsed && h->remaining < 0);
+            return;
+        }
+        Received += n;
+
+        if (!h->parsed) {
+            h->length += n;
+            size_t header = hammer_header(h);
+            if (!header) {
+                if (h->length == sizeof(h->header)) {
+                    hammer_finish(h, false);
+                    return;
+                }
+                continue;
+            }
+            hammer_parse(h, header);
+            n = h->length - header;
+        }
+
+        if (h->remaining >= 0) {
+            h->remaining -= n;
+            if (h->remaining <= 0) {
+                hammer_finish(h, true);
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Write request of hammer.
+ *
+ * @param   h           Hammer.
+ **/
+static void hammer_write(Hammer *h) {
+    if (h->state == HAMMER_CONNECTING) {
+        int       error  = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+            hammer_finish(h, false);
+            return;
+        }
+        h->state = HAMMER_WRITING;
+    }
+
+    const char *request = Requests[h->request];
+    size_t      length  = RequestLengths[h->request];
+
+    while (h->written < length) {
+        ssize_t n = write(h->fd, request + h->written, length - h->written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n < 0) {
+            hammer_finish(h, false);
+            return;
+        }
+        h->written += n;
+    }
+
+    h->state = HAMMER_READING;
+    hammer_watch(h, EPOLL_CTL_MOD);
+}
+
+/**
+ * Raise limit of open files to allow as many hammers as possible.
+ **/
+static void raise_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/**
+ * Report throughput and latency.
+ *
+ * @param   elapsed     Seconds spent throwing requests.
+ * @param   json        Whether or not to report as a JSON object.
+ **/
+static void report(double elapsed, bool json) {
+    size_t count = Completed - Errors;
+    double rate  = count / elapsed;
+    double mbps  = Received / elapsed / (1024 * 1024);
+
+    if (json) {
+        printf("{\"requests\": %zu, \"errors\": %zu, \"failures\": %zu, \"seconds\": %.3f, "
+               "\"rps\": %.1f, \"mbps\": %.2f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+               "\"p999_us\": %.1f, \"max_us\": %.1f}\n",
+               Completed, Errors, Failures, elapsed, rate, mbps,
+               histogram_percentile(50, count), histogram_percentile(99, count),
+               histogram_percentile(99.9, count), histogram_percentile(100, count));
+        return;
+    }
+
+    printf("Requests:    %zu (%zu errors, %zu responses >= 400)\n", Completed, Errors, Failures);
+    printf("Duration:    %.3f s\n", elapsed);
+    printf("Throughput:  %.1f requests/s, %.2f MB/s\n", rate, mbps);
+    if (count) {
+        printf("Latency:     p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+               histogram_percentile(50, count), histogram_percentile(99, count),
+               histogram_percentile(99.9, count), histogram_percentile(100, count));
+    }
+}
+
+/**
+ * Hammer URLs and report throughput and latency.
+ **/
+int main(int argc, char *argv[]) {
+    size_t hammers  = 1;
+    size_t throws   = 1;
+    double seconds  = 0;
+    double rate     = 0;
+    bool   json     = false;
+
+    /* Parse command line arguments */
+    int argind = 1;
+    while (argind < argc && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (strlen(arg) != 2) {
+            usage(argv[0], EXIT_FAILURE);
+        } else if (arg[1] == 'j') {
+            json = true;
+        } else if (arg[1] == 'k') {
+            KeepAlive = true;
+        } else if (argind < argc && arg[1] == 'h') {
+            hammers = strtoul(argv[argind++], NULL, 10);
+        } else if (argind < argc && arg[1] == 't') {
+            throws = strtoul(argv[argind++], NULL, 10);
+        } else if (argind < argc && arg[1] == 'd') {
+            seconds = strtod(argv[argind++], NULL);
+        } else if (argind < argc && arg[1] == 'r') {
+            rate = strtod(argv[argind++], NULL);
+        } else {
+            usage(argv[0], EXIT_FAILURE);
+        }
+    }
+    Requests       = calloc(argc, sizeof(char *));
+    RequestLengths = calloc(argc, sizeof(size_t));
+    if (argind == argc || !hammers || !Requests || !RequestLengths) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+    while (argind < argc) {
+        if (!parse_url(argv[argind++])) {
+            usage(argv[0], EXIT_FAILURE);
+        }
+    }
+
+    raise_limit();
+    Hammers = calloc(hammers, sizeof(Hammer));
+    Idle    = calloc(hammers, sizeof(size_t));
+    EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (!Hammers || !Idle || EpollFd < 0) {
+        fprintf(stderr, "Unable to allocate %zu hammers: %s\n", hammers, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < hammers; i++) {
+        Hammers[i].fd = -1;
+        Idle[NIdle++] = hammers - 1 - i;
+    }
+
+    /* Throw requests until all are completed (or time is up) */
+    struct epoll_event events[THOR_EVENTS];
+    size_t   total    = seconds > 0 ? SIZE_MAX : hammers * throws;
+    size_t   thrown   = 0;
+    uint64_t started  = now();
+    uint64_t deadline = seconds > 0 ? started + (uint64_t)(seconds * 1e9) : UINT64_MAX;
+    uint64_t current  = started;
+
+    while (Completed < total && current < deadline) {
+        int timeout = -1;
+
+        while (NIdle && thrown < total) {
+            uint64_t scheduled = rate > 0 ? started + (uint64_t)(thrown * 1e9 / rate) : current;
+            if (scheduled > current) {
+                timeout = (scheduled - current + 999999) / 1000000;
+                break;
+            }
+            hammer_throw(&Hammers[Idle[--NIdle]], thrown++ % NRequests, scheduled);
+        }
+        while (NIdle && thrown >= total) {
+            /* Release connections that have nothing left to throw */
+            Hammer *h = &Hammers[Idle[--NIdle]];
+            if (h->fd >= 0) {
+                close(h->fd);
+                h->fd = -1;
+            }
+        }
+        if (seconds > 0) {
+            int remaining = (deadline - current + 999999) / 1000000;
+            timeout = timeout < 0 || remaining < timeout ? remaining : timeout;
+        }
+        if (Completed >= total) {
+            break;
+        }
+
+        int n = epoll_wait(EpollFd, events, THOR_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            Hammer *h = events[i].data.ptr;
+            if (h->state == HAMMER_READING) {
+                hammer_read(h);
+            } else if (h->state != HAMMER_IDLE) {
+                hammer_write(h);
+            } else {
+                /* Server closed idle connection */
+                close(h->fd);
+                h->fd = -1;
+            }
+        }
+        current = now();
+    }
+
+    report((now() - started) / 1e9, json);
+    return Errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,415 @@
+/* threaded.c: Multithreaded HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define WORK_QUEUE_SIZE     1024        /* Must be a power of two */
+#define WORK_QUEUE_MASK     (WORK_QUEUE_SIZE - 1)
+#define POLLER_MAX_EVENTS   1024
+
+/* Connection */
+
+typedef struct connection Connection;
+struct connection {
+    Request    *request;                /*< Request state of connection */
+    time_t      active;                 /*< Time connection became idle */
+    Connection *prev;                   /*< Previous connection in idle list */
+    Connection *next;                   /*< Next connection in idle list */
+};
+
+/* Work Queue */
+
+/**
+ * Bounded lock-free work queue owned by one worker thread.
+ *
+ * The acceptor is the only producer and advances tail.  The owning worker
+ * and any thieves are consumers: each reads the slot at head and then claims
+ * it by advancing head with a compare-and-swap.  A slot can only be refilled
+ * once head has moved past it, so a consumer whose CAS succeeds always owns
+ * the request it read.  Requests are taken in FIFO order by owner and
+ * thieves alike so no connection is starved behind newer ones.
+ **/
+typedef struct {
+    size_t   head;                      /*< Next slot to take (consumers) */
+    char     padding[64 - sizeof(size_t)];
+    size_t   tail;                      /*< Next slot to fill (acceptor) */
+    Connection *slots[WORK_QUEUE_SIZE]; /*< Queued readable connections */
+} WorkQueue;
+
+/* Global Variables */
+
+static WorkQueue *Queues  = NULL;       /*< One work queue per thread */
+static sem_t      Pending;              /*< Number of queued connections */
+static int        Poller  = -1;         /*< Epoll set of server and idle connections */
+
+/* Idle connections ordered from least to most recently active, so expired
+ * connections are always found at the head (workers append, the acceptor
+ * removes) */
+static Connection     *IdleHead = NULL;
+static Connection     *IdleTail = NULL;
+static pthread_mutex_t IdleLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Push connection onto work queue (acceptor only).
+ *
+ * @param   q           Work queue.
+ * @param   c           Connection to queue.
+ * @return  Whether or not the connection was queued (false if full).
+ **/
+static bool work_queue_push(WorkQueue *q, Connection *c) {
+    size_t tail = q->tail;
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= WORK_QUEUE_SIZE) {
+        return false;
+    }
+
+    __atomic_store_n(&q->slots[tail & WORK_QUEUE_MASK], c, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Take connection from work queue (owner or thief).
+ *
+ * @param   q           Work queue.
+ * @return  Connection taken from queue (or NULL if empty).
+ **/
+static Connection *work_queue_take(WorkQueue *q) {
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    while (head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+        Connection *c = __atomic_load_n(&q->slots[head & WORK_QUEUE_MASK], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&q->head, &head, head + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Return current monotonic time in seconds.
+ **/
+static time_t threaded_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Close connection (which also removes it from the poller).
+ *
+ * @param   c           Connection (not in the idle list).
+ **/
+static void threaded_close(Connection *c) {
+    stats_connection(false);
+    free_request(c->request);
+    free(c);
+}
+
+/**
+ * Remove connection from idle list (with IdleLock held).
+ *
+ * @param   c           Connection.
+ **/
+static void threaded_idle_remove(Connection *c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        IdleHead = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    } else {
+        IdleTail = c->prev;
+    }
+    c->prev = c->next = NULL;
+}
+
+/**
+ * Return connection to the poller until the client sends more data.
+ *
+ * @param   c           Connection.
+ * @param   op          EPOLL_CTL_ADD for new connections, otherwise
+ * EPOLL_CTL_MOD.
+ *
+ * The connection is appended to the idle list before it is armed, since the
+ * acceptor may dispatch it as soon as it is, and IdleLock is held until it
+ * is armed, so the acceptor cannot expire (and free) it in between.  Once
+ * armed, the connection belongs to the acceptor and must not be touched.
+ * Connections are registered one-shot, so each is only ever owned by one
+ * worker at a time.
+ **/
+static void threaded_idle(Connection *c, int op) {
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+        .data.ptr = c,
+    };
+
+    pthread_mutex_lock(&IdleLock);
+    c->active = threaded_now();
+    c->prev   = IdleTail;
+    c->next   = NULL;
+    if (IdleTail) {
+        IdleTail->next = c;
+    } else {
+        IdleHead = c;
+    }
+    IdleTail = c;
+
+    if (epoll_ctl(Poller, op, c->request->fd, &event) < 0) {
+        log("Unable to register request: %s", strerror(errno));
+        threaded_idle_remove(c);
+        pthread_mutex_unlock(&IdleLock);
+        threaded_close(c);
+        return;
+    }
+    pthread_mutex_unlock(&IdleLock);
+}
+
+/**
+ * Handle requests on a readable connection.
+ *
+ * @param   c           Connection.
+ *
+ * Like the event server, this answers every complete request that is
+ * buffered (ie. pipelined requests) and then hands the connection back to
+ * the poller instead of waiting for the next request, so an idle keep-alive
+ * connection never holds a worker.  An incomplete request header is also
+ * handed back, unless it is overdue (see request_expired) or the client has
+ * finished sending, in which case it is answered before closing.
+ **/
+static void threaded_handle(Connection *c) {
+    Request *r = c->request;
+    bool keep_alive = true;
+
+    ssize_t nread = fill_request(r, false);
+    bool    eof   = nread == 0;
+    if ((eof && r->offset == r->length) || (nread < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        threaded_close(c);
+        return;
+    }
+
+    while (keep_alive && r->offset < r->length) {
+        if (check_request(r) == 0 && !request_expired(r) && !eof) {
+            break;
+        }
+        handle_request(r);
+        keep_alive = r->keep_alive;
+        reset_request(r);
+    }
+
+    if (keep_alive && !eof && idle_request(r)) {
+        threaded_idle(c, EPOLL_CTL_MOD);
+    } else {
+        threaded_close(c);
+    }
+}
+
+/**
+ * Handle connections from own work queue, stealing from others when empty.
+ *
+ * @param   arg         Index of worker thread.
+ * @return  NULL (never returns).
+ *
+ * Every queued connection is matched by one post to the Pending semaphore,
+ * so a worker that gets past sem_wait is guaranteed to find a connection in
+ * some queue, even if another worker stole the one meant for it.
+ **/
+static void *threaded_worker(void *arg) {
+    size_t id = (size_t)arg;
+
+    while (true) {
+        while (sem_wait(&Pending) < 0 && errno == EINTR);
+
+        Connection *c = NULL;
+        while (!c) {
+            for (size_t i = 0; i < Threads && !c; i++) {
+                c = work_queue_take(&Queues[(id + i) % Threads]);
+            }
+        }
+
+        threaded_handle(c);
+    }
+
+    return NULL;
+}
+
+/**
+ * Queue readable connection, backing off while every queue is full.
+ *
+ * @param   c           Connection.
+ * @param   next        Index of next queue to try (updated round-robin).
+ **/
+static void threaded_dispatch(Connection *c, size_t *next) {
+    while (true) {
+        size_t i;
+        for (i = 0; i < Threads; i++) {
+            if (work_queue_push(&Queues[(*next + i) % Threads], c)) {
+                break;
+            }
+        }
+        if (i < Threads) {
+            *next = (*next + i + 1) % Threads;
+            break;
+        }
+        sched_yield();
+    }
+    sem_post(&Pending);
+}
+
+/**
+ * Accept all pending connections and hand them to the poller.
+ *
+ * @param   sfd         Server socket file descriptor (non-blocking).
+ **/
+static void threaded_accept(int sfd) {
+    Request *request;
+
+    while ((request = accept_request(sfd))) {
+        Connection *c = calloc(1, sizeof(Connection));
+        if (!c) {
+            log("Unable to allocate connection: %s", strerror(errno));
+            free_request(request);
+            continue;
+        }
+        c->request = request;
+        stats_connection(true);
+        threaded_idle(c, EPOLL_CTL_ADD);
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log("Unable to accept request: %s", strerror(errno));
+    }
+}
+
+/**
+ * Close connections that have been idle for KeepAliveTimeout seconds.
+ **/
+static void threaded_expire() {
+    time_t now = threaded_now();
+
+    while (true) {
+        pthread_mutex_lock(&IdleLock);
+        Connection *c = IdleHead;
+        if (c && now - c->active >= KeepAliveTimeout) {
+            threaded_idle_remove(c);
+        } else {
+            c = NULL;
+        }
+        pthread_mutex_unlock(&IdleLock);
+
+        if (!c) {
+            break;
+        }
+        threaded_close(c);
+    }
+}
+
+/**
+ * Handle HTTP requests concurrently with a pool of threads.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * The main thread polls the server socket and every idle connection with one
+ * epoll set.  It accepts all pending connections on each wakeup, and queues
+ * connections round-robin across the worker threads' queues only once the
+ * client has sent data; idle workers steal from busy ones so a slow request
+ * does not hold up the rest of a worker's backlog.  Workers return
+ * connections to the epoll set between requests, and the main thread closes
+ * those idle for KeepAliveTimeout seconds.
+ **/
+int threaded_server(int sfd) {
+    struct epoll_event events[POLLER_MAX_EVENTS];
+
+    if (!Threads) {
+        Threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    /* Allocate work queues */
+    if (posix_memalign((void **)&Queues, 64, Threads * sizeof(WorkQueue)) != 0) {
+        fatal("Unable to allocate work queues");
+    }
+    memset(Queues, 0, Threads * sizeof(WorkQueue));
+    sem_init(&Pending, 0, 0);
+
+    /* Make server socket non-blocking (so each wakeup drains the backlog) */
+    int flags = fcntl(sfd, F_GETFL);
+    if (flags < 0 || fcntl(sfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        fatal("Unable to make server socket non-blocking: %s", strerror(errno));
+    }
+
+    /* Register server socket with poller */
+    if ((Poller = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fatal("Unable to create epoll instance: %s", strerror(errno));
+    }
+
+    struct epoll_event event = {
+        .events   = EPOLLIN,
+        .data.ptr = NULL,
+    };
+    if (epoll_ctl(Poller, EPOLL_CTL_ADD, sfd, &event) < 0) {
+        fatal("Unable to register server socket: %s", strerror(errno));
+    }
+
+    /* Start worker threads */
+    for (size_t i = 0; i < Threads; i++) {
+        pthread_t thread;
+        int status = pthread_create(&thread, NULL, threaded_worker, (void *)i);
+        if (status != 0) {
+            fatal("Unable to create thread: %s", strerror(status));
+        }
+        pthread_detach(thread);
+    }
+
+    /* Accept connections and queue readable ones to workers */
+    size_t next = 0;
+    while (true) {
+        int n = epoll_wait(Poller, events, POLLER_MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno != EINTR) {
+                log("Unable to wait for events: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            Connection *c = events[i].data.ptr;
+
+            /* Server socket: accept new connections */
+            if (!c) {
+                threaded_accept(sfd);
+                continue;
+            }
+
+            /* Client socket: hand to a worker (which also notices hang ups) */
+            pthread_mutex_lock(&IdleLock);
+            threaded_idle_remove(c);
+            pthread_mutex_unlock(&IdleLock);
+            threaded_dispatch(c, &next);
+        }
+
+        threaded_expire();
+    }
+
+    /* Close server socket */
+    close(Poller);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
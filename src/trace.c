@@ -0,0 +1,121 @@
+/* trace.c: Request Phase Tracing */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <time.h>
+
+/*
+ * A sampled request carries a TraceRecord (on the stack of handle_request)
+ * that trace_mark stamps with the end of each phase, relative to the start
+ * of the request.  The first request on a connection starts when it was
+ * accepted (so it includes accept), later ones start when handle_request is
+ * entered.  The client stream is opened once a connection has something to
+ * respond to (see open_request), so only requests that follow an idle period
+ * reach the stream phase.  Phases that are skipped (ie. file
+ * cache hits) are simply not marked in the reached bitmask.
+ *
+ * Finished records are queued to the LOG_TRACE channel of the logger, which
+ * appends them to the trace file (after a TraceHeader).  Use
+ * bin/trace_summary to report percentiles of each phase.
+ */
+
+/* Global Variables */
+
+__thread TraceRecord *TraceCurrent = NULL;
+static __thread size_t Traced = 0;
+
+/**
+ * Read monotonic clock.
+ *
+ * @return  CLOCK_MONOTONIC time in nanoseconds.
+ **/
+uint64_t trace_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Write header to empty trace file.
+ *
+ * @param   fd          Trace file descriptor.
+ * @return  Whether or not the file is usable (ie. empty or already traced).
+ **/
+bool trace_header(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return false;
+    }
+    if (st.st_size > 0) {
+        return true;
+    }
+
+    TraceHeader header = {.phases = TRACE_PHASES, .size = sizeof(TraceRecord)};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    return write(fd, &header, sizeof(header)) == sizeof(header);
+}
+
+/**
+ * Begin tracing request (if it is sampled).
+ *
+ * @param   r           Request structure.
+ * @param   record      Record to fill.
+ * @return  record if this is one of every TraceSampling requests (counted
+ * per thread), otherwise NULL.
+ **/
+TraceRecord *trace_begin(Request *r, TraceRecord *record) {
+    uint64_t accepted = r->accepted;
+
+    /* Only the first request on a connection includes accepting it */
+    r->accepted = 0;
+
+    if (!TracePath || !TraceSampling || ++Traced % TraceSampling != 0) {
+        return NULL;
+    }
+
+    memset(record, 0, sizeof(TraceRecord));
+    if (accepted) {
+        record->started = accepted;
+        record->reached = 1 << TRACE_ACCEPT;
+    } else {
+        record->started = trace_now();
+    }
+
+    return TraceCurrent = record;
+}
+
+/**
+ * Record end of phase (see trace_mark).
+ *
+ * @param   record      Record of current request.
+ * @param   phase       Phase that ended.
+ *
+ * Only the first end of each phase is recorded (ie. the first byte).
+ **/
+void trace_record(TraceRecord *record, TracePhase phase) {
+    if (record->reached & (1 << phase)) {
+        return;
+    }
+    record->phases[phase] = trace_now() - record->started;
+    record->reached      |= 1 << phase;
+}
+
+/**
+ * Finish tracing request and queue its record to the trace file.
+ *
+ * @param   record      Record of current request.
+ * @param   status      Status of response.
+ * @param   handler     Handler of request.
+ **/
+void trace_end(TraceRecord *record, Status status, StatsHandler handler) {
+    trace_record(record, TRACE_LAST_BYTE);
+    record->pid     = getpid();
+    record->code    = atoi(http_status_string(status));
+    record->handler = handler;
+    TraceCurrent    = NULL;
+
+    logger_queue(LOG_TRACE, (const char *)record, sizeof(TraceRecord));
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
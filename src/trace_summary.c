@@ -0,0 +1,153 @@
+/* trace_summary: Summarize Spidey Trace File */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Constants */
+
+/* Names of phases (indexed by TracePhase) */
+static const char *PhaseNames[] = {
+    "accept",
+    "fopencookie",
+    "parse_request",
+    "determine_request_path",
+    "stat/access",
+    "determine_mimetype",
+    "first byte",
+    "last byte",
+};
+
+/* Global Variables */
+
+static uint32_t *Durations[TRACE_PHASES];   /* Nanoseconds spent in each phase */
+static size_t    Counts[TRACE_PHASES];
+static uint32_t *Totals;                    /* Nanoseconds from start to last byte */
+static size_t    Records;
+
+/**
+ * Display usage message and exit with specified status code.
+ *
+ * @param   progname    Program Name
+ * @param   status      Exit status.
+ */
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [trace]\n", progname);
+    fprintf(stderr, "Summarize request phases traced by spidey -T (or standard input).\n");
+    exit(status);
+}
+
+/**
+ * Compare durations (for qsort).
+ **/
+static int compare_durations(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Lookup percentile of sorted durations.
+ *
+ * @param   durations   Sorted durations.
+ * @param   n           Number of durations.
+ * @param   percentile  Percentile (0 - 100).
+ * @return  Duration at percentile in microseconds.
+ **/
+static double percentile(const uint32_t *durations, size_t n, double percentile) {
+    size_t index = (size_t)(percentile / 100.0 * (n - 1) + 0.5);
+    return durations[index] / 1000.0;
+}
+
+/**
+ * Print percentiles of durations.
+ *
+ * @param   name        Name of phase.
+ * @param   durations   Durations (sorted in place).
+ * @param   n           Number of durations.
+ **/
+static void summarize(const char *name, uint32_t *durations, size_t n) {
+    if (!n) {
+        printf("%-24s %8d\n", name, 0);
+        return;
+    }
+
+    qsort(durations, n, sizeof(uint32_t), compare_durations);
+    printf("%-24s %8zu %10.1f %10.1f %10.1f %10.1f\n", name, n,
+           percentile(durations, n, 50), percentile(durations, n, 90),
+           percentile(durations, n, 99), durations[n - 1] / 1000.0);
+}
+
+/**
+ * Add record to durations.
+ *
+ * @param   record      Trace record.
+ *
+ * Each reached phase lasts from the end of the previous reached phase (or the
+ * start of the request).
+ **/
+static void add_record(const TraceRecord *record) {
+    uint32_t previous = 0;
+
+    for (TracePhase phase = 0; phase < TRACE_PHASES; phase++) {
+        if (!(record->reached & (1 << phase))) {
+            continue;
+        }
+        Durations[phase][Counts[phase]++] = record->phases[phase] - previous;
+        previous = record->phases[phase];
+    }
+    Totals[Records++] = record->phases[TRACE_LAST_BYTE];
+}
+
+/**
+ * Summarize trace file.
+ **/
+int main(int argc, char *argv[]) {
+    if (argc > 2 || (argc == 2 && streq(argv[1], "-h"))) {
+        usage(argv[0], argc == 2 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    FILE *stream = argc == 2 ? fopen(argv[1], "r") : stdin;
+    if (!stream) {
+        fprintf(stderr, "Unable to open %s: %s\n", argv[1], strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, stream) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.phases != TRACE_PHASES || header.size != sizeof(TraceRecord)) {
+        fprintf(stderr, "Not a spidey trace file (or from another version)\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Read records, growing the duration arrays as needed */
+    size_t      capacity = 0;
+    TraceRecord record;
+    while (fread(&record, sizeof(record), 1, stream) == 1) {
+        if (Records == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            bool allocated = (Totals = realloc(Totals, capacity * sizeof(uint32_t)));
+            for (TracePhase phase = 0; phase < TRACE_PHASES; phase++) {
+                allocated &= !!(Durations[phase] = realloc(Durations[phase], capacity * sizeof(uint32_t)));
+            }
+            if (!allocated) {
+                fprintf(stderr, "Unable to allocate durations: %s\n", strerror(errno));
+                return EXIT_FAILURE;
+            }
+        }
+        add_record(&record);
+    }
+    fclose(stream);
+
+    printf("%zu requests (durations in microseconds)\n\n", Records);
+    printf("%-24s %8s %10s %10s %10s %10s\n", "PHASE", "COUNT", "P50", "P90", "P99", "MAX");
+    for (TracePhase phase = 0; phase < TRACE_PHASES; phase++) {
+        summarize(PhaseNames[phase], Durations[phase], Counts[phase]);
+    }
+    summarize("total", Totals, Records);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,553 @@
+/* transmit.c: Zero-Copy Transmission Functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <poll.h>
+#include <stdio_ext.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Output queued for a deferred request (see transmit_resume) */
+struct output_segment {
+    OutputSegment *next;                /*< Next segment in queue */
+    int            fd;                  /*< File to send from (or -1 for data) */
+    off_t          offset;              /*< Offset of next byte in file (or data) */
+    size_t         length;              /*< Number of bytes left */
+    char           data[];              /*< Copy of output (if fd is -1) */
+};
+
+/**
+ * Wait until client socket is writable.
+ *
+ * @param   r           Request structure.
+ * @return  Whether or not the socket became writable.
+ *
+ * Only needed for non-blocking sockets, where sendfile and splice fail with
+ * EAGAIN once the socket buffer is full.
+ **/
+static bool transmit_wait(Request *r) {
+    struct pollfd pfd = {.fd = r->fd, .events = POLLOUT};
+    int status;
+
+    do {
+        status = poll(&pfd, 1, KeepAliveTimeout * 1000);
+    } while (status < 0 && errno == EINTR);
+
+    return status > 0 && !(pfd.revents & (POLLERR | POLLHUP));
+}
+
+/**
+ * Wait until source pipe has data (or is closed), if it has none yet.
+ *
+ * @param   fd          Source file descriptor.
+ * @return  Whether or not the pipe was empty and then became readable (errno
+ * is ETIMEDOUT if it stayed empty for CGI_TIMEOUT seconds).
+ *
+ * A splice from a non-blocking pipe into a non-blocking socket fails with
+ * EAGAIN both when the pipe is empty and when the socket is full, so the
+ * pipe is checked first.  Producers such as CGI scripts may take long to
+ * finish, but not to produce the next bit of output.
+ **/
+static bool transmit_source(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int status;
+
+    if (poll(&pfd, 1, 0) > 0) {
+        return false;
+    }
+    while ((status = poll(&pfd, 1, CGI_TIMEOUT * 1000)) < 0 && errno == EINTR);
+    if (status == 0) {
+        errno = ETIMEDOUT;
+    }
+    return status > 0;
+}
+
+/**
+ * Count bytes written to client socket.
+ *
+ * @param   r           Request structure.
+ * @param   n           Number of bytes written.
+ *
+ * The first write of a traced request marks its first byte (the FIRST_BYTE
+ * probe fires on every write).
+ **/
+static void transmit_count(Request *r, size_t n) {
+    r->sent += n;
+    trace_mark(FIRST_BYTE);
+}
+
+/**
+ * Check whether output of request must be queued rather than written.
+ *
+ * @param   r           Request structure.
+ * @return  Whether or not output is already queued (which nothing may
+ * overtake), or the socket of a deferred request was full on the last write.
+ **/
+static bool transmit_later(Request *r) {
+    return r->pending || (r->deferred && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/**
+ * Queue output of a deferred request until its socket is writable.
+ *
+ * @param   r           Request structure.
+ * @param   fd          File to send output from (duplicated), or -1 to copy
+ *                      the buffers.
+ * @param   offset      Offset of output in fd.
+ * @param   iov         Buffers to copy (if fd is -1).
+ * @param   iovcnt      Number of buffers.
+ * @param   length      Number of bytes of output.
+ * @return  Whether or not the output was queued.
+ *
+ * Queued output is counted as sent, since it is committed to the connection.
+ **/
+static bool transmit_defer(Request *r, int fd, off_t offset, const struct iovec *iov, int iovcnt, size_t length) {
+    OutputSegment *s = malloc(sizeof(OutputSegment) + (fd < 0 ? length : 0));
+    if (!s) {
+        return false;
+    }
+
+    s->next   = NULL;
+    s->fd     = -1;
+    s->offset = 0;
+    s->length = length;
+
+    if (fd >= 0) {
+        s->offset = offset;
+        s->fd     = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (s->fd < 0) {
+            free(s);
+            return false;
+        }
+    } else {
+        char *data = s->data;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(data, iov[i].iov_base, iov[i].iov_len);
+            data += iov[i].iov_len;
+        }
+    }
+
+    if (r->pending_last) {
+        r->pending_last->next = s;
+    } else {
+        r->pending = s;
+    }
+    r->pending_last = s;
+    transmit_count(r, length);
+    return true;
+}
+
+/**
+ * Remove first segment from queued output of request.
+ *
+ * @param   r           Request structure.
+ **/
+static void transmit_pop(Request *r) {
+    OutputSegment *s = r->pending;
+
+    r->pending = s->next;
+    if (!r->pending) {
+        r->pending_last = NULL;
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    free(s);
+}
+
+/**
+ * Flush buffered response headers to client socket.
+ *
+ * @param   r           Request structure.
+ * @return  Whether or not the stream was flushed.
+ **/
+static bool transmit_flush(Request *r) {
+    return fflush(r->stream) == 0;
+}
+
+/**
+ * Write buffered data of request stream to client socket.
+ *
+ * @param   cookie      Request structure.
+ * @param   buffer      Data to write.
+ * @param   size        Length of data.
+ * @return  Number of bytes written or -1 on error.
+ *
+ * The request stream is opened with fopencookie on this function (see
+ * open_request), so every
+ * byte sent through it is counted in r->sent.  All the data is written (on
+ * non-blocking sockets, EAGAIN waits for the socket to become writable, or
+ * queues the rest for deferred requests), since stdio discards its buffer
+ * after a failed write.
+ **/
+ssize_t transmit_write(void *cookie, const char *buffer, size_t size) {
+    Request *r = cookie;
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = r->pending ? -1 : write(r->fd, buffer + total, size - total);
+        if (n < 0 && transmit_later(r)) {
+            struct iovec iov = {.iov_base = (char *)buffer + total, .iov_len = size - total};
+            if (!transmit_defer(r, -1, 0, &iov, 1, size - total)) {
+                return total ? (ssize_t)total : -1;
+            }
+            return size;
+        }
+        if (n < 0) {
+            if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && transmit_wait(r))) {
+                continue;
+            }
+            return total ? (ssize_t)total : -1;
+        }
+        total   += n;
+        transmit_count(r, n);
+    }
+
+    return total;
+}
+
+/**
+ * Count bytes of responses on the connection so far.
+ *
+ * @param   r           Request structure.
+ * @return  Number of bytes written to the client socket or still buffered in
+ * the request stream.
+ **/
+size_t transmit_sent(Request *r) {
+    return r->sent + (r->stream ? __fpending(r->stream) : 0);
+}
+
+/**
+ * Copy data from file descriptor to client socket with read and write.
+ *
+ * @param   r           Request structure.
+ * @param   fd          Source file descriptor.
+ * @param   offset      Offset in file to read from with pread (advanced
+ *                      locally), or NULL to read at the file offset of fd.
+ * @param   count       Maximum number of bytes to copy.
+ * @return  Number of bytes copied or -1 on error.
+ *
+ * Last resort when neither sendfile nor splice support the source.  Once the
+ * socket of a deferred request is full, the rest of a file (read at offset)
+ * is queued by reference, and anything else is read and queued as data.
+ **/
+static ssize_t transmit_copy(Request *r, int fd, off_t *offset, size_t count) {
+    char buffer[BUFSIZ];
+    size_t total = 0;
+
+    while (total < count) {
+        size_t  wanted = count - total < sizeof(buffer) ? count - total : sizeof(buffer);
+        ssize_t nread  = offset ? pread(fd, buffer, wanted, *offset + total) : read(fd, buffer, wanted);
+        if (nread < 0 && (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && transmit_source(fd)))) {
+            continue;
+        }
+        if (nread <= 0) {
+            return nread < 0 ? -1 : (ssize_t)total;
+        }
+
+        for (ssize_t nwritten = 0; nwritten < nread; ) {
+            ssize_t n = r->pending ? -1 : write(r->fd, buffer + nwritten, nread - nwritten);
+            if (n < 0 && transmit_later(r)) {
+                struct iovec iov = {.iov_base = buffer + nwritten, .iov_len = nread - nwritten};
+                if (!transmit_defer(r, -1, 0, &iov, 1, nread - nwritten)) {
+                    return -1;
+                }
+                if (offset && count - total > (size_t)nread) {
+                    if (!transmit_defer(r, fd, *offset + total + nread, NULL, 0, count - total - nread)) {
+                        return -1;
+                    }
+                    return count;
+                }
+                break;
+            }
+            if (n < 0) {
+                if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && transmit_wait(r))) {
+                    continue;
+                }
+                return -1;
+            }
+            nwritten += n;
+            transmit_count(r, n);
+        }
+        total += nread;
+    }
+
+    return total;
+}
+
+/**
+ * Transmit data from a non-regular file descriptor (ie. pipe) with splice.
+ *
+ * @param   r           Request structure.
+ * @param   fd          Source file descriptor.
+ * @param   count       Maximum number of bytes to transmit (SIZE_MAX for
+ *                      everything until end of file).
+ * @return  Number of bytes transmitted or -1 on error (errno is ETIMEDOUT if
+ * a pipe produced nothing for CGI_TIMEOUT seconds, see transmit_source).
+ *
+ * Pipes (which may be non-blocking) are spliced directly into the socket.
+ * Any other source is spliced through an intermediate pipe so the data still
+ * never enters user space.  Buffered response headers are flushed first.
+ * Deferred requests copy the data instead, so it can be queued once the
+ * socket is full (see transmit_copy).
+ **/
+ssize_t transmit_stream(Request *r, int fd, size_t count) {
+    struct stat s;
+    int pipefds[2] = {-1, -1};
+    int source = fd;
+    size_t total = 0;
+
+    if (!transmit_flush(r)) {
+        return -1;
+    }
+
+    if (r->deferred) {
+        return transmit_copy(r, fd, NULL, count);
+    }
+
+    if (fstat(fd, &s) < 0) {
+        return -1;
+    }
+
+    if (!S_ISFIFO(s.st_mode)) {
+        if (pipe2(pipefds, O_CLOEXEC) < 0) {
+            return transmit_copy(r, fd, NULL, count);
+        }
+        source = pipefds[0];
+    }
+
+    while (total < count) {
+        size_t wanted = count - total < (1 << 20) ? count - total : (1 << 20);
+
+        /* Fill intermediate pipe from source */
+        if (source != fd) {
+            ssize_t nfilled = splice(fd, NULL, pipefds[1], NULL, wanted, SPLICE_F_MOVE);
+            if (nfilled < 0 && errno == EINTR) {
+                continue;
+            }
+            if (nfilled < 0 && total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                close(pipefds[0]);
+                close(pipefds[1]);
+                return transmit_copy(r, fd, NULL, count);
+            }
+            if (nfilled <= 0) {
+                break;
+            }
+            wanted = nfilled;
+        }
+
+        /* Drain pipe into socket */
+        size_t drained = 0;
+        while (drained < wanted) {
+            ssize_t n = splice(source, NULL, r->fd, NULL, wanted - drained, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0) {
+                if ((errno == EAGAIN || errno == EWOULDBLOCK) && source == fd && transmit_source(fd)) {
+                    continue;
+                }
+                if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && transmit_wait(r))) {
+                    continue;
+                }
+                if (total == 0 && drained == 0 && source == fd && (errno == EINVAL || errno == ENOSYS)) {
+                    return transmit_copy(r, fd, NULL, count);
+                }
+                goto fail;
+            }
+            if (n == 0) {
+                break;
+            }
+            drained += n;
+            transmit_count(r, n);
+        }
+        total += drained;
+
+        /* End of file on a pipe source */
+        if (drained < wanted) {
+            break;
+        }
+    }
+
+    if (source != fd) {
+        close(pipefds[0]);
+        close(pipefds[1]);
+    }
+    return total;
+
+fail:
+    if (source != fd) {
+        close(pipefds[0]);
+        close(pipefds[1]);
+    }
+    return -1;
+}
+
+/**
+ * Transmit memory buffers to client socket with a single writev.
+ *
+ * @param   r           Request structure.
+ * @param   iov         Array of buffers (modified to track partial writes).
+ * @param   iovcnt      Number of buffers.
+ * @return  Number of bytes transmitted or -1 on error.
+ *
+ * Anything buffered in the request stream is flushed first.  Partial writes
+ * are resumed and, on non-blocking sockets, EAGAIN waits for the socket to
+ * become writable (or queues the rest for deferred requests).
+ **/
+ssize_t transmit_iov(Request *r, struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+
+    if (!transmit_flush(r)) {
+        return -1;
+    }
+
+    while (iovcnt > 0) {
+        ssize_t n = r->pending ? -1 : writev(r->fd, iov, iovcnt);
+        if (n < 0 && transmit_later(r)) {
+            size_t length = 0;
+            for (int i = 0; i < iovcnt; i++) {
+                length += iov[i].iov_len;
+            }
+            if (!transmit_defer(r, -1, 0, iov, iovcnt, length)) {
+                return -1;
+            }
+            return total + length;
+        }
+        if (n < 0) {
+            if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && transmit_wait(r))) {
+                continue;
+            }
+            return -1;
+        }
+        total   += n;
+        transmit_count(r, n);
+
+        /* Skip fully written buffers and advance into partial one */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base  = (char *)iov->iov_base + n;
+            iov->iov_len  -= n;
+        }
+    }
+
+    return total;
+}
+
+/**
+ * Transmit part of a regular file to client socket with sendfile.
+ *
+ * @param   r           Request structure.
+ * @param   fd          Source file descriptor.
+ * @param   offset      Offset in file to start at.
+ * @param   count       Number of bytes to transmit.
+ * @return  Number of bytes transmitted or -1 on error.
+ *
+ * Buffered response headers are flushed first, then the file is sent by the
+ * kernel directly from the page cache.  Partial writes are resumed and, on
+ * non-blocking sockets, EAGAIN waits for the socket to become writable (or
+ * queues the rest of the file for deferred requests).  The file offset of fd
+ * is not changed, so it may be shared between requests.
+ * Sources that sendfile does not support fall back to pread and write (at a
+ * local offset, for the same reason).
+ **/
+ssize_t transmit_file(Request *r, int fd, off_t offset, size_t count) {
+    size_t total = 0;
+
+    if (!transmit_flush(r)) {
+        return -1;
+    }
+
+    while (total < count) {
+        ssize_t n = r->pending ? -1 : sendfile(r->fd, fd, &offset, count - total);
+        if (n < 0 && transmit_later(r)) {
+            if (!transmit_defer(r, fd, offset, NULL, 0, count - total)) {
+                return -1;
+            }
+            return count;
+        }
+        if (n < 0) {
+            if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && transmit_wait(r))) {
+                continue;
+            }
+            if (total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                return transmit_copy(r, fd, &offset, count);
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total   += n;
+        transmit_count(r, n);
+    }
+
+    return total;
+}
+
+/**
+ * Resume sending output queued for a deferred request.
+ *
+ * @param   r           Request structure.
+ * @return  1 once all queued output is sent, 0 if the socket is full again,
+ * or -1 on error.
+ *
+ * Deferred requests (see event_server) never wait for their socket: output
+ * that does not fit is queued (files by reference, anything else copied)
+ * and sent from here whenever the socket becomes writable.
+ **/
+int transmit_resume(Request *r) {
+    while (r->pending) {
+        OutputSegment *s = r->pending;
+        ssize_t n;
+
+        if (s->fd < 0) {
+            n = write(r->fd, s->data + s->offset, s->length);
+        } else {
+            off_t offset = s->offset;
+            n = sendfile(r->fd, s->fd, &offset, s->length);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                char buffer[BUFSIZ];
+                ssize_t nread = pread(s->fd, buffer, s->length < sizeof(buffer) ? s->length : sizeof(buffer), s->offset);
+                n = nread > 0 ? write(r->fd, buffer, nread) : nread;
+            }
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+
+        s->offset += n;
+        s->length -= n;
+        if (s->length == 0) {
+            transmit_pop(r);
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Discard output queued for a deferred request.
+ *
+ * @param   r           Request structure.
+ **/
+void transmit_discard(Request *r) {
+    while (r->pending) {
+        transmit_pop(r);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
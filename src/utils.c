@@ -4,70 +4,186 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 
+#include <linux/openat2.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+/* Global Variables */
+
+static int            RootFd   = -1;        /* Descriptor of RootPath */
+static pthread_once_t RootOnce = PTHREAD_ONCE_INIT;
+
 /**
  * Determine mime-type from file extension.
  *
  * @param   path        Path to file.
- * @return  An allocated string containing the mime-type of the specified file.
- *
- * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
- *
- * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
- * following format:
+ * @return  A static string containing the mime-type of the specified file.
  *
- *  <MIMETYPE>      <EXT1> <EXT2> ...
- *
- * This function simply checks the file extension version each extension for
- * each mimetype and returns the mimetype on the first match.
+ * This function finds the file's last extension (so archive.tar.gz is gzip
+ * and dots in directory names are ignored) and looks it up in the index
+ * loaded from the MimeTypesPath file at startup (see mimetypes_load).
  *
  * If no extension exists or no matching mimetype is found, then return
  * DefaultMimeType.
  *
- * This function returns an allocated string that must be free'd.
+ * The returned string must not be free'd.
  **/
-char * determine_mimetype(const char *path) {
-    char ext[256];
-    char *mimetype = NULL;
-    char *token = NULL;
-    char buffer[BUFSIZ];
-    FILE *fs = NULL;
-
-    /* Find file extension */
-    if(!strchr(path, (int)'.')) {
-        mimetype = strdup(DefaultMimeType);
-        return mimetype;
+const char * determine_mimetype(const char *path) {
+    const char *mimetype = NULL;
+
+    /* Find file extension (ignoring leading dot of hidden files) */
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+
+    const char *ext = strrchr(base, '.');
+    if (ext && ext != base) {
+        debug("File extension: %s", ext + 1);
+        mimetype = mimetypes_lookup(ext + 1);
     }
-    sprintf(ext, "%s", strchr(path, (int)'.') + 1);
-    debug("File extension: %s", ext);
 
-    /* Open MimeTypesPath file */
-    fs = fopen(MimeTypesPath, "r");
+    if (!mimetype) {
+        mimetype = DefaultMimeType;
+    }
+    debug("MIMETYPE: %s", mimetype);
 
-    /* Scan file for matching file extensions */
-    while(fgets(buffer, BUFSIZ, fs)) {
-        if(buffer[0] == '#')
+    return mimetype;
+}
+
+/**
+ * Normalize resource path of URI into a path relative to RootPath.
+ *
+ * @param   uri         Resource path of URI (without query).
+ * @param   buffer      Buffer for normalized path.
+ * @param   size        Size of buffer.
+ * @return  Whether or not the URI is valid.
+ *
+ * In a single pass, this percent-decodes the URI, drops empty and "."
+ * segments, and removes the previous segment for each "..".  The result has
+ * no leading slash, and the root itself is ".".  The URI is rejected if it
+ * does not start with a slash, climbs above the root, has an invalid escape,
+ * escapes a NUL or slash, or does not fit in the buffer.
+ **/
+bool normalize_uri(const char *uri, char *buffer, size_t size) {
+    size_t length = 0;
+
+    if (*uri != '/' || size < 2) {
+        return false;
+    }
+
+    while (*uri) {
+        if (*uri == '/') {
+            uri++;
             continue;
+        }
 
-	token = strtok(buffer, WHITESPACE);
+        /* Copy (and decode) segment after a separator */
+        size_t previous = length;
+        if (length > 0) {
+            if (length + 2 > size) {
+                return false;
+            }
+            buffer[length++] = '/';
+        }
+        size_t segment = length;
+        for (; *uri && *uri != '/'; uri++) {
+            char c = *uri;
+            if (c == '%') {
+                if (!isxdigit((unsigned char)uri[1]) || !isxdigit((unsigned char)uri[2])) {
+                    return false;
+                }
+                char hex[3] = {uri[1], uri[2], 0};
+                c    = strtol(hex, NULL, 16);
+                uri += 2;
+                if (c == '\0' || c == '/') {
+                    return false;
+                }
+            }
+            if (length + 2 > size) {
+                return false;
+            }
+            buffer[length++] = c;
+        }
 
-        while((token = strtok(0, WHITESPACE))) {
-            if(!strcmp(token, ext))
-		mimetype = strdup(buffer);
+        /* Drop "." segments and pop previous segment for ".." */
+        size_t n = length - segment;
+        if (n == 1 && buffer[segment] == '.') {
+            length = previous;
+        } else if (n == 2 && buffer[segment] == '.' && buffer[segment + 1] == '.') {
+            if (previous == 0) {
+                return false;
+            }
+            length = previous;
+            while (length > 0 && buffer[length - 1] != '/') {
+                length--;
+            }
+            length = length > 0 ? length - 1 : 0;
         }
     }
-    if(!mimetype) {
-        mimetype = strdup(DefaultMimeType);
+
+    if (length == 0) {
+        buffer[length++] = '.';
     }
-    debug("MIMETYPE: %s", mimetype);
+    buffer[length] = '\0';
+    return true;
+}
 
-    fclose(fs);
-    return mimetype;
+/**
+ * Open root directory (once per process).
+ **/
+static void open_root() {
+    RootFd = open(RootPath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * Open normalized path beneath RootPath.
+ *
+ * @param   path        Path relative to RootPath (see normalize_uri).
+ * @param   flags       Flags of open(2) (O_CLOEXEC is added).
+ * @return  File descriptor (or -1 if the path does not exist or resolves
+ * outside of RootPath).
+ *
+ * This resolves the path relative to a descriptor of RootPath with openat2
+ * and RESOLVE_BENEATH, so the kernel rejects any symlink (or "..") that leads
+ * outside of RootPath, in a single syscall.  Without openat2 (Linux < 5.6),
+ * the real path is checked against RootPath instead.
+ **/
+int open_request_path(const char *path, int flags) {
+    pthread_once(&RootOnce, open_root);
+    int fd;
+
+#ifdef SYS_openat2
+    struct open_how how = {
+        .flags   = flags | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    fd = syscall(SYS_openat2, RootFd, path, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS) {
+        return fd;
+    }
+#endif
+
+    char full[PATH_MAX];
+    if (snprintf(full, sizeof(full), "%s/%s", RootPath, path) >= (int)sizeof(full)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    char *real = realpath(full, NULL);
+    size_t rootlen = strlen(RootPath);
+    if (!real || strncmp(real, RootPath, rootlen) != 0 || (real[rootlen] != '/' && real[rootlen] != '\0')) {
+        free(real);
+        errno = EXDEV;
+        return -1;
+    }
+
+    fd = open(real, flags | O_CLOEXEC);
+    free(real);
+    return fd;
 }
 
 /**
@@ -75,23 +191,40 @@ char * determine_mimetype(const char *path) {
  *
  * @param   uri         Resource path of URI.
  * @return  An allocated string containing the full path of the resource on the
- * local filesystem.
- *
- * This function uses realpath(3) to generate the realpath of the
- * file requested in the URI.
- *
- * As a security check, if the real path does not begin with the RootPath, then
- * return NULL.
+ * local filesystem (or NULL if it does not exist under RootPath).
  *
- * Otherwise, return a newly allocated string containing the real path.  This
- * string must later be free'd.
+ * The URI is normalized (see normalize_uri), and the path is only returned if
+ * it resolves beneath RootPath (see open_request_path).  The returned path is
+ * RootPath followed by the normalized URI, so symlinks that stay beneath
+ * RootPath are not expanded.  This string must later be free'd.
  **/
 char * determine_request_path(const char *uri) {
-    char path[BUFSIZ];
-    sprintf(path, "%s%s", RootPath, uri);
-    char* absolute = realpath(path, NULL);
+    char path[PATH_MAX];
+    if (!normalize_uri(uri, path, sizeof(path))) {
+        return NULL;
+    }
+
+    int fd = open_request_path(path, O_PATH);
+    if (fd < 0) {
+        return NULL;
+    }
+    close(fd);
 
-    return absolute;
+    return request_path(path);
+}
+
+/**
+ * Join RootPath and normalized path.
+ *
+ * @param   path        Path relative to RootPath (see normalize_uri).
+ * @return  Newly allocated full path (or NULL on failure).
+ **/
+char * request_path(const char *path) {
+    char *full = NULL;
+    if (streq(path, ".")) {
+        return strdup(RootPath);
+    }
+    return asprintf(&full, "%s/%s", RootPath, path) < 0 ? NULL : full;
 }
 
 /**
@@ -108,6 +241,13 @@ const char * http_status_string(Status status) {
         "400 Bad Request",
         "404 Not Found",
         "500 Internal Server Error",
+        "431 Request Header Fields Too Large",
+        "206 Partial Content",
+        "416 Range Not Satisfiable",
+        "304 Not Modified",
+        "408 Request Timeout",
+        "501 Not Implemented",
+        "504 Gateway Timeout",
         "418 I'm A Teapot",
     };
 
@@ -124,7 +264,7 @@ const char * http_status_string(Status status) {
  * @return  Point to first whitespace character in s.
  **/
 char * skip_nonwhitespace(char *s) {
-    while(!isspace(*s)) {
+    while(*s && !isspace(*s)) {
 	s++;
     }
     return s;
@@ -0,0 +1,181 @@
+/* validators.c: HTTP Validators and Conditional Requests */
+
+#include "spidey.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* Constants */
+
+#define HTTP_DATE_FORMAT    "%a, %d %b %Y %H:%M:%S GMT"
+
+/**
+ * Render validators of file.
+ *
+ * @param   info        File information (with status of file).
+ *
+ * The entity tag is derived from the inode, size, and modification time of
+ * the file, and the Last-Modified date from its modification time, so both
+ * are rendered once when the file is resolved rather than per request.
+ **/
+void validators_init(FileInfo *info) {
+    snprintf(info->etag, sizeof(info->etag), "%jx-%jx-%jx.%lx",
+             (uintmax_t)info->st.st_ino, (uintmax_t)info->st.st_size,
+             (uintmax_t)info->st.st_mtim.tv_sec, info->st.st_mtim.tv_nsec);
+
+    struct tm tm;
+    if (!gmtime_r(&info->st.st_mtim.tv_sec, &tm) ||
+        !strftime(info->last_modified, sizeof(info->last_modified), HTTP_DATE_FORMAT, &tm)) {
+        info->last_modified[0] = '\0';
+    }
+}
+
+/**
+ * Render ETag and Last-Modified headers of file.
+ *
+ * @param   buffer      Buffer to render headers into.
+ * @param   size        Size of buffer.
+ * @param   info        File information.
+ * @param   encoding    Content encoding of representation.
+ * @return  Length of headers (like snprintf).
+ *
+ * Each encoding is a different representation of the file, so it gets its
+ * own entity tag (the file's tag with the encoding appended).
+ **/
+int validators_render(char *buffer, size_t size, const FileInfo *info, Encoding encoding) {
+    return snprintf(buffer, size, "ETag: \"%s%s%s\"\r\nLast-Modified: %s\r\n",
+                    info->etag, encoding ? "-" : "", encoding ? EncodingNames[encoding] : "",
+                    info->last_modified);
+}
+
+/**
+ * Parse HTTP date.
+ *
+ * @param   s           Date string (ie. "Sun, 06 Nov 1994 08:49:37 GMT").
+ * @param   t           Set to parsed time.
+ * @return  Whether or not the date was parsed.
+ **/
+static bool validators_date(const char *s, time_t *t) {
+    struct tm   tm  = {0};
+    const char *end = strptime(s, HTTP_DATE_FORMAT, &tm);
+    if (!end || *end) {
+        return false;
+    }
+    *t = timegm(&tm);
+    return true;
+}
+
+/**
+ * Check whether entity tag matches file.
+ *
+ * @param   tag         Entity tag (ie. "W/\"...\"" or "\"...\"").
+ * @param   length      Length of tag.
+ * @param   info        File information.
+ * @param   encoding    Content encoding of representation.
+ * @param   weak        Whether weak tags may match.
+ * @return  Whether or not the tag matches the representation.
+ **/
+static bool validators_tag(const char *tag, size_t length, const FileInfo *info, Encoding encoding, bool weak) {
+    if (length >= 2 && strncmp(tag, "W/", 2) == 0) {
+        if (!weak) {
+            return false;
+        }
+        tag    += 2;
+        length -= 2;
+    }
+
+    if (length < 2 || tag[0] != '"' || tag[length - 1] != '"') {
+        return false;
+    }
+    tag    += 1;
+    length -= 2;
+
+    size_t elength = strlen(info->etag);
+    if (length < elength || strncmp(tag, info->etag, elength) != 0) {
+        return false;
+    }
+    if (encoding == ENCODING_IDENTITY) {
+        return length == elength;
+    }
+    return tag[elength] == '-' && length == elength + 1 + strlen(EncodingNames[encoding]) &&
+           strncmp(tag + elength + 1, EncodingNames[encoding], length - elength - 1) == 0;
+}
+
+/**
+ * Check whether any entity tag in list matches file.
+ *
+ * @param   list        Comma separated entity tags (or "*").
+ * @param   info        File information.
+ * @param   encoding    Content encoding of representation.
+ * @param   weak        Whether weak tags may match.
+ * @return  Whether or not a tag matches the representation.
+ **/
+static bool validators_match(const char *list, const FileInfo *info, Encoding encoding, bool weak) {
+    for (const char *s = list; *s; ) {
+        s += strspn(s, " \t,");
+
+        size_t length = strcspn(s, " \t,");
+        if (length == 1 && *s == '*') {
+            return true;
+        }
+        if (length && validators_tag(s, length, info, encoding, weak)) {
+            return true;
+        }
+        s += length;
+    }
+    return false;
+}
+
+/**
+ * Evaluate conditional GET.
+ *
+ * @param   r           Request structure.
+ * @param   info        File information.
+ * @param   encoding    Content encoding of representation.
+ * @return  Whether or not the client's copy is current (ie. respond with
+ * 304 Not Modified).
+ *
+ * If-None-Match takes precedence over If-Modified-Since, as in RFC 7232.
+ * Entity tags are compared weakly and dates to the second.
+ **/
+bool validators_not_modified(Request *r, const FileInfo *info, Encoding encoding) {
+    const char *none_match = r->known[HEADER_IF_NONE_MATCH];
+    if (none_match) {
+        return validators_match(none_match, info, encoding, true);
+    }
+
+    const char *modified_since = r->known[HEADER_IF_MODIFIED_SINCE];
+    time_t      since;
+    if (modified_since && validators_date(modified_since, &since)) {
+        return info->st.st_mtim.tv_sec <= since;
+    }
+    return false;
+}
+
+/**
+ * Check If-Range precondition.
+ *
+ * @param   r           Request structure.
+ * @param   info        File information.
+ * @return  Whether or not the Range header should be honored.
+ *
+ * If-Range holds either an entity tag (compared strongly) or an HTTP date
+ * (which must be exactly the modification time).  The range is only honored
+ * if it still matches the file, otherwise the whole file is sent.
+ **/
+bool validators_if_range(Request *r, const FileInfo *info) {
+    const char *condition = r->known[HEADER_IF_RANGE];
+    if (!condition) {
+        return true;
+    }
+
+    if (*condition == '"' || strncmp(condition, "W/", 2) == 0) {
+        return validators_tag(condition, strlen(condition), info, ENCODING_IDENTITY, false);
+    }
+
+    time_t date;
+    return validators_date(condition, &date) && date == info->st.st_mtim.tv_sec;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */